@@ -140,10 +140,7 @@ static void insert_records(DE *structure, size_t start, size_t stop,
         } else if constexpr (std::is_same_v<PGM, DE>) {
             structure->insert_or_assign(records[i].key, records[i].value);
         } else {
-            while (!structure->insert(records[i])) {
-                psudb::progress_update((double) i / (double)(stop - start), "Insert Progress");
-                usleep(1);
-            }
+            structure->insert_blocking(records[i]);
         }
 
         if (delete_records && gsl_rng_uniform(rng) <= 
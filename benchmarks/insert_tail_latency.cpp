@@ -30,9 +30,7 @@ void insert_thread(Ext *extension, size_t n, size_t k, size_t rate) {
         TIMER_START();
         for (int64_t j=0; j<k; j++) {
             Rec r = {i+j, i+j};
-            while (!extension->insert(r)) {
-                _mm_pause();
-            }
+            extension->insert_blocking(r);
 
             //usleep(delay);
             /*
@@ -21,9 +21,7 @@ typedef de::DynamicExtension<Rec, ISAM, Q> Ext;
 void insert_thread(int64_t start, int64_t end, Ext *extension) {
     for (int64_t i=start; i<end; i++) {
             Rec r = {i, i};
-            while (!extension->insert(r)) {
-                _mm_pause();
-            }
+            extension->insert_blocking(r);
     }
 }
 
@@ -9,8 +9,18 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <functional>
+#include <immintrin.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <thread>
 #include <vector>
 
 #include "framework/interface/Scheduler.h"
@@ -21,6 +31,8 @@
 
 #include "framework/scheduling/Epoch.h"
 #include "framework/util/Configuration.h"
+#include "framework/util/NumaTopology.h"
+#include "framework/util/WatermarkController.h"
 
 namespace de {
 
@@ -46,14 +58,68 @@ private:
   typedef typename QueryType::LocalQueryBuffer BufferQuery;
   typedef typename QueryType::LocalResultType LocalResult;
   typedef typename QueryType::ResultType QueryResult;
-  
+
+  /*
+   * The local results of a preempted query for each of the shards that it
+   * had finished with. The references keep those shards alive until the
+   * query has been restarted, so they cannot be confused with new shards.
+   */
+  typedef std::vector<
+      std::pair<std::shared_ptr<ShardType>, std::vector<LocalResult>>>
+      PartialResults;
+
+  /*
+   * a tagged delete marks the one record equal to the deleted one, and so
+   * cannot remove every version of an upsert record's key
+   */
+  static_assert(!(UpsertInterface<RecordType> && D == DeletePolicy::TAGGING),
+                "upsert records require the tombstone delete policy");
 
   static constexpr size_t QUERY = 1;
   static constexpr size_t RECONSTRUCTION = 2;
 
-  struct epoch_ptr {
+  /*
+   * the reconstruction that flushes the buffer, which inserts may be
+   * waiting on, and so may be prioritized by the scheduler
+   */
+  static constexpr size_t FLUSH = 3;
+
+  /*
+   * the number of times that a query can be preempted before it will
+   * run to completion regardless, so that large queries cannot be
+   * starved by a steady stream of reconstructions
+   */
+  static constexpr size_t MAX_QUERY_RESTARTS = 3;
+
+  /*
+   * the number of slots in which threads can announce the epochs that
+   * they have pinned. Once every slot is in use, further pins are
+   * recorded in a list protected by a lock instead, which is slower,
+   * but has no limit. Each open snapshot holds a pin, so this can be
+   * reached by ordinary use.
+   */
+  static constexpr size_t READER_SLOT_CNT = 128;
+
+  /*
+   * insert throttling delays shorter than this are spun out rather than
+   * slept, as sleep_for rounds them up to the timer slack of the OS,
+   * which is typically around 50us
+   */
+  static constexpr std::chrono::nanoseconds MIN_THROTTLE_SLEEP =
+      std::chrono::microseconds(50);
+
+  struct alignas(64) reader_slot {
+    std::atomic<_Epoch *> epoch;
+  };
+
+  /*
+   * A pin held by a job, naming the slot in which it was announced, so
+   * that end_job releases that slot and no other. slot is nullptr if
+   * the pin was recorded in the overflow list instead.
+   */
+  struct epoch_pin {
     _Epoch *epoch;
-    size_t refcnt;
+    reader_slot *slot;
   };
 
 public:
@@ -72,28 +138,77 @@ public:
    * @param scale_factor The rate at which the capacity of levels 
    *        grows; should be at least 2 for reasonable performance
    *
-   * @param memory_budget Unused at this time
+   * @param memory_budget The number of bytes that may be used by the
+   *        new shards of reconstructions in progress at once, in
+   *        addition to the structure itself. Reconstructions that would
+   *        exceed it are deferred by the scheduler until enough of those
+   *        in progress have completed, while queries continue to run. 0
+   *        indicates no limit. Not enforced by SerialScheduler.
+   *        PriorityScheduler holds a small part of it back for buffer
+   *        flushes, which other reconstructions cannot use.
    *
    * @param thread_cnt The maximum number of threads available to the
    *        framework's scheduler for use in answering queries and 
    *        performing compactions and flushes, etc.
+   *
+   * @param buffer_lane_cnt The number of per-thread insert lanes to use
+   *        within the buffer. If 0, all inserts will be appended directly
+   *        to the buffer. Using roughly one lane per inserting thread
+   *        avoids contention on the buffer's tail under heavily
+   *        concurrent insert workloads.
+   *
+   * @param buffer_sorted_runs If true, the buffer will maintain sorted
+   *        runs over fixed-size blocks of its records, allowing buffer
+   *        range scans and point lookups to use binary search, and
+   *        allowing flushes to merge the runs rather than sorting the
+   *        whole buffer, at the cost of some extra work during inserts.
+   *
+   * @param buffer_max_capacity If larger than twice the high watermark,
+   *        the buffer is allowed to grow past its high watermark while a
+   *        flush is in progress, rather than rejecting inserts, until it
+   *        holds half of this many records. Any excess records are
+   *        flushed by subsequent reconstructions, and the extra memory
+   *        is released once they have been.
    */
   DynamicExtension(size_t buffer_low_watermark, size_t buffer_high_watermark,
                    size_t scale_factor, size_t memory_budget = 0,
-                   size_t thread_cnt = 16)
+                   size_t thread_cnt = 16, size_t buffer_lane_cnt = 0,
+                   bool buffer_sorted_runs = false,
+                   size_t buffer_max_capacity = 0)
       : m_scale_factor(scale_factor), m_max_delete_prop(1),
         m_sched(memory_budget, thread_cnt),
-        m_buffer(new Buffer(buffer_low_watermark, buffer_high_watermark)),
-        m_core_cnt(thread_cnt), m_next_core(0), m_epoch_cnt(0) {
+        m_buffer(new Buffer(buffer_low_watermark, buffer_high_watermark, 0,
+                            buffer_lane_cnt, buffer_sorted_runs,
+                            buffer_max_capacity)),
+        m_core_cnt(thread_cnt), m_next_core(0), m_epoch_cnt(0),
+        m_background_level(NO_LEVEL), m_background_merges(true),
+        m_pending_merge(nullptr), m_pending_flush_head(NO_HEAD),
+        m_query_fanout(std::same_as<SchedType, SerialScheduler> ? 0
+                                                                 : thread_cnt),
+        m_reader_slots(new reader_slot[READER_SLOT_CNT]()),
+        m_reclaim_requested(false), m_insert_throttle(0),
+        m_watermark_ctl(nullptr),
+        m_topology(NumaTopology::discover()),
+        m_affinity(AffinityPolicy::SCATTER) {
     if constexpr (L == LayoutPolicy::BSM) {
       assert(scale_factor == 2);
     }
 
     auto vers =
         new Structure(buffer_high_watermark, m_scale_factor, m_max_delete_prop);
-    m_current_epoch.store({new _Epoch(0, vers, m_buffer, 0), 0});
-    m_previous_epoch.store({nullptr, 0});
-    m_next_epoch.store({nullptr, 0});
+    m_current_epoch.store(new _Epoch(0, vers, m_buffer, 0));
+    m_next_epoch.store(nullptr);
+
+    /*
+     * releasing a generation of the buffer may free up room for inserts,
+     * or allow a pending flush to be installed, so wake up any threads
+     * waiting on either
+     */
+    m_buffer->set_reclaim_callback([this]() {
+      m_epoch_cv_lk.lock();
+      m_epoch_cv.notify_all();
+      m_epoch_cv_lk.unlock();
+    });
   }
 
   /**
@@ -104,18 +219,42 @@ public:
    */
   ~DynamicExtension() {
 
-    /* let any in-flight epoch transition finish */
-    await_next_epoch();
+    /*
+     * let any in-flight reconstructions finish, and then take the
+     * reconstruction flag so that no more can begin. Background
+     * reconstructions are only started by the holder of the flag, but
+     * need it to commit, so the flag can only be kept once there are
+     * none.
+     */
+    while (true) {
+      retry_pending_flush();
+
+      bool old = false;
+      if (m_background_level.load() == NO_LEVEL &&
+          m_reconstruction_scheduled.compare_exchange_strong(old, true)) {
+        if (m_background_level.load() == NO_LEVEL) {
+          break;
+        }
+        release_reconstruction_flag();
+      }
+
+      std::unique_lock<std::mutex> lk(m_epoch_cv_lk);
+      m_epoch_cv.wait_for(lk, std::chrono::milliseconds(1));
+    }
 
     /* shutdown the scheduler */
     m_sched.shutdown();
 
     /* delete all held resources */
-    delete m_next_epoch.load().epoch;
-    delete m_current_epoch.load().epoch;
-    delete m_previous_epoch.load().epoch;
+    delete m_next_epoch.load();
+    delete m_current_epoch.load();
+    for (auto epoch : m_retired_epochs) {
+      delete epoch;
+    }
+    delete[] m_reader_slots;
 
     delete m_buffer;
+    delete m_watermark_ctl;
   }
 
   /**
@@ -132,6 +271,99 @@ public:
    */
   int insert(const RecordType &rec) { return internal_append(rec, false); }
 
+  /**
+   *  Inserts a record into the index, as in insert, and places a
+   *  sequence number for it in seq on success. Passing the sequence
+   *  number to query guarantees that the query will see the record, and
+   *  every record inserted before it, regardless of which thread issues
+   *  the query. This allows a client to hand its writes off to other
+   *  clients without any further synchronization.
+   *
+   *  @param rec The record to be inserted
+   *  @param seq Set to the sequence number of the record if the insert
+   *         succeeds, and left unchanged otherwise
+   *
+   *  @return 1 on success, 0 on failure (in which case the insert should
+   *          be retried)
+   */
+  int insert(const RecordType &rec, size_t *seq) {
+    return internal_append(rec, false, seq);
+  }
+
+  /**
+   *  Inserts a record into the index. Unlike insert, if the buffer is
+   *  full, the calling thread will sleep until a flush has freed up
+   *  space in the buffer and then retry, rather than failing. If an
+   *  insert throttle has been set, the calling thread may also be
+   *  briefly delayed as the buffer approaches its high watermark (see
+   *  set_insert_throttle). The record will be immediately visible inside
+   *  the index upon the return of this function.
+   *
+   *  @param rec The record to be inserted
+   *
+   *  @return 1 once the record has been inserted
+   */
+  int insert_blocking(const RecordType &rec) {
+    return internal_append_blocking(rec, false,
+                                    std::chrono::steady_clock::time_point::max());
+  }
+
+  /**
+   *  Inserts a record into the index, blocking as in insert_blocking if
+   *  the buffer is full, but for no longer than the specified timeout.
+   *
+   *  @param rec The record to be inserted
+   *  @param timeout The maximum amount of time to wait for space in
+   *         the buffer
+   *
+   *  @return 1 on success, 0 if the timeout expired before the record
+   *          could be inserted
+   */
+  template <typename Rep, typename Period>
+  int try_insert_for(const RecordType &rec,
+                     const std::chrono::duration<Rep, Period> &timeout) {
+    return internal_append_blocking(rec, false,
+                                    std::chrono::steady_clock::now() +
+                                        timeout);
+  }
+
+  /**
+   *  Configure the throttling applied by insert_blocking and
+   *  try_insert_for. Once the buffer is past its low watermark, each
+   *  insert will be delayed by a fraction of max_delay that grows
+   *  quadratically with the buffer's progress towards its high
+   *  watermark, reaching max_delay at the high watermark. This spreads
+   *  the cost of a slow flush over many inserts, rather than having
+   *  inserts stall completely once the buffer is full. A max_delay of 0
+   *  (the default) disables throttling. Has no effect on insert. Delays
+   *  of under 50us are busy-waited, so that they are not rounded up by
+   *  the OS timer, and will occupy the inserting thread's CPU.
+   *
+   *  @param max_delay The delay applied to an insert when the buffer is
+   *         at its high watermark
+   */
+  void set_insert_throttle(std::chrono::nanoseconds max_delay) {
+    m_insert_throttle.store(max_delay.count());
+  }
+
+  /**
+   *  Inserts a batch of records into the index. The buffer space for the
+   *  batch is reserved using a single atomic operation, rather than one
+   *  per record. If the buffer's high water mark is reached part way
+   *  through the batch, only a prefix of the records will be inserted,
+   *  and the remainder should be retried once the buffer has flushed.
+   *  All inserted records will be visible within the index upon the
+   *  return of this function.
+   *
+   *  @param recs The records to be inserted
+   *
+   *  @return The number of records from the front of recs that were
+   *          inserted. Will be 0 if the buffer is full.
+   */
+  size_t insert_batch(std::span<const RecordType> recs) {
+    return internal_append_batch(recs, false);
+  }
+
   /**
    *  Erases a record from the index, according to the DeletePolicy 
    *  template parameter. Returns 1 on success and 0 on failure. The
@@ -157,34 +389,49 @@ public:
    *          found in the index, and should *not* be retried.
    */
   int erase(const RecordType &rec) {
-    // FIXME: delete tagging will require a lot of extra work to get
-    //        operating "correctly" in a concurrent environment.
-
-    /*
-     * Get a view on the buffer *first*. This will ensure a stronger
-     * ordering than simply accessing the buffer directly, but is
-     * not *strictly* necessary.
-     */
     if constexpr (D == DeletePolicy::TAGGING) {
-      static_assert(std::same_as<SchedType, SerialScheduler>,
-                    "Tagging is only supported in single-threaded operation");
+      /*
+       * A reconstruction may copy the record into a new shard before
+       * the tag is set, in which case the tag would be lost when the
+       * new version is installed. So, each delete is also logged, and
+       * the log is replayed into every new version before it is
+       * installed. Deletes are excluded while this happens, so that
+       * none can land in the old version after the replay.
+       */
+      epoch_pin pin;
+      bool deleted;
+      {
+        std::shared_lock<std::shared_mutex> lk(m_delete_lk);
+
+        /*
+         * The buffer view must come from the same epoch as the structure,
+         * or records that have just been flushed could be missed by both.
+         */
+        pin = get_active_epoch();
+        auto epoch = pin.epoch;
+        auto view = epoch->get_buffer();
 
-      auto view = m_buffer->get_buffer_view();
+        /*
+         * the buffer will take the longest amount of time, and
+         * probably has the lowest probability of having the record,
+         * so we'll check it last.
+         */
+        deleted = epoch->get_structure()->tagged_delete(rec) ||
+                  view.delete_record(rec);
 
-      auto epoch = get_active_epoch();
-      if (epoch->get_structure()->tagged_delete(rec)) {
-        end_job(epoch);
-        return 1;
+        if (deleted) {
+          std::unique_lock<std::mutex> log_lk(m_delete_log_lk);
+          m_delete_log.push_back(rec);
+        }
       }
 
-      end_job(epoch);
-
       /*
-       * the buffer will take the longest amount of time, and
-       * probably has the lowest probability of having the record,
-       * so we'll check it last.
+       * ending the job may install a pending flush, which needs
+       * m_delete_lk exclusively
        */
-      return view.delete_record(rec);
+      end_job(pin);
+
+      return deleted;
     }
 
     /*
@@ -193,10 +440,94 @@ public:
     return internal_append(rec, true);
   }
 
+  /**
+   *  A group of inserts and erases to be applied to the index as a
+   *  single unit, using write. Erases are written as tombstones, and so
+   *  can only be batched when tombstone deletes are in use.
+   */
+  class WriteBatch {
+  public:
+    /**
+     *  Add an insert of rec to the batch
+     */
+    void insert(const RecordType &rec) {
+      Wrapped<RecordType> wrec;
+      wrec.rec = rec;
+      wrec.header = 0;
+      m_records.push_back(wrec);
+    }
+
+    /**
+     *  Add an erase of rec to the batch
+     */
+    void erase(const RecordType &rec)
+      requires(D == DeletePolicy::TOMBSTONE)
+    {
+      Wrapped<RecordType> wrec;
+      wrec.rec = rec;
+      wrec.header = 0;
+      wrec.set_tombstone();
+      m_records.push_back(wrec);
+    }
+
+    size_t size() const { return m_records.size(); }
+
+    void clear() { m_records.clear(); }
+
+  private:
+    friend DynamicExtension;
+    std::vector<Wrapped<RecordType>> m_records;
+  };
+
+  /**
+   *  Applies every insert and erase within batch to the index at once. The
+   *  buffer space for the batch is reserved using a single atomic
+   *  operation, and the batch is made visible in a single step, so a
+   *  query will see either all of its records, or none of them. This
+   *  allows a record to be updated, by erasing the old version and
+   *  inserting the new one, without readers observing the gap between
+   *  the two. All of the records will be visible within the index upon
+   *  the return of this function.
+   *
+   *  @param batch The batch of records to be written. A batch that holds
+   *         more records than the buffer's high watermark can never be
+   *         written.
+   *
+   *  @return 1 on success, 0 if the buffer lacks the room for the entire
+   *          batch, in which case nothing is written and the write should
+   *          be retried
+   */
+  int write(const WriteBatch &batch) {
+    check_low_watermark();
+
+    return m_buffer->append_atomic(batch.m_records.data(),
+                                   batch.m_records.size());
+  }
+
+  /**
+   *  Applies batch to the index, as in write, and places a sequence
+   *  number for it in seq on success. A query passed the sequence number
+   *  will see the entire batch (see insert).
+   *
+   *  @param batch The batch of records to be written
+   *  @param seq Set to the sequence number of the batch if the write
+   *         succeeds, and left unchanged otherwise
+   *
+   *  @return 1 on success, 0 if the buffer lacks the room for the entire
+   *          batch
+   */
+  int write(const WriteBatch &batch, size_t *seq) {
+    check_low_watermark();
+
+    return m_buffer->append_atomic(batch.m_records.data(),
+                                   batch.m_records.size(), seq);
+  }
+
   /**
    *  Schedule the execution of a query with specified parameters and
    *  returns a future that can be used to access the results. The query
    *  is executed asynchronously.
+   *
    *  @param parms An rvalue reference to the query parameters.
    *
    *  @return A future, from which the query results can be retrieved upon
@@ -207,6 +538,112 @@ public:
     return schedule_query(std::move(parms));
   }
 
+  /**
+   *  Schedule the execution of a query, as above, that is guaranteed to
+   *  see every record written up to and including the one assigned the
+   *  sequence number min_seq. If that record has not yet been published,
+   *  the query waits for it before running.
+   *
+   *  @param parms An rvalue reference to the query parameters.
+   *  @param min_seq A sequence number returned by insert or write
+   *
+   *  @return A future, from which the query results can be retrieved upon
+   *          query completion
+   */
+  std::future<std::vector<QueryResult>>
+  query(Parameters &&parms, size_t min_seq) {
+    return schedule_query(std::move(parms), min_seq);
+  }
+
+  /**
+   *  A consistent, read-only view of the index, as of the moment that it
+   *  was created. Every query run against a snapshot sees the same set
+   *  of records, regardless of any inserts, deletes, or reconstructions
+   *  that happen in the meantime. The view is released when the snapshot
+   *  is destroyed.
+   *
+   *  Snapshots should be short-lived. The records in the buffer that
+   *  are visible to a snapshot cannot be reused until it is released,
+   *  so inserts may stall once the buffer fills. The buffer can also
+   *  only retain a limited number of older versions of its contents. If
+   *  snapshots hold on to all of them, buffer flushes are put off until
+   *  one is released, and inserts will fail (or block) once the buffer
+   *  fills in the meantime.
+   */
+  class Snapshot {
+  public:
+    Snapshot(Snapshot &&other)
+        : m_extension(std::exchange(other.m_extension, nullptr)),
+          m_pin(std::exchange(other.m_pin, {nullptr, nullptr})),
+          m_buffer(std::move(other.m_buffer)) {}
+
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    Snapshot &operator=(Snapshot &&) = delete;
+
+    ~Snapshot() {
+      if (m_extension) {
+        /*
+         * release the view first, so that end_job can install a flush
+         * that was waiting for its buffer head
+         */
+        { auto buffer = std::move(m_buffer); }
+        m_extension->end_job(m_pin);
+      }
+    }
+
+    /**
+     *  Execute a query against the snapshot. Unlike DynamicExtension's
+     *  query, this is driven by the calling thread, which blocks until
+     *  the results are available. The local queries may still be spread
+     *  across helper jobs on the scheduler, subject to the query fanout
+     *  (see set_query_fanout). Queries may be run against the same
+     *  snapshot from several threads at once.
+     *
+     *  @param parms An rvalue reference to the query parameters.
+     *
+     *  @return The results of the query
+     */
+    std::vector<QueryResult> query(Parameters &&parms) {
+      std::vector<QueryResult> output;
+      run_query(m_pin.epoch, &m_buffer, parms, output, false, m_extension);
+      return output;
+    }
+
+    /**
+     *  @return The number of records (including tagged records and
+     *          tombstones) within the snapshot
+     */
+    size_t get_record_count() {
+      return m_buffer.get_record_count() +
+             m_pin.epoch->get_structure()->get_record_count();
+    }
+
+  private:
+    friend DynamicExtension;
+
+    Snapshot(DynamicExtension *extension, epoch_pin pin)
+        : m_extension(extension), m_pin(pin),
+          m_buffer(pin.epoch->get_buffer()) {}
+
+    DynamicExtension *m_extension;
+    epoch_pin m_pin;
+
+    /*
+     * the view keeps its buffer head alive until the snapshot is
+     * destroyed
+     */
+    BufView m_buffer;
+  };
+
+  /**
+   *  Create a snapshot of the current state of the index, against which
+   *  a series of queries can be run with consistent results.
+   *
+   *  @return The new snapshot
+   */
+  Snapshot get_snapshot() { return Snapshot(this, get_active_epoch()); }
+
   /**
    *  Determine the number of records (including tagged records and 
    *  tombstones) currently within the framework. This number is used for
@@ -215,10 +652,11 @@ public:
    *  @return The number of records within the index
    */
   size_t get_record_count() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = epoch->get_buffer().get_record_count() +
              epoch->get_structure()->get_record_count();
-    end_job(epoch);
+    end_job(pin);
 
     return t;
   }
@@ -231,10 +669,11 @@ public:
    *  @return The number of tombstone records within the index
    */ 
   size_t get_tombstone_count() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = epoch->get_buffer().get_tombstone_count() +
              epoch->get_structure()->get_tombstone_count();
-    end_job(epoch);
+    end_job(pin);
 
     return t;
   }
@@ -248,9 +687,10 @@ public:
    *  @return The number of levels within the index
    */ 
   size_t get_height() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = epoch->get_structure()->get_height();
-    end_job(epoch);
+    end_job(pin);
 
     return t;
   }
@@ -266,10 +706,11 @@ public:
    *          ShardType::get_memory_usage) and the buffer by the index.
    */
   size_t get_memory_usage() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = m_buffer->get_memory_usage() +
              epoch->get_structure()->get_memory_usage();
-    end_job(epoch);
+    end_job(pin);
 
     return t;
   }
@@ -283,9 +724,10 @@ public:
    *          (as reported by ShardType::get_aux_memory_usage) by the index.
    */
   size_t get_aux_memory_usage() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = epoch->get_structure()->get_aux_memory_usage();
-    end_job(epoch);
+    end_job(pin);
 
     return t;
   }
@@ -309,7 +751,8 @@ public:
       await_next_epoch();
     }
 
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto vers = epoch->get_structure();
     std::vector<ShardType *> shards;
 
@@ -335,24 +778,39 @@ public:
       }
     }
 
-    ShardType *flattened = new ShardType(shards);
+    /* every record is merged, so no upsert tombstone has anything to shadow */
+    ShardType *flattened =
+        InternalLevel<ShardType, QueryType>::build_shard(shards, true);
 
     for (auto shard : shards) {
       delete shard;
     }
 
-    end_job(epoch);
+    end_job(pin);
     return flattened;
   }
 
   /*
    * If the current epoch is *not* the newest one, then wait for
    * the newest one to become available. Otherwise, returns immediately.
+   * A flush holds m_reconstruction_scheduled from the point at which it
+   * is scheduled until its epoch has been installed and any flush that
+   * the buffer already needs has been scheduled after it, so this also
+   * waits for the flag to be released.
    */
   void await_next_epoch() {
-    while (m_next_epoch.load().epoch != nullptr) {
+    while (m_next_epoch.load() != nullptr ||
+           m_reconstruction_scheduled.load()) {
+      retry_pending_flush();
+
+      /*
+       * m_epoch_cv is notified whenever a buffer generation is released,
+       * at which point a pending flush may be installed. The wait is
+       * bounded, as the thread releasing it may have found the flush
+       * claimed by another thread's failed attempt to install it.
+       */
       std::unique_lock<std::mutex> lk(m_epoch_cv_lk);
-      m_epoch_cv.wait(lk);
+      m_epoch_cv.wait_for(lk, std::chrono::milliseconds(1));
     }
   }
 
@@ -365,9 +823,10 @@ public:
    *  satisfied, and false if it is not.
    */
   bool validate_tombstone_proportion() {
-    auto epoch = get_active_epoch();
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
     auto t = epoch->get_structure()->validate_tombstone_proportion();
-    end_job(epoch);
+    end_job(pin);
     return t;
   }
 
@@ -377,6 +836,93 @@ public:
    */
   void print_scheduler_statistics() const { m_sched.print_statistics(); }
 
+  /**
+   * Configure the placement of the scheduler's worker threads. Worker
+   * threads are pinned to a CPU, selected according to the affinity
+   * policy, before performing a reconstruction, so that the memory of
+   * the shards that they build is placed on that CPU's NUMA node. On
+   * systems with more than one node, threads answering queries are
+   * instead pinned to a CPU on the node holding the largest level of
+   * the structure. This should be called before any records are
+   * inserted.
+   *
+   * @param policy The policy used to assign CPUs to worker threads.
+   *        AffinityPolicy::NONE disables thread pinning entirely.
+   *
+   * @param topology The NUMA topology of the system. By default, this
+   *        is read from sysfs.
+   */
+  void set_thread_affinity(AffinityPolicy policy,
+                           NumaTopology topology = NumaTopology::discover()) {
+    m_affinity = policy;
+    m_topology = std::move(topology);
+  }
+
+  /**
+   * Enables automatic adjustment of the buffer's watermarks. Following
+   * each flush, the low and high watermarks will be adjusted based on
+   * the observed insert rate and reconstruction time, so as to leave
+   * enough space between them to absorb a reconstruction without
+   * stalling inserts. The high watermark is limited to half of the
+   * buffer's physical capacity, so that the records still referenced
+   * by the old buffer head are never overwritten. This should be
+   * called before any records are inserted.
+   *
+   * @param min_lwm The smallest permissible low watermark
+   * @param max_lwm The largest permissible low watermark
+   * @param min_hwm The smallest permissible high watermark
+   */
+  void enable_adaptive_watermarks(size_t min_lwm, size_t max_lwm,
+                                  size_t min_hwm) {
+    delete m_watermark_ctl;
+    m_watermark_ctl = new WatermarkController(
+        min_lwm, max_lwm, min_hwm, m_buffer->get_capacity() / 2);
+  }
+
+  /**
+   * Get the watermarks currently used by the buffer. These are the ones
+   * that the index was created with, unless adaptive watermarks are in
+   * use, in which case they are updated following each flush.
+   *
+   * @return The buffer's (low, high) watermarks
+   */
+  std::pair<size_t, size_t> get_buffer_watermarks() {
+    return {m_buffer->get_low_watermark(), m_buffer->get_high_watermark()};
+  }
+
+  /**
+   * Enable or disable background reconstructions (enabled by default).
+   * When enabled, any reconstructions below L0 that will be needed to
+   * make room in L0 once it fills are started as soon as they are
+   * identified, and run alongside subsequent buffer flushes into L0,
+   * rather than delaying the flush that would need them. Only a flush
+   * that must itself reconstruct into the levels being rebuilt in the
+   * background will wait for it. Has no effect under the
+   * SerialScheduler, or with the BSM layout policy.
+   *
+   * @param enabled Whether background reconstructions should be used
+   */
+  void set_background_merges(bool enabled) {
+    m_background_merges.store(enabled);
+  }
+
+  /**
+   * Set the maximum number of threads across which the local queries of
+   * a single query may be spread. The local queries against the buffer
+   * and each shard are run as parallel subtasks on the scheduler, with
+   * the query's own thread taking part, and the results are then combined
+   * on the query's thread. Only queries satisfying ParallelQueryInterface
+   * are spread out in this way, and those that also set EARLY_ABORT are
+   * still run on a single thread. Defaults to the thread count of the
+   * scheduler. Has no effect under the SerialScheduler.
+   *
+   * @param max_threads The maximum number of threads per query. A value
+   *        of 0 or 1 runs every query on a single thread.
+   */
+  void set_query_fanout(size_t max_threads) {
+    m_query_fanout.store(max_threads);
+  }
+
 private:
   size_t m_scale_factor;
   double m_max_delete_prop;
@@ -388,176 +934,363 @@ private:
   std::atomic<int> m_next_core;
   std::atomic<size_t> m_epoch_cnt;
   
+  /*
+   * held by the job responsible for the next epoch transition, so that
+   * only one can be in progress at a time
+   */
   alignas(64) std::atomic<bool> m_reconstruction_scheduled;
 
-  std::atomic<epoch_ptr> m_next_epoch;
-  std::atomic<epoch_ptr> m_current_epoch;
-  std::atomic<epoch_ptr> m_previous_epoch;
+  /*
+   * the shallowest level being rebuilt by the background reconstruction,
+   * or NO_LEVEL if there is none. Foreground reconstructions may not
+   * touch this level, or any below it, until the background one commits.
+   */
+  static constexpr level_index NO_LEVEL = -1;
+  std::atomic<level_index> m_background_level;
+  std::atomic<bool> m_background_merges;
 
-  std::condition_variable m_epoch_cv;
-  std::mutex m_epoch_cv_lk;
+  /*
+   * a background reconstruction that has finished, but could not take
+   * m_reconstruction_scheduled to commit. Its commit is left to the
+   * holder of the flag, which performs it before releasing the flag.
+   */
+  std::atomic<_Epoch *> m_pending_merge;
+
+  /*
+   * the new buffer head of a flush that has been applied to m_next_epoch,
+   * but could not yet be installed, as every generation of the buffer
+   * was still referenced, or NO_HEAD if there is none. The flush keeps
+   * m_reconstruction_scheduled until it is installed by
+   * retry_pending_flush.
+   */
+  static constexpr size_t NO_HEAD = SIZE_MAX;
+  std::atomic<size_t> m_pending_flush_head;
+
+  /* the maximum number of threads used by a single query */
+  std::atomic<size_t> m_query_fanout;
+
+  std::atomic<_Epoch *> m_next_epoch;
+  std::atomic<_Epoch *> m_current_epoch;
+
+  /*
+   * Each job announces the epoch that it is using in one of these
+   * slots, which it holds until the job ends. An epoch cannot be freed
+   * while it appears in any slot. Threads start searching for a free
+   * slot at their own index, so that in the common case pinning and
+   * unpinning an epoch only touches a cache line local to the thread.
+   */
+  reader_slot *m_reader_slots;
 
+  /* epochs pinned while every reader slot was in use */
+  std::vector<_Epoch *> m_overflow_pins;
+  std::mutex m_overflow_lk;
+
+  /*
+   * epochs that have been replaced, but may still be pinned by running
+   * jobs. These are freed lazily, once no slot refers to them.
+   */
+  std::vector<_Epoch *> m_retired_epochs;
+  std::mutex m_retire_lk;
 
+  /* set when the retired epochs should be scanned again */
+  std::atomic<bool> m_reclaim_requested;
 
+  /*
+   * also used to wake up threads blocked on a full buffer, as room is
+   * only freed up when the buffer head advances during an epoch
+   * transition, or when an older generation of the buffer is released
+   */
+  std::condition_variable m_epoch_cv;
+  std::mutex m_epoch_cv_lk;
 
-  void enforce_delete_invariant(_Epoch *epoch) {
-    auto structure = epoch->get_structure();
-    auto compactions = structure->get_compaction_tasks();
+  /*
+   * tagged deletes performed since the oldest version still being
+   * rebuilt was copied, to be replayed into it before it is installed
+   */
+  std::vector<RecordType> m_delete_log;
+  std::mutex m_delete_log_lk;
+  std::shared_mutex m_delete_lk;
 
-    while (compactions.size() > 0) {
+  /* the maximum throttling delay for blocking inserts, in nanoseconds */
+  std::atomic<int64_t> m_insert_throttle;
 
-      /* schedule a compaction */
-      ReconstructionArgs<ShardType, QueryType, L> *args =
-          new ReconstructionArgs<ShardType, QueryType, L>();
-      args->epoch = epoch;
-      args->merges = compactions;
-      args->extension = this;
-      args->compaction = true;
-      /* NOTE: args is deleted by the reconstruction job, so shouldn't be freed
-       * here */
+  WatermarkController *m_watermark_ctl;
 
-      auto wait = args->result.get_future();
+  NumaTopology m_topology;
+  AffinityPolicy m_affinity;
 
-      m_sched.schedule_job(reconstruction, 0, args, RECONSTRUCTION);
+  /*
+   * Pin the current epoch, and return the pin. The epoch will not be
+   * freed until the pin is released again using end_job.
+   */
+  epoch_pin get_active_epoch() {
+    auto slot_ptr = claim_reader_slot();
+    if (!slot_ptr) {
+      return {pin_overflow(), nullptr};
+    }
 
-      /* wait for compaction completion */
-      wait.get();
+    auto &slot = *slot_ptr;
 
-      /* get a new batch of compactions to perform, if needed */
-      compactions = structure->get_compaction_tasks();
+    /*
+     * The epoch may be retired, and its slots scanned, between loading
+     * it and announcing it. So, once announced, the epoch is only
+     * protected if it is still current. Otherwise, it was replaced
+     * before the announcement was visible, and the pin must be retried
+     * on the new one. The slot is only ever cleared by its owner, so
+     * it can be overwritten freely.
+     */
+    _Epoch *epoch = m_current_epoch.load();
+    slot.epoch.store(epoch);
+    for (_Epoch *cur; (cur = m_current_epoch.load()) != epoch;) {
+      epoch = cur;
+      slot.epoch.store(epoch);
     }
-  }
 
-  _Epoch *get_active_epoch() {
-    epoch_ptr old, new_ptr;
+    return {epoch, slot_ptr};
+  }
 
-    do {
-      /*
-       * during an epoch transition, a nullptr will installed in the
-       * current_epoch. At this moment, the "new" current epoch will
-       * soon be installed, but the "current" current epoch has been
-       * moved back to m_previous_epoch.
-       */
-      if (m_current_epoch.load().epoch == nullptr) {
-        old = m_previous_epoch;
-        new_ptr = {old.epoch, old.refcnt + 1};
-        if (old.epoch != nullptr &&
-            m_previous_epoch.compare_exchange_strong(old, new_ptr)) {
-          break;
-        }
-      } else {
-        old = m_current_epoch;
-        new_ptr = {old.epoch, old.refcnt + 1};
-        if (old.epoch != nullptr &&
-            m_current_epoch.compare_exchange_strong(old, new_ptr)) {
-          break;
-        }
+  /*
+   * Find a free reader slot, and claim it by marking it with a
+   * placeholder that no retired epoch can match. Returns nullptr if
+   * every slot is in use.
+   */
+  reader_slot *claim_reader_slot() {
+    _Epoch *const claimed = reinterpret_cast<_Epoch *>(m_reader_slots);
+
+    size_t id = get_reader_slot_id();
+    for (size_t i = id; i < id + READER_SLOT_CNT; i++) {
+      auto &slot = m_reader_slots[i % READER_SLOT_CNT];
+      _Epoch *expected = nullptr;
+      if (slot.epoch.load(std::memory_order_relaxed) == nullptr &&
+          slot.epoch.compare_exchange_strong(expected, claimed)) {
+        return &slot;
       }
-    } while (true);
-
-    assert(new_ptr.refcnt > 0);
+    }
 
-    return new_ptr.epoch;
+    return nullptr;
   }
 
-  void advance_epoch(size_t buffer_head) {
+  /*
+   * Pin the current epoch in the overflow list, for use when there are
+   * no free reader slots. Epochs are only freed after checking the list
+   * under the same lock, so the epoch loaded here cannot have been
+   * retired and freed unseen.
+   */
+  _Epoch *pin_overflow() {
+    std::unique_lock<std::mutex> lk(m_overflow_lk);
+    _Epoch *epoch = m_current_epoch.load();
+    m_overflow_pins.push_back(epoch);
 
-    retire_epoch(m_previous_epoch.load().epoch);
+    return epoch;
+  }
 
-    epoch_ptr tmp = {nullptr, 0};
-    epoch_ptr cur;
-    do {
-      cur = m_current_epoch;
-    } while (!m_current_epoch.compare_exchange_strong(cur, tmp));
-
-    m_previous_epoch.store(cur);
-
-    // FIXME: this may currently block because there isn't any
-    // query preemption yet. At this point, we'd need to either
-    // 1) wait for all queries on the old_head to finish
-    // 2) kill all queries on the old_head
-    // 3) somehow migrate all queries on the old_head to the new
-    //    version
-    while (!m_next_epoch.load().epoch->advance_buffer_head(buffer_head)) {
-      _mm_pause();
+  static size_t get_reader_slot_id() {
+    static std::atomic<size_t> next_id = 0;
+    static thread_local size_t slot_id = next_id.fetch_add(1);
+    return slot_id;
+  }
+
+  /*
+   * Returns true if epoch is pinned by any running job.
+   */
+  bool is_pinned(_Epoch *epoch) {
+    for (size_t i = 0; i < READER_SLOT_CNT; i++) {
+      if (m_reader_slots[i].epoch.load() == epoch) {
+        return true;
+      }
     }
 
-    m_current_epoch.store(m_next_epoch);
-    m_next_epoch.store({nullptr, 0});
+    std::unique_lock<std::mutex> lk(m_overflow_lk);
+    return std::find(m_overflow_pins.begin(), m_overflow_pins.end(), epoch) !=
+           m_overflow_pins.end();
+  }
 
-    /* notify any blocking threads that the new epoch is available */
-    m_epoch_cv_lk.lock();
-    m_epoch_cv.notify_all();
-    m_epoch_cv_lk.unlock();
+  /*
+   * Complete a flush by advancing the buffer head to buffer_head and
+   * installing the next epoch. The buffer can only track a limited number
+   * of heads, and each retired epoch, snapshot and running query holds on
+   * to its own until it is released. If every one is in use, the head
+   * cannot be advanced. Rather than waiting for one to be freed, which
+   * may never happen if the calling thread is the one holding them, the
+   * flush is left pending, and is installed by whichever thread next
+   * calls retry_pending_flush once a head has been released, rather
+   * than by a thread waiting for the release. In the
+   * meantime, the queries running against retired epochs are asked to
+   * restart against the current one, so that they release their heads.
+   * Queries that have already been restarted too many times will not
+   * respond, and must finish first.
+   */
+  void advance_epoch(size_t buffer_head) {
+    m_pending_flush_head.store(buffer_head);
+    if (!retry_pending_flush()) {
+      preempt_retired_epochs();
+    }
   }
 
   /*
-   * Creates a new epoch by copying the currently active one. The new epoch's
-   * structure will be a shallow copy of the old one's.
+   * Install the pending flush, if there is one and the buffer head can
+   * now be advanced, and release m_reconstruction_scheduled on its
+   * behalf. This is called wherever a buffer head may have been released
+   * (the end of a job, or of a snapshot), and by inserts, which will fail
+   * once the buffer fills while the flush is pending. Returns true if a
+   * flush was installed.
    */
-  _Epoch *create_new_epoch() {
-    /*
-     * This epoch access is _not_ protected under the assumption that
-     * only one reconstruction will be able to trigger at a time. If that
-     * condition is violated, it is possible that this code will clone a retired
-     * epoch.
-     */
-    assert(m_next_epoch.load().epoch == nullptr);
-    auto current_epoch = get_active_epoch();
+  bool retry_pending_flush() {
+    if (m_pending_flush_head.load(std::memory_order_relaxed) == NO_HEAD) {
+      return false;
+    }
 
-    m_epoch_cnt.fetch_add(1);
-    m_next_epoch.store({current_epoch->clone(m_epoch_cnt.load()), 0});
+    size_t head = m_pending_flush_head.exchange(NO_HEAD);
+    if (head == NO_HEAD) {
+      return false;
+    }
 
-    end_job(current_epoch);
+    if (!m_next_epoch.load()->advance_buffer_head(head)) {
+      m_pending_flush_head.store(head);
+      return false;
+    }
 
-    return m_next_epoch.load().epoch;
-  }
+    install_next_epoch();
+    adjust_watermarks();
+    schedule_background_merge();
+    release_reconstruction_flag();
 
-  void retire_epoch(_Epoch *epoch) {
     /*
-     * Epochs with currently active jobs cannot
-     * be retired. By the time retire_epoch is called,
-     * it is assumed that a new epoch is active, meaning
-     * that the epoch to be retired should no longer
-     * accumulate new active jobs. Eventually, this
-     * number will hit zero and the function will
-     * proceed.
+     * inserts made while the flush ran may have refilled the buffer past
+     * the low watermark, and the flush that they attempted to schedule
+     * was turned away by the flag. Schedule it now, rather than leaving
+     * it to the next insert.
      */
+    check_low_watermark();
 
-    if (epoch == nullptr) {
-      return;
+    return true;
+  }
+
+  void preempt_retired_epochs() {
+    std::unique_lock<std::mutex> lk(m_retire_lk);
+    for (auto epoch : m_retired_epochs) {
+      epoch->request_preemption();
     }
+  }
 
-    epoch_ptr old, new_ptr;
-    new_ptr = {nullptr, 0};
-    do {
-      old = m_previous_epoch.load();
+  /*
+   * Publish the next epoch, and retire the current one without waiting.
+   */
+  void install_next_epoch() {
+    std::unique_lock<std::shared_mutex> lk(m_delete_lk, std::defer_lock);
+    if constexpr (D == DeletePolicy::TAGGING) {
+      lk.lock();
+      replay_deletes(m_next_epoch.load()->get_structure());
+    }
 
-      /*
-       * If running in single threaded mode, the failure to retire
-       * an Epoch will result in the thread of execution blocking
-       * indefinitely.
-       */
-      if constexpr (std::same_as<SchedType, SerialScheduler>) {
-        if (old.epoch == epoch)
-          assert(old.refcnt == 0);
-      }
+    auto old = m_current_epoch.exchange(m_next_epoch.load());
+    m_next_epoch.store(nullptr);
 
-      if (old.epoch == epoch && old.refcnt == 0 &&
-          m_previous_epoch.compare_exchange_strong(old, new_ptr)) {
-        break;
+    if constexpr (D == DeletePolicy::TAGGING) {
+      lk.unlock();
+    }
+
+    retire_epoch(old);
+
+    /* notify any blocking threads that the new epoch is available */
+    m_epoch_cv_lk.lock();
+    m_epoch_cv.notify_all();
+    m_epoch_cv_lk.unlock();
+  }
+
+  /*
+   * Apply every logged delete to structure. A background reconstruction
+   * may be working on a copy of the structure from before several
+   * installs, so the log is only cleared once none is running. Deleting
+   * a record that has already been deleted has no effect, so entries
+   * can safely be replayed more than once. The caller must hold
+   * m_delete_lk exclusively.
+   */
+  void replay_deletes(Structure *structure) {
+    /*
+     * records that are not found are still in the buffer, which is
+     * shared by all versions, and so are already tagged
+     */
+    for (auto &rec : m_delete_log) {
+      structure->tagged_delete(rec);
+    }
+
+    if (m_background_level.load() == NO_LEVEL) {
+      m_delete_log.clear();
+    }
+  }
+
+  /*
+   * Creates a new epoch by copying the currently active one. The new epoch's
+   * structure will be a shallow copy of the old one's.
+   */
+  _Epoch *create_new_epoch() {
+    /*
+     * This epoch access is _not_ protected under the assumption that
+     * only one reconstruction will be able to trigger at a time. If that
+     * condition is violated, it is possible that this code will clone a retired
+     * epoch.
+     */
+    assert(m_next_epoch.load() == nullptr);
+    auto pin = get_active_epoch();
+    auto current_epoch = pin.epoch;
+
+    m_epoch_cnt.fetch_add(1);
+    m_next_epoch.store(current_epoch->clone(m_epoch_cnt.load()));
+
+    end_job(pin);
+
+    return m_next_epoch.load();
+  }
+
+  /*
+   * Move an epoch that has just been replaced onto the retire list. The
+   * epoch is freed once all of the jobs that pinned it have finished, by
+   * whichever thread next reclaims retired epochs, so the caller never
+   * waits.
+   */
+  void retire_epoch(_Epoch *old) {
+    {
+      std::unique_lock<std::mutex> lk(m_retire_lk);
+      m_retired_epochs.push_back(old);
+    }
+
+    reclaim_epochs();
+  }
+
+  /*
+   * Free any retired epochs that are no longer pinned. If another thread
+   * is already doing so, this returns immediately, and that thread scans
+   * the list again once it is done. Otherwise, a pin released after
+   * that thread had checked its epoch would never be noticed, and the
+   * epoch, along with its generation of the buffer, would be held until
+   * some later job happened to reclaim it.
+   */
+  void reclaim_epochs() {
+    m_reclaim_requested.store(true);
+
+    while (m_reclaim_requested.load()) {
+      std::unique_lock<std::mutex> lk(m_retire_lk, std::try_to_lock);
+      if (!lk.owns_lock()) {
+        return;
       }
-      usleep(1);
 
-    } while (true);
+      m_reclaim_requested.store(false);
+      std::erase_if(m_retired_epochs, [this](_Epoch *epoch) {
+        if (is_pinned(epoch)) {
+          return false;
+        }
 
-    delete epoch;
+        delete epoch;
+        return true;
+      });
+    }
   }
 
   static void reconstruction(void *arguments) {
     auto args = (ReconstructionArgs<ShardType, QueryType, L> *)arguments;
 
-    ((DynamicExtension *)args->extension)->SetThreadAffinity();
+    bool pinned = ((DynamicExtension *)args->extension)->SetThreadAffinity();
     Structure *vers = args->epoch->get_structure();
 
     if constexpr (L == LayoutPolicy::BSM) {
@@ -565,10 +1298,10 @@ private:
         vers->reconstruction(args->merges[0]);
       }
     } else {
-      for (ssize_t i = 0; i < args->merges.size(); i++) {
-        vers->reconstruction(args->merges[i].target,
-                             args->merges[i].sources[0]);
-      }
+      auto extension = (DynamicExtension *)args->extension;
+      vers->reconstruction(args->merges,
+                           extension->get_reconstruction_executor(FLUSH),
+                           extension->get_reconstruction_helper_cnt() + 1);
     }
 
     /*
@@ -578,30 +1311,28 @@ private:
      * no real benefit to doing this first.
      */
     auto buffer_view = args->epoch->get_buffer();
-    size_t new_head = buffer_view.get_tail();
 
     /*
-     * if performing a compaction, don't flush the buffer, as
-     * there is no guarantee that any necessary reconstructions
-     * will free sufficient space in L0 to support a flush
+     * the reconstructions were planned around a flush of at most HWM
+     * records, but a growable buffer may hold more than this. Any records
+     * past that point will be left for the next flush.
      */
-    if (!args->compaction) {
-      vers->flush_buffer(std::move(buffer_view));
-    }
+    buffer_view.limit_record_count(
+        ((DynamicExtension *)args->extension)->m_buffer->get_high_watermark());
+    size_t new_head = buffer_view.get_tail();
 
-    args->result.set_value(true);
+    vers->flush_buffer(std::move(buffer_view));
 
-    /*
-     * Compactions occur on an epoch _before_ it becomes active,
-     * and as a result the active epoch should _not_ be advanced as
-     * part of a compaction
-     */
-    if (!args->compaction) {
-      ((DynamicExtension *)args->extension)->advance_epoch(new_head);
+    /* later jobs run by this worker should not inherit the flush's CPU */
+    if (pinned) {
+      ((DynamicExtension *)args->extension)->RestoreThreadAffinity();
     }
 
-    ((DynamicExtension *)args->extension)
-        ->m_reconstruction_scheduled.store(false);
+    /*
+     * the flush releases the reconstruction flag once it has been
+     * installed, which may happen later, on another thread
+     */
+    ((DynamicExtension *)args->extension)->advance_epoch(new_head);
 
     delete args;
   }
@@ -610,65 +1341,213 @@ private:
     auto *args = 
       (QueryArgs<ShardType, QueryType, DynamicExtension> *) arguments;
 
-    auto epoch = args->extension->get_active_epoch();
+    /*
+     * If the epoch that the query is running against is preempted, the
+     * query is restarted against the newest epoch. Records may have moved
+     * between shards in the meantime, so the local results of the shards
+     * that have already been visited are only reused for those shards
+     * that are still present in the new epoch, and only by queries that
+     * allow it (see ReusableQueryInterface).
+     */
+    auto extension = args->extension;
+    std::vector<QueryResult> output;
+    PartialResults partial;
+    for (size_t attempt = 0;;) {
+      auto pin = extension->get_active_epoch();
+      auto epoch = pin.epoch;
+      bool repinned = extension->SetQueryThreadAffinity(epoch->get_structure());
+
+      /*
+       * Records are published in the order in which their slots were
+       * reserved, so a view whose tail has reached min_seq contains the
+       * record it was assigned to, and every one written before it. If
+       * the view falls short, the query is not run, and the epoch is
+       * re-pinned once the writers have caught up.
+       */
+      bool complete = false;
+      bool ready;
+      {
+        auto buffer = epoch->get_buffer();
+        ready = buffer.get_tail() >= args->min_seq;
+        if (ready) {
+          complete = run_query(epoch, &buffer, args->query_parms, output,
+                               attempt < MAX_QUERY_RESTARTS, extension,
+                               &partial);
+        }
+
+        /* the buffer view is released here, freeing up its buffer head */
+      }
+
+      /* officially end the query job, releasing the pin on the epoch */
+      extension->end_job(pin);
+
+      /* later jobs run by this worker should not inherit the query's CPU */
+      if (repinned) {
+        extension->RestoreThreadAffinity();
+      }
+
+      if (complete) {
+        break;
+      }
+
+      if (ready) {
+        attempt++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+
+    /* return the output vector to caller via the future */
+    args->result_set.set_value(std::move(output));
 
-    auto buffer = epoch->get_buffer();
+    delete args;
+  }
+
+  /*
+   * Run a query against epoch and a view of the buffer from it, placing
+   * the results in output. If preemptible is true and the epoch is
+   * preempted before the query completes, returns false, and the
+   * contents of output are unspecified. The original parameters are left
+   * unchanged, so that the query can be restarted.
+   *
+   * If extension is provided, the local queries may be run in parallel,
+   * using subtasks scheduled on its scheduler.
+   *
+   * If partial is provided, the local results that it holds are used in
+   * place of running the local queries of shards that are still present,
+   * and it is then cleared. If the query is preempted, the local results
+   * that were completed are placed back in it. This only applies to
+   * queries satisfying ReusableQueryInterface, and only to the first
+   * pass of a query that repeats.
+   */
+  static bool run_query(_Epoch *epoch, BufView *buffer,
+                        const Parameters &query_parms,
+                        std::vector<QueryResult> &output, bool preemptible,
+                        DynamicExtension *extension = nullptr,
+                        PartialResults *partial = nullptr) {
     auto vers = epoch->get_structure();
-    auto *parms = &(args->query_parms);
+    Parameters parms = query_parms;
+    bool preempted = false;
+    output.clear();
 
     /* create initial buffer query */
-    auto buffer_query = QueryType::local_preproc_buffer(&buffer, parms);
+    auto buffer_query = QueryType::local_preproc_buffer(buffer, &parms);
 
     /* create initial local queries */
     std::vector<std::pair<ShardID, ShardType *>> shards;
     std::vector<LocalQuery *> local_queries =
-        vers->get_local_queries(shards, parms);
+        vers->get_local_queries(shards, &parms);
 
     /* process local/buffer queries to create the final version */
-    QueryType::distribute_query(parms, local_queries, buffer_query);
+    QueryType::distribute_query(&parms, local_queries, buffer_query);
+
+    if constexpr (!ReusableQueryInterface<QueryType>) {
+      partial = nullptr;
+    }
 
     /* execute the local/buffer queries and combine the results into output */
-    std::vector<QueryResult> output;
+    bool first_pass = true;
     do {
       std::vector<std::vector<LocalResult>>
           query_results(shards.size() + 1);
-      for (size_t i = 0; i < query_results.size(); i++) {
-        std::vector<LocalResult> local_results;
-        ShardID shid;
+      std::vector<char> finished(query_results.size(), false);
+
+      if (partial && first_pass) {
+        for (auto &[shard, results] : *partial) {
+          for (size_t i = 0; i < shards.size(); i++) {
+            if (shards[i].second == shard.get()) {
+              query_results[i + 1] = std::move(results);
+              finished[i + 1] = true;
+              break;
+            }
+          }
+        }
 
-        if (i == 0) { /* execute buffer query */
-          local_results = QueryType::local_query_buffer(buffer_query);
-          shid = INVALID_SHID;
+        partial->clear();
+      }
+
+      auto run_local_query = [&](size_t i) {
+        if (finished[i]) { /* reused from a preempted run */
+          return;
+        } else if (i == 0) { /* execute buffer query */
+          query_results[i] = QueryType::local_query_buffer(buffer_query);
         } else { /*execute local queries */
-          local_results = QueryType::local_query(shards[i - 1].second,
-                                                 local_queries[i - 1]);
-          shid = shards[i - 1].first;
+          query_results[i] = QueryType::local_query(shards[i - 1].second,
+                                                    local_queries[i - 1]);
         }
 
-        /* framework-level, automatic delete filtering */
-        query_results[i] = std::move(local_results);
+        finished[i] = true;
+      };
+
+      /*
+       * EARLY_ABORT queries must visit the local queries in order, and
+       * stop at the first to produce a result, so they are never run in
+       * parallel, and nor are queries that have not opted in
+       */
+      size_t fanout = 0;
+      if constexpr (ParallelQueryInterface<QueryType> &&
+                    !QueryType::EARLY_ABORT) {
+        fanout = (extension) ? extension->m_query_fanout.load() : 0;
+      }
 
-        /* end query early if EARLY_ABORT is set and a result exists */
-        if constexpr (QueryType::EARLY_ABORT) {
-          if (query_results[i].size() > 0)
+      if (fanout > 1 && query_results.size() > 1) {
+        std::atomic<bool> stop = false;
+        parallel_for(
+            extension, std::min(fanout, query_results.size()) - 1,
+            query_results.size(), [&](size_t i) {
+              if (stop.load(std::memory_order_relaxed) ||
+                  (preemptible && epoch->is_preempted())) {
+                stop.store(true, std::memory_order_relaxed);
+                return;
+              }
+
+              run_local_query(i);
+            });
+        preempted = stop.load();
+      } else {
+        for (size_t i = 0; i < query_results.size(); i++) {
+          if (preemptible && epoch->is_preempted()) {
+            preempted = true;
             break;
+          }
+
+          run_local_query(i);
+
+          /* end query early if EARLY_ABORT is set and a result exists */
+          if constexpr (QueryType::EARLY_ABORT) {
+            if (query_results[i].size() > 0)
+              break;
+          }
         }
       }
 
+      if (preempted) {
+        /*
+         * the restart takes a new view of the buffer, so its results are
+         * always dropped
+         */
+        if (partial && first_pass) {
+          for (size_t i = 1; i < query_results.size(); i++) {
+            if (finished[i]) {
+              partial->push_back({vers->get_shard_ptr(shards[i - 1].first),
+                                  std::move(query_results[i])});
+            }
+          }
+        }
+
+        break;
+      }
+
+      first_pass = false;
+
       /*
        * combine the results of the local queries, also translating
        * from LocalResultType to ResultType
        */
-      QueryType::combine(query_results, parms, output);
+      QueryType::combine(query_results, &parms, output);
 
       /* optionally repeat the local queries if necessary */
-    } while (QueryType::repeat(parms, output, local_queries, buffer_query));
-
-    /* return the output vector to caller via the future */
-    args->result_set.set_value(std::move(output));
-
-    /* officially end the query job, releasing the pin on the epoch */
-    args->extension->end_job(epoch);
+    } while (QueryType::repeat(&parms, output, local_queries, buffer_query));
 
     /* clean up memory allocated for temporary query objects */
     delete buffer_query;
@@ -676,10 +1555,151 @@ private:
       delete local_queries[i];
     }
 
-    delete args;
+    return !preempted;
+  }
+
+  /*
+   * The state shared between the calling thread and the subtasks of a
+   * parallel_for. It is owned jointly, as subtasks may not begin to run
+   * until the loop has already been completed by other threads.
+   */
+  struct ParallelForState {
+    std::function<void(size_t)> work;
+    size_t cnt;
+    std::atomic<size_t> next;
+    std::atomic<size_t> done;
+    std::mutex lk;
+    std::condition_variable cv;
+
+    /* the subtasks that may still be scheduled, and how to schedule them */
+    std::atomic<size_t> helpers;
+    DynamicExtension *extension;
+    size_t type;
+
+    /*
+     * Claim and run iterations until there are none left. Returns once
+     * this thread can claim no more, which may be before the others that
+     * have been claimed are complete.
+     */
+    void run() {
+      size_t i;
+      while ((i = next.fetch_add(1)) < cnt) {
+        work(i);
+
+        if (done.fetch_add(1) + 1 == cnt) {
+          std::unique_lock<std::mutex> l(lk);
+          cv.notify_all();
+        }
+      }
+    }
+  };
+
+  /*
+   * Run work(i) for each i in [0, cnt), using the calling thread and up
+   * to helper_cnt subtasks scheduled by extension, but never more than
+   * cnt - 1. Iterations are claimed dynamically, and the calling thread
+   * takes part, so the loop completes even if none of the subtasks are
+   * able to start. Returns once every iteration has completed. The
+   * subtasks are scheduled as jobs of the given type.
+   */
+  static void parallel_for(DynamicExtension *extension, size_t helper_cnt,
+                           size_t cnt, std::function<void(size_t)> work,
+                           size_t type = QUERY) {
+    auto state = std::make_shared<ParallelForState>();
+    state->work = std::move(work);
+    state->cnt = cnt;
+    state->next.store(0);
+    state->done.store(0);
+    state->helpers.store(std::min(helper_cnt, (cnt > 0) ? cnt - 1 : 0));
+    state->extension = extension;
+    state->type = type;
+
+    schedule_helper(state);
+    state->run();
+
+    std::unique_lock<std::mutex> l(state->lk);
+    state->cv.wait(l, [&] { return state->done.load() == cnt; });
+  }
+
+  /*
+   * Schedule another subtask for the loop described by state, if there
+   * are any left to schedule and iterations left to claim. Each subtask
+   * schedules the next one as it starts, rather than all of them being
+   * scheduled up front, so that subtasks are only queued while there is
+   * still work for them. At most one will find the loop complete by the
+   * time that it runs, in which case it returns immediately.
+   */
+  static void schedule_helper(std::shared_ptr<ParallelForState> &state) {
+    size_t remaining = state->helpers.load();
+    do {
+      if (remaining == 0 || state->next.load() >= state->cnt) {
+        return;
+      }
+    } while (!state->helpers.compare_exchange_weak(remaining, remaining - 1));
+
+    /* the job holds its own reference to the state, freed when it ends */
+    auto ref = new std::shared_ptr<ParallelForState>(state);
+    state->extension->m_sched.schedule_job(
+        [](void *args) {
+          auto ref = (std::shared_ptr<ParallelForState> *)args;
+          schedule_helper(*ref);
+          (*ref)->run();
+          delete ref;
+        },
+        0, ref, state->type);
+  }
+
+  /*
+   * Returns a function to run the independent parts of a reconstruction
+   * (its shard builds, and the parts of a large merge) across up to one
+   * thread per core, as subtasks of the calling reconstruction. The
+   * subtasks are scheduled with the reconstruction's own job type, so
+   * that they are prioritized along with it. They are not sized, as
+   * their memory is already counted in the reconstruction's footprint.
+   * The reconstruction itself takes part, so it does not depend upon
+   * them to make progress.
+   */
+  auto get_reconstruction_executor(size_t type) {
+    return [this, type](size_t cnt, std::function<void(size_t)> work) {
+      parallel_for(this, get_reconstruction_helper_cnt(), cnt,
+                   std::move(work), type);
+    };
+  }
+
+  size_t get_reconstruction_helper_cnt() {
+    if constexpr (std::same_as<SchedType, SerialScheduler>) {
+      return 0;
+    } else {
+      return (m_core_cnt > 0) ? m_core_cnt - 1 : 0;
+    }
   }
 
   void schedule_reconstruction() {
+    /*
+     * if the flush would need to reconstruct levels that are being
+     * rebuilt in the background, it must wait for that to commit. The
+     * commit will retry the flush.
+     */
+    level_index background_level = m_background_level.load();
+    if (background_level != NO_LEVEL) {
+      auto pin = get_active_epoch();
+      auto epoch = pin.epoch;
+      auto merges = epoch->get_structure()->get_reconstruction_tasks(
+          m_buffer->get_high_watermark());
+      end_job(pin);
+
+      for (size_t i = 0; i < merges.size(); i++) {
+        if (merges[i].target >= background_level) {
+          release_reconstruction_flag();
+          return;
+        }
+      }
+    }
+
+    if (m_watermark_ctl) {
+      m_watermark_ctl->reconstruction_scheduled(m_buffer->get_tail());
+    }
+
     auto epoch = create_new_epoch();
 
     ReconstructionArgs<ShardType, QueryType, L> *args =
@@ -688,19 +1708,158 @@ private:
     args->merges = epoch->get_structure()->get_reconstruction_tasks(
         m_buffer->get_high_watermark());
     args->extension = this;
-    args->compaction = false;
     /* NOTE: args is deleted by the reconstruction job, so shouldn't be freed
      * here */
 
-    m_sched.schedule_job(reconstruction, 0, args, RECONSTRUCTION);
+    size_t footprint = get_reconstruction_footprint(
+        args->merges, m_buffer->get_high_watermark());
+    m_sched.schedule_job(reconstruction, footprint, args, FLUSH);
+  }
+
+  /*
+   * Estimate the memory used by the new shards built by the reconstructions
+   * in merges, and by a flush of buffer_reccnt records alongside them. The
+   * shards being replaced remain in use until the new ones are installed,
+   * so this memory is needed in addition to that of the structure.
+   */
+  static size_t get_reconstruction_footprint(ReconstructionVector &merges,
+                                             size_t buffer_reccnt = 0) {
+    return (merges.get_total_reccnt() + buffer_reccnt) *
+           sizeof(Wrapped<RecordType>);
+  }
+
+  /*
+   * Start a background reconstruction of the levels below L0, if any will
+   * be needed to make room in L0 once it fills. The reconstruction is
+   * performed on a private copy of the structure. This must only be
+   * called while holding m_reconstruction_scheduled, so that the current
+   * epoch is stable.
+   */
+  void schedule_background_merge() {
+    if constexpr (std::same_as<SchedType, SerialScheduler>) {
+      return;
+    }
+
+    if (!m_background_merges.load() ||
+        m_background_level.load() != NO_LEVEL) {
+      return;
+    }
+
+    auto pin = get_active_epoch();
+    auto epoch = pin.epoch;
+    auto merges = epoch->get_structure()->get_background_reconstruction_tasks();
+    if (merges.size() == 0) {
+      end_job(pin);
+      return;
+    }
+
+    /* the tasks are ordered from the deepest level upwards */
+    m_background_level.store(merges[merges.size() - 1].sources[0]);
+
+    ReconstructionArgs<ShardType, QueryType, L> *args =
+        new ReconstructionArgs<ShardType, QueryType, L>();
+    args->epoch = new _Epoch(epoch->get_epoch_number(),
+                             epoch->get_structure()->copy(), nullptr, 0);
+    args->merges = merges;
+    args->extension = this;
+    end_job(pin);
+
+    m_sched.schedule_job(background_reconstruction,
+                         get_reconstruction_footprint(args->merges), args,
+                         RECONSTRUCTION);
+  }
+
+  static void background_reconstruction(void *arguments) {
+    auto args = (ReconstructionArgs<ShardType, QueryType, L> *)arguments;
+    auto extension = (DynamicExtension *)args->extension;
+
+    bool pinned = extension->SetThreadAffinity();
+    Structure *vers = args->epoch->get_structure();
+
+    /* BSM never produces background tasks, nor supports parallel builds */
+    if constexpr (L != LayoutPolicy::BSM) {
+      vers->reconstruction(
+          args->merges, extension->get_reconstruction_executor(RECONSTRUCTION),
+          extension->get_reconstruction_helper_cnt() + 1);
+    }
+
+    if (pinned) {
+      extension->RestoreThreadAffinity();
+    }
+
+    /*
+     * the commit needs m_reconstruction_scheduled, which may be held by a
+     * flush that has yet to run. Rather than occupying this worker while
+     * waiting for it, the commit is handed off to whichever thread holds
+     * the flag, and the job ends here.
+     */
+    extension->m_pending_merge.store(args->epoch);
+    extension->try_commit_background_merge();
+
+    delete args;
+  }
+
+  /*
+   * Commit the pending background reconstruction, if there is one and
+   * m_reconstruction_scheduled can be taken. Otherwise, the current
+   * holder of the flag will commit it when releasing the flag.
+   */
+  void try_commit_background_merge() {
+    while (m_pending_merge.load() != nullptr) {
+      bool old = false;
+      if (!m_reconstruction_scheduled.compare_exchange_strong(old, true)) {
+        return;
+      }
+
+      _Epoch *merged = m_pending_merge.exchange(nullptr);
+      if (merged) {
+        commit_background_merge(merged);
+      }
+
+      m_reconstruction_scheduled.store(false);
+
+      /* retry any flush that was held back by the background reconstruction */
+      if (merged) {
+        check_low_watermark();
+      }
+    }
+  }
+
+  /*
+   * Release m_reconstruction_scheduled. A background reconstruction may
+   * have finished while it was held, and left its commit to the holder,
+   * so this must be used instead of clearing the flag directly.
+   */
+  void release_reconstruction_flag() {
+    m_reconstruction_scheduled.store(false);
+    try_commit_background_merge();
+  }
+
+  /*
+   * Install the levels rebuilt by a background reconstruction into a new
+   * epoch, and free merged. Foreground reconstructions have not touched
+   * these levels in the meantime, so the rest of the structure can be
+   * taken from the current epoch. The caller must hold
+   * m_reconstruction_scheduled.
+   */
+  void commit_background_merge(_Epoch *merged) {
+    auto epoch = create_new_epoch();
+    epoch->get_structure()->install_levels(merged->get_structure(),
+                                           m_background_level.load());
+    m_background_level.store(NO_LEVEL);
+    install_next_epoch();
+    delete merged;
+
+    schedule_background_merge();
   }
 
   std::future<std::vector<QueryResult>>
-  schedule_query(Parameters &&query_parms) {
+  schedule_query(Parameters &&query_parms, size_t min_seq = 0) {
     auto args =
         new QueryArgs<ShardType, QueryType, DynamicExtension>();
     args->extension = this;
     args->query_parms = std::move(query_parms);
+    args->min_seq = min_seq;
     auto result = args->result_set.get_future();
 
     m_sched.schedule_job(async_query, 0, (void *)args, QUERY);
@@ -708,88 +1867,291 @@ private:
     return result;
   }
 
-  int internal_append(const RecordType &rec, bool ts) {
+  /*
+   * Apply the watermarks selected by the watermark controller, if there
+   * is one. This is only called once a flush has been installed, prior to
+   * the reconstruction flag being cleared, and so is never run
+   * concurrently with itself.
+   */
+  void adjust_watermarks() {
+    if (!m_watermark_ctl) {
+      return;
+    }
+
+    m_watermark_ctl->reconstruction_complete();
+    auto [lwm, hwm] = m_watermark_ctl->get_watermarks();
+
+    /*
+     * the buffer requires that the low watermark always be below the
+     * high one, so the order of the updates matters
+     */
+    if (hwm > m_buffer->get_high_watermark()) {
+      m_buffer->set_high_watermark(hwm);
+      m_buffer->set_low_watermark(lwm);
+    } else {
+      m_buffer->set_low_watermark(lwm);
+      m_buffer->set_high_watermark(hwm);
+    }
+  }
+
+  int internal_append(const RecordType &rec, bool ts, size_t *seq = nullptr) {
+    check_low_watermark();
+
+    /* this will fail if the HWM is reached and return 0 */
+    return m_buffer->append(rec, ts, seq);
+  }
+
+  size_t internal_append_batch(std::span<const RecordType> recs, bool ts) {
+    check_low_watermark();
+
+    /* this will only insert a prefix of recs if the HWM is reached */
+    return m_buffer->append_batch(recs.data(), recs.size(), ts);
+  }
+
+  /*
+   * Append rec to the buffer, sleeping whenever there is no room for it,
+   * until the head is advanced or older generations of the buffer are
+   * released. Returns 1 on success, or 0 if deadline passes before the
+   * record could be appended.
+   */
+  int internal_append_blocking(const RecordType &rec, bool ts,
+                               std::chrono::steady_clock::time_point deadline) {
+    throttle_append();
+
+    while (!internal_append(rec, ts)) {
+      std::unique_lock<std::mutex> lk(m_epoch_cv_lk);
+
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        return 0;
+      }
+
+      /*
+       * the head is advanced, and older generations released, before
+       * m_epoch_cv is notified under the lock, so checking for space
+       * after acquiring the lock ensures that the wakeup cannot be
+       * missed. The wait is still bounded, as a pending flush is only
+       * installed by a thread retrying it (here, through the append),
+       * and the one releasing its generation may not have managed to.
+       */
+      if (!m_buffer->can_append()) {
+        m_epoch_cv.wait_until(
+            lk, std::min(deadline, now + std::chrono::milliseconds(1)));
+      }
+    }
+
+    return 1;
+  }
+
+  void throttle_append() {
+    auto max_delay = m_insert_throttle.load(std::memory_order_relaxed);
+    if (max_delay == 0) {
+      return;
+    }
+
+    size_t lwm = m_buffer->get_low_watermark();
+    size_t hwm = m_buffer->get_high_watermark();
+    size_t reccnt = m_buffer->get_record_count();
+    if (reccnt <= lwm || hwm <= lwm) {
+      return;
+    }
+
+    double progress =
+        std::min(1.0, (double)(reccnt - lwm) / (double)(hwm - lwm));
+    auto delay =
+        std::chrono::nanoseconds((int64_t)(max_delay * progress * progress));
+
+    if (delay >= MIN_THROTTLE_SLEEP) {
+      std::this_thread::sleep_for(delay);
+      return;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + delay;
+    while (std::chrono::steady_clock::now() < deadline) {
+      _mm_pause();
+    }
+  }
+
+  void check_low_watermark() {
+    retry_pending_flush();
+
     if (m_buffer->is_at_low_watermark()) {
       auto old = false;
 
       if (m_reconstruction_scheduled.compare_exchange_strong(old, true)) {
+        /*
+         * the LWM check above may have raced with the completion of the
+         * previous reconstruction, in which case the buffer may have
+         * since been flushed. Only the holder of the flag can advance
+         * the head, so the check is reliable at this point.
+         */
+        if (!m_buffer->is_at_low_watermark()) {
+          release_reconstruction_flag();
+          return;
+        }
+
         schedule_reconstruction();
       }
     }
-
-    /* this will fail if the HWM is reached and return 0 */
-    return m_buffer->append(rec, ts);
   }
 
 #ifdef _GNU_SOURCE
-  void SetThreadAffinity() {
+  /*
+   * Pin the calling thread to the CPU selected for it by the affinity
+   * policy, if it is allowed to run there. Returns true if the thread was
+   * pinned, in which case its previous affinity must be restored with
+   * RestoreThreadAffinity once the reconstruction is complete.
+   */
+  bool SetThreadAffinity() {
     if constexpr (std::same_as<SchedType, SerialScheduler>) {
-      return;
+      return false;
+    }
+
+    if (m_affinity == AffinityPolicy::NONE) {
+      return false;
+    }
+
+    size_t idx = m_next_core.fetch_add(1) % m_core_cnt;
+    int cpu = m_topology.get_cpu(idx, m_affinity);
+
+    cpu_set_t *allowed = GetSavedAffinity();
+    if (!allowed || !CPU_ISSET(cpu, allowed)) {
+      return false;
     }
 
-    int core = m_next_core.fetch_add(1) % m_core_cnt;
     cpu_set_t mask;
     CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return ApplyAffinity(&mask, allowed);
+  }
+
+  /*
+   * Move the calling thread onto the NUMA node holding the bulk of the
+   * structure, if it isn't already there, allowing it to run on any of
+   * the node's CPUs that it could already use. Returns true if the thread
+   * was moved, in which case its previous affinity must be restored with
+   * RestoreThreadAffinity once the query is complete.
+   */
+  bool SetQueryThreadAffinity(Structure *vers) {
+    if constexpr (std::same_as<SchedType, SerialScheduler>) {
+      return false;
+    }
+
+    if (m_affinity == AffinityPolicy::NONE ||
+        m_topology.get_node_count() < 2) {
+      return false;
+    }
+
+    /* this check needs no system call, so it is made first */
+    int node = m_topology.get_node_of_cpu(vers->get_home_cpu());
+    if (node == -1 ||
+        node == m_topology.get_node_of_cpu(NumaTopology::get_current_cpu())) {
+      return false;
+    }
 
-    switch (core % 2) {
-    case 0:
-      // 0 |-> 0
-      // 2 |-> 2
-      // 4 |-> 4
-      core = core + 0;
-      break;
-    case 1:
-      // 1 |-> 28
-      // 3 |-> 30
-      // 5 |-> 32
-      core = (core - 1) + m_core_cnt;
-      break;
-    }
-    CPU_SET(core, &mask);
-    ::sched_setaffinity(0, sizeof(mask), &mask);
+    cpu_set_t *allowed = GetSavedAffinity();
+    if (!allowed) {
+      return false;
+    }
+
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int cpu : m_topology.get_node_cpus(node)) {
+      if (CPU_ISSET(cpu, allowed)) {
+        CPU_SET(cpu, &mask);
+      }
+    }
+
+    return ApplyAffinity(&mask, allowed);
+  }
+
+  void RestoreThreadAffinity() {
+    /*
+     * this can only fail if the CPUs available to the process have
+     * changed since the affinity was saved, in which case it is read
+     * again the next time that it is needed
+     */
+    if (::sched_setaffinity(0, sizeof(cpu_set_t), GetSavedAffinity()) != 0) {
+      GetSavedAffinityState().valid = false;
+    }
+  }
+
+  struct saved_affinity {
+    bool valid;
+    cpu_set_t mask;
+  };
+
+  static saved_affinity &GetSavedAffinityState() {
+    static thread_local saved_affinity saved = {false, {}};
+    return saved;
+  }
+
+  /*
+   * The affinity of the calling thread outside of the jobs that pin it.
+   * Every pin is undone when its job completes, so this is only read
+   * once per thread. Returns nullptr if it cannot be determined.
+   */
+  static cpu_set_t *GetSavedAffinity() {
+    auto &saved = GetSavedAffinityState();
+    if (!saved.valid) {
+      saved.valid =
+          ::sched_getaffinity(0, sizeof(cpu_set_t), &saved.mask) == 0;
+    }
+
+    return (saved.valid) ? &saved.mask : nullptr;
+  }
+
+  /*
+   * Restrict the calling thread to mask, unless this would leave it
+   * without a CPU, or would not change anything. Returns true if the
+   * affinity of the thread was changed.
+   */
+  static bool ApplyAffinity(cpu_set_t *mask, cpu_set_t *allowed) {
+    if (CPU_COUNT(mask) == 0 || CPU_EQUAL(mask, allowed)) {
+      return false;
+    }
+
+    return ::sched_setaffinity(0, sizeof(cpu_set_t), mask) == 0;
   }
 #else
-  void SetThreadAffinity() {}
+  bool SetThreadAffinity() { return false; }
+  bool SetQueryThreadAffinity(Structure *vers) { return false; }
+  void RestoreThreadAffinity() {}
 #endif
 
-  void end_job(_Epoch *epoch) {
-    epoch_ptr old, new_ptr;
-
-    do {
-      if (m_previous_epoch.load().epoch == epoch) {
-        old = m_previous_epoch;
-        /*
-         * This could happen if we get into the system during a
-         * transition. In this case, we can just back out and retry
-         */
-        if (old.epoch == nullptr) {
-          continue;
-        }
+  void release_overflow_pin(_Epoch *epoch) {
+    std::unique_lock<std::mutex> lk(m_overflow_lk);
+    auto pin =
+        std::find(m_overflow_pins.begin(), m_overflow_pins.end(), epoch);
+    assert(pin != m_overflow_pins.end());
 
-        assert(old.refcnt > 0);
+    m_overflow_pins.erase(pin);
+  }
 
-        new_ptr = {old.epoch, old.refcnt - 1};
-        if (m_previous_epoch.compare_exchange_strong(old, new_ptr)) {
-          break;
-        }
-      } else {
-        old = m_current_epoch;
-        /*
-         * This could happen if we get into the system during a
-         * transition. In this case, we can just back out and retry
-         */
-        if (old.epoch == nullptr) {
-          continue;
-        }
+  void end_job(epoch_pin pin) {
+    /*
+     * a slot belongs to the job that claimed it until it is cleared
+     * here. Entries in the overflow list are only counted, so any one
+     * recording the same epoch may be removed.
+     */
+    _Epoch *epoch = pin.epoch;
+    if (pin.slot) {
+      pin.slot->epoch.store(nullptr);
+    } else {
+      release_overflow_pin(epoch);
+    }
 
-        assert(old.refcnt > 0);
+    /*
+     * if the epoch has been retired, this may have been its last pin,
+     * in which case it can now be freed
+     */
+    if (epoch != m_current_epoch.load()) {
+      reclaim_epochs();
+    }
 
-        new_ptr = {old.epoch, old.refcnt - 1};
-        if (m_current_epoch.compare_exchange_strong(old, new_ptr)) {
-          break;
-        }
-      }
-    } while (true);
+    /* the job may have held the last reference to a buffer head */
+    retry_pending_flush();
   }
+
 };
 } // namespace de
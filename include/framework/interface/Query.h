@@ -133,4 +133,32 @@ concept QueryInterface = LocalResultInterface<LOCAL_RESULT> &&
    */
    /* { QUERY::SKIP_DELETE_FILTER } -> std::convertible_to<bool>; */
 };
+
+/*
+ * Queries satisfying this interface (by setting PARALLEL_LOCAL_QUERIES to
+ * True) allow the framework to run their local queries concurrently, on
+ * several threads. This is only safe if local_query and local_query_buffer
+ * share no mutable state between the local queries of a single query,
+ * which rules out sampling queries that draw from a random number
+ * generator passed in with the query parameters. Queries that do not
+ * set it always run their local queries on a single thread.
+ */
+template <typename QUERY>
+concept ParallelQueryInterface = requires {
+  requires QUERY::PARALLEL_LOCAL_QUERIES;
+};
+
+/*
+ * Queries satisfying this interface (by setting REUSABLE_LOCAL_RESULTS to
+ * True) produce local results that depend only upon the shard and the
+ * query parameters, and not upon the other shards in the structure, as
+ * they would if distribute_query divided the work between them. If such
+ * a query is preempted, the local results of the shards that it has
+ * already visited are kept, and reused for those shards that are still
+ * present in the epoch that it is restarted against.
+ */
+template <typename QUERY>
+concept ReusableQueryInterface = requires {
+  requires QUERY::REUSABLE_LOCAL_RESULTS;
+};
 } // namespace de
@@ -40,6 +40,23 @@ concept KVPInterface = RecordInterface<R> && requires(R r) {
   r.value;
 };
 
+/*
+ * Records satisfying this interface are treated as key-value pairs in
+ * which each key has at most one live value. A newer record shadows any
+ * older records with an equal key (as determined by key_equals, rather
+ * than operator==) during queries, and the older records are discarded
+ * when shards are merged, rather than requiring a tombstone for each.
+ * Likewise, a tombstone removes its key, whatever its value may be.
+ *
+ * Of the bundled queries, only rq::Query is aware of the shadowing, and
+ * the others reject these records. Shadowing also relies upon tombstones,
+ * and so these records cannot be used with the tagging delete policy.
+ */
+template <typename R>
+concept UpsertInterface = KVPInterface<R> && requires(R r, R s) {
+  { r.key_equals(s) } -> std::convertible_to<bool>;
+};
+
 template <typename R>
 concept AlexInterface = KVPInterface<R> && requires(R r) {
   { r.key } -> std::convertible_to<size_t>;
@@ -114,6 +131,23 @@ template <typename K, typename V> struct Record {
   }
 };
 
+template <typename K, typename V> struct UpsertRecord {
+  K key;
+  V value;
+
+  inline bool operator<(const UpsertRecord &other) const {
+    return key < other.key || (key == other.key && value < other.value);
+  }
+
+  inline bool operator==(const UpsertRecord &other) const {
+    return key == other.key && value == other.value;
+  }
+
+  inline bool key_equals(const UpsertRecord &other) const {
+    return key == other.key;
+  }
+};
+
 template <typename V> struct Record<const char *, V> {
   const char *key;
   V value;
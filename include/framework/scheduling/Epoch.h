@@ -29,15 +29,31 @@ private:
 public:
   Epoch(size_t number = 0)
       : m_buffer(nullptr), m_structure(nullptr), m_active_merge(false),
-        m_epoch_number(number), m_buffer_head(0) {}
+        m_preempted(false), m_epoch_number(number), m_buffer_head(0) {}
 
+  /*
+   * An epoch holds a reference to its generation of the buffer for as long
+   * as it exists, so that the generation cannot be reclaimed while the
+   * epoch may still be used to create views of it. buff may be null, for
+   * epochs that are only used to hold a structure.
+   */
   Epoch(size_t number, Structure *structure, Buffer *buff, size_t head)
       : m_buffer(buff), m_structure(structure), m_active_merge(false),
-        m_epoch_number(number), m_buffer_head(head) {
+        m_preempted(false), m_epoch_number(number), m_buffer_head(head) {
     structure->take_reference();
+
+    if (m_buffer) {
+      bool referenced = m_buffer->take_head_reference(m_buffer_head);
+      assert(referenced);
+      (void)referenced;
+    }
   }
 
   ~Epoch() {
+    if (m_buffer) {
+      m_buffer->release_head_reference(m_buffer_head);
+    }
+
     if (m_structure) {
       m_structure->release_reference();
     }
@@ -74,6 +90,10 @@ public:
     epoch->m_buffer = m_buffer;
     epoch->m_buffer_head = m_buffer_head;
 
+    if (m_buffer) {
+      m_buffer->take_head_reference(m_buffer_head);
+    }
+
     if (m_structure) {
       epoch->m_structure = m_structure->copy();
       /* the copy routine returns a structure with 0 references */
@@ -106,24 +126,45 @@ public:
     return true;
   }
 
+  /*
+   * Advance the buffer's head to head, and move this epoch's reference
+   * over to the new generation. Returns false, leaving the epoch
+   * unchanged, if the buffer cannot register another generation.
+   */
   bool advance_buffer_head(size_t head) {
+    if (!m_buffer->advance_head(head)) {
+      return false;
+    }
+
+    /* the new generation is current, and so cannot yet be reclaimed */
+    m_buffer->take_head_reference(head);
+    m_buffer->release_head_reference(m_buffer_head);
     m_buffer_head = head;
-    return m_buffer->advance_head(m_buffer_head);
+
+    return true;
   }
 
+  /*
+   * Ask any queries running against this epoch to abandon it, so that
+   * the buffer head that it references can be released. Queries check
+   * for this between local queries, and restart against the newest
+   * epoch. Once set, this is never cleared, as only retired epochs are
+   * preempted.
+   */
+  void request_preemption() {
+    m_preempted.store(true, std::memory_order_relaxed);
+  }
+
+  bool is_preempted() { return m_preempted.load(std::memory_order_relaxed); }
+
 private:
   Buffer *m_buffer;
   Structure *m_structure;
 
   std::mutex m_buffer_lock;
   std::atomic<bool> m_active_merge;
+  std::atomic<bool> m_preempted;
 
-  /*
-   * The number of currently active jobs
-   * (queries/merges) operating on this
-   * epoch. An epoch can only be retired
-   * when this number is 0.
-   */
   size_t m_epoch_number;
   size_t m_buffer_head;
 };
@@ -5,10 +5,22 @@
  *
  * Distributed under the Modified BSD License.
  *
- * This scheduler runs just concurrently, using a standard FIFO queue to
- * determine which jobs to run next. If more jobs are scheduled than there
- * are available threads, the excess will stall until a thread becomes
- * available and then run in the order they were received by the scheduler.
+ * This scheduler runs jobs concurrently, on a work-stealing thread pool.
+ * Each job is handed directly to one of the pool's workers when it is
+ * scheduled, and idle workers steal jobs from busy ones. If more jobs are
+ * scheduled than there are available threads, the excess will stall until
+ * a thread becomes available. Jobs queued on any one worker run in the
+ * order they were received, but jobs may be run slightly out of order
+ * across workers.
+ *
+ * Jobs with a non-zero size (reconstructions) are only started while the
+ * total size of those in progress fits within the memory budget. Any
+ * others are deferred, in the order they were received, until enough
+ * memory has been released by completed jobs. A job that exceeds the
+ * budget on its own is started once no other sized jobs are running.
+ * Jobs without a size (queries) are never deferred. A sized job must not
+ * block waiting on another sized job, as that job may be deferred until
+ * the memory of the first has been released.
  *
  * TODO: We need to set up a custom threadpool based on jthreads to support
  * thread preemption for a later phase of this project. That will allow us
@@ -17,19 +29,16 @@
  */
 #pragma once
 
+#include <deque>
+#include <mutex>
+#include <vector>
+
 #include "framework/scheduling/Task.h"
+#include "framework/scheduling/WorkStealingPool.h"
 #include "framework/scheduling/statistics.h"
-#include <chrono>
-#include <condition_variable>
-#include <thread>
-
-#include "ctpl/ctpl.h"
-#include "psu-ds/LockedPriorityQueue.h"
 
 namespace de {
 
-using namespace std::literals::chrono_literals;
-
 class FIFOScheduler {
 private:
   static const size_t DEFAULT_MAX_THREADS = 8;
@@ -38,86 +47,88 @@ public:
   FIFOScheduler(size_t memory_budget, size_t thread_cnt)
       : m_memory_budget((memory_budget) ? memory_budget : UINT64_MAX),
         m_thrd_cnt((thread_cnt) ? thread_cnt : DEFAULT_MAX_THREADS),
-        m_used_memory(0), m_used_thrds(0), m_shutdown(false) {
-    m_sched_thrd = std::thread(&FIFOScheduler::run, this);
-    m_sched_wakeup_thrd = std::thread(&FIFOScheduler::periodic_wakeup, this);
-    m_thrd_pool.resize(m_thrd_cnt);
-  }
+        m_counter(0), m_used_memory(0), m_thrd_pool(m_thrd_cnt) {}
 
-  ~FIFOScheduler() {
-    if (!m_shutdown.load()) {
-      shutdown();
-    }
-
-    m_sched_thrd.join();
-    m_sched_wakeup_thrd.join();
-  }
+  ~FIFOScheduler() { shutdown(); }
 
   void schedule_job(std::function<void(void *)> job, size_t size, void *args,
                     size_t type = 0) {
-    std::unique_lock<std::mutex> lk(m_cv_lock);
     size_t ts = m_counter.fetch_add(1);
-
     m_stats.job_queued(ts, type, size);
-    m_task_queue.push(Task(size, ts, job, args, type, &m_stats));
 
-    m_cv.notify_all();
-  }
+    if (size == 0) {
+      dispatch(Task(size, ts, job, args, type, &m_stats));
+      return;
+    }
+
+    /* the job's memory is released as soon as it has finished */
+    auto t = Task(
+        size, ts,
+        [this, job, size](void *args) {
+          job(args);
+          release_memory(size);
+        },
+        args, type, &m_stats);
+
+    {
+      std::unique_lock<std::mutex> lk(m_memory_lk);
+      if (m_deferred.size() > 0 || !can_admit(size)) {
+        m_deferred.push_back(t);
+        return;
+      }
 
-  void shutdown() {
-    m_shutdown.store(true);
-    m_thrd_pool.stop(true);
-    m_cv.notify_all();
+      m_used_memory += size;
+    }
+
+    dispatch(t);
   }
 
+  void shutdown() { m_thrd_pool.stop(); }
+
   void print_statistics() { m_stats.print_statistics(); }
 
 private:
-  psudb::LockedPriorityQueue<Task> m_task_queue;
-
-  [[maybe_unused]] size_t m_memory_budget;
+  size_t m_memory_budget;
   size_t m_thrd_cnt;
 
-
   std::atomic<size_t> m_counter;
-  std::mutex m_cv_lock;
-  std::condition_variable m_cv;
-
-  std::thread m_sched_thrd;
-  std::thread m_sched_wakeup_thrd;
-  ctpl::thread_pool m_thrd_pool;
 
-  std::atomic<size_t> m_used_memory;
-  std::atomic<size_t> m_used_thrds;
-
-  std::atomic<bool> m_shutdown;
+  /* the memory used by sized jobs in progress, and those awaiting memory */
+  std::mutex m_memory_lk;
+  size_t m_used_memory;
+  std::deque<Task> m_deferred;
 
   SchedulerStatistics m_stats;
 
-  void periodic_wakeup() {
-    do {
-      std::this_thread::sleep_for(10us);
-      m_cv.notify_all();
-    } while (!m_shutdown.load());
-  }
+  /* declared last, so that it is stopped before the statistics are freed */
+  WorkStealingPool m_thrd_pool;
 
-  void schedule_next() {
-    assert(m_task_queue.size() > 0);
-    auto t = m_task_queue.pop();
+  void dispatch(Task t) {
     m_stats.job_scheduled(t.m_timestamp);
+    m_thrd_pool.push(std::move(t));
+  }
 
-    m_thrd_pool.push(t);
+  /* m_memory_lk must be held */
+  bool can_admit(size_t size) {
+    return m_used_memory == 0 || m_used_memory + size <= m_memory_budget;
   }
 
-  void run() {
-    do {
-      std::unique_lock<std::mutex> cv_lock(m_cv_lock);
-      m_cv.wait(cv_lock);
+  void release_memory(size_t size) {
+    std::vector<Task> ready;
+    {
+      std::unique_lock<std::mutex> lk(m_memory_lk);
+      m_used_memory -= size;
 
-      while (m_task_queue.size() > 0 && m_thrd_pool.n_idle() > 0) {
-        schedule_next();
+      while (m_deferred.size() > 0 && can_admit(m_deferred.front().m_size)) {
+        m_used_memory += m_deferred.front().m_size;
+        ready.push_back(m_deferred.front());
+        m_deferred.pop_front();
       }
-    } while (!m_shutdown.load());
+    }
+
+    for (auto &t : ready) {
+      dispatch(t);
+    }
   }
 };
 
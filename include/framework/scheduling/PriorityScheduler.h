@@ -0,0 +1,248 @@
+/*
+ * include/framework/scheduling/PriorityScheduler.h
+ *
+ * Copyright (C) 2023-2024 Douglas B. Rumbaugh <drumbaugh@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ * This scheduler runs jobs concurrently on a work-stealing thread pool,
+ * like FIFOScheduler, but keeps a separate queue for each class of job
+ * rather than ordering every job by its arrival. A job is only handed to
+ * the pool once it is allowed to start, and the next jobs are started by
+ * the thread that schedules a job, or that finishes one, so there is no
+ * dispatcher thread. Within each class, jobs are started in the order in
+ * which they were received.
+ *
+ * There are three classes. Buffer flushes, which inserts may be waiting
+ * on, are started ahead of everything else, and a number of worker
+ * threads are reserved for them, which no other job can occupy. Other
+ * reconstructions (such as background merges) are started next, but not
+ * while a flush is waiting. Every other job is a query, and is started
+ * last. So, neither a burst of queries nor a long-running merge can
+ * delay a flush until inserts begin to fail at the high watermark.
+ *
+ * Flushes and reconstructions are only started while the total size of
+ * those in progress fits within the memory budget, which both classes
+ * share. Jobs without a size (such as the subtasks of a reconstruction)
+ * are never held back by it. A fraction of the budget is held back as headroom that only
+ * flushes may use, so that a flush can still be started while other
+ * reconstructions have taken up the rest of it. Queries continue to be
+ * started while either waits. A job that exceeds the budget on its own
+ * is started once no other sized job is running, and holds back every
+ * other flush and reconstruction until it finishes. As with
+ * FIFOScheduler, a sized job must not block waiting on another.
+ */
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "framework/scheduling/Task.h"
+#include "framework/scheduling/WorkStealingPool.h"
+#include "framework/scheduling/statistics.h"
+
+namespace de {
+
+class PriorityScheduler {
+private:
+  static const size_t DEFAULT_MAX_THREADS = 8;
+  static const size_t DEFAULT_RESERVED_THREADS = 1;
+  static constexpr double DEFAULT_FLUSH_HEADROOM = 0.1;
+
+  /*
+   * The job types used by DynamicExtension for reconstructions and
+   * buffer flushes. Jobs of any other type are scheduled as queries.
+   */
+  static const size_t RECONSTRUCTION = 2;
+  static const size_t FLUSH = 3;
+
+  enum class JobClass { FLUSH, RECONSTRUCTION, QUERY };
+
+public:
+  /*
+   * reserved_thread_cnt worker threads are kept free of queries and
+   * other reconstructions, so that they are available for flushes. At
+   * least one thread is always left available for the other classes.
+   * Likewise, flush_headroom is the fraction of the memory budget that
+   * only flushes may use.
+   */
+  PriorityScheduler(size_t memory_budget, size_t thread_cnt,
+                    size_t reserved_thread_cnt = DEFAULT_RESERVED_THREADS,
+                    double flush_headroom = DEFAULT_FLUSH_HEADROOM)
+      : m_memory_budget((memory_budget) ? memory_budget : UINT64_MAX),
+        m_flush_headroom(
+            (memory_budget)
+                ? (size_t)(memory_budget * std::clamp(flush_headroom, 0.0, 1.0))
+                : 0),
+        m_thrd_cnt((thread_cnt) ? thread_cnt : DEFAULT_MAX_THREADS),
+        m_reserved_thrds(std::min(reserved_thread_cnt, m_thrd_cnt - 1)),
+        m_counter(0), m_used_thrds(0), m_used_memory(0),
+        m_used_shared_thrds(0), m_thrd_pool(m_thrd_cnt) {}
+
+  ~PriorityScheduler() { shutdown(); }
+
+  void schedule_job(std::function<void(void *)> job, size_t size, void *args,
+                    size_t type = 0) {
+    size_t ts = m_counter.fetch_add(1);
+    m_stats.job_queued(ts, type, size);
+
+    std::vector<Task> ready;
+    {
+      std::unique_lock<std::mutex> lk(m_lk);
+      get_queue(get_class(type))
+          .push_back(Task(size, ts, job, args, type, &m_stats));
+
+      take_ready(ready);
+    }
+
+    dispatch(ready);
+  }
+
+  /*
+   * Queued jobs are still started as running ones finish, so every
+   * scheduled job is run before this returns.
+   */
+  void shutdown() { m_thrd_pool.stop(); }
+
+  void print_statistics() { m_stats.print_statistics(); }
+
+private:
+  size_t m_memory_budget;
+  size_t m_flush_headroom;
+  size_t m_thrd_cnt;
+  size_t m_reserved_thrds;
+
+  std::atomic<size_t> m_counter;
+
+  /* the jobs waiting to start, and the resources used by those running */
+  std::mutex m_lk;
+  std::deque<Task> m_flush_queue;
+  std::deque<Task> m_reconstruction_queue;
+  std::deque<Task> m_query_queue;
+  size_t m_used_thrds;
+  size_t m_used_memory;
+
+  /* the threads used by jobs other than flushes */
+  size_t m_used_shared_thrds;
+
+  SchedulerStatistics m_stats;
+
+  /* declared last, so that it is stopped before the statistics are freed */
+  WorkStealingPool m_thrd_pool;
+
+  /*
+   * Move every queued job that can start now into ready, in the order in
+   * which they should be started, and account for the resources that
+   * they will use. m_lk must be held.
+   */
+  void take_ready(std::vector<Task> &ready) {
+    while (m_used_thrds < m_thrd_cnt) {
+      bool shared_available =
+          m_used_shared_thrds < m_thrd_cnt - m_reserved_thrds;
+
+      JobClass cls;
+      if (m_flush_queue.size() > 0 &&
+          can_admit(m_flush_queue.front().m_size, JobClass::FLUSH)) {
+        cls = JobClass::FLUSH;
+      } else if (shared_available && m_flush_queue.size() == 0 &&
+                 m_reconstruction_queue.size() > 0 &&
+                 can_admit(m_reconstruction_queue.front().m_size,
+                           JobClass::RECONSTRUCTION)) {
+        cls = JobClass::RECONSTRUCTION;
+      } else if (shared_available && m_query_queue.size() > 0) {
+        cls = JobClass::QUERY;
+      } else {
+        return;
+      }
+
+      auto &queue = get_queue(cls);
+      ready.push_back(start(queue.front(), cls));
+      queue.pop_front();
+    }
+  }
+
+  /*
+   * Claim the resources for t, and return a task that runs it and then
+   * releases them again. m_lk must be held.
+   */
+  Task start(const Task &t, JobClass cls) {
+    m_used_thrds++;
+    if (cls != JobClass::FLUSH) {
+      m_used_shared_thrds++;
+    }
+
+    size_t size = (cls == JobClass::QUERY) ? 0 : t.m_size;
+    m_used_memory += size;
+
+    auto job = t.m_job;
+    return Task(
+        t.m_size, t.m_timestamp,
+        [this, job, size, cls](void *args) {
+          job(args);
+          finish(size, cls);
+        },
+        t.m_args, t.m_type, &m_stats);
+  }
+
+  /* release the resources of a finished job, and start any that can run */
+  void finish(size_t size, JobClass cls) {
+    std::vector<Task> ready;
+    {
+      std::unique_lock<std::mutex> lk(m_lk);
+      m_used_thrds--;
+      if (cls != JobClass::FLUSH) {
+        m_used_shared_thrds--;
+      }
+      m_used_memory -= size;
+
+      take_ready(ready);
+    }
+
+    dispatch(ready);
+  }
+
+  static JobClass get_class(size_t type) {
+    switch (type) {
+    case FLUSH:
+      return JobClass::FLUSH;
+    case RECONSTRUCTION:
+      return JobClass::RECONSTRUCTION;
+    default:
+      return JobClass::QUERY;
+    }
+  }
+
+  std::deque<Task> &get_queue(JobClass cls) {
+    switch (cls) {
+    case JobClass::FLUSH:
+      return m_flush_queue;
+    case JobClass::RECONSTRUCTION:
+      return m_reconstruction_queue;
+    default:
+      return m_query_queue;
+    }
+  }
+
+  void dispatch(std::vector<Task> &ready) {
+    for (auto &t : ready) {
+      m_stats.job_scheduled(t.m_timestamp);
+      m_thrd_pool.push(std::move(t));
+    }
+  }
+
+  /*
+   * Returns true if a job of class cls and size bytes fits within the
+   * memory budget, less the flush headroom for anything but a flush.
+   * m_lk must be held.
+   */
+  bool can_admit(size_t size, JobClass cls) {
+    size_t limit = (cls == JobClass::FLUSH)
+                       ? m_memory_budget
+                       : m_memory_budget - m_flush_headroom;
+    return size == 0 || m_used_memory == 0 || m_used_memory + size <= limit;
+  }
+};
+
+} // namespace de
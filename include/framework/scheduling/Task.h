@@ -29,14 +29,13 @@ struct ReconstructionArgs {
   typedef typename ShardType::RECORD RecordType;
   Epoch<ShardType, QueryType, L> *epoch;
   ReconstructionVector merges;
-  std::promise<bool> result;
-  bool compaction;
   void *extension;
 };
 
 template <ShardInterface S, QueryInterface<S> Q, typename DE> struct QueryArgs {
   std::promise<std::vector<typename Q::ResultType>> result_set;
   typename Q::Parameters query_parms;
+  size_t min_seq;
   DE *extension;
 };
 
@@ -0,0 +1,314 @@
+/*
+ * include/framework/scheduling/WorkStealingPool.h
+ *
+ * Copyright (C) 2023-2024 Douglas B. Rumbaugh <drumbaugh@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ * A thread pool in which each worker thread owns a lock-free deque of
+ * tasks, and idle workers steal tasks from the deques of the others.
+ * Tasks submitted from outside of the pool are pushed directly onto the
+ * inbox of one of the workers, chosen round-robin, so there is no
+ * dispatcher thread between the submitting thread and the worker that
+ * will run the task. Idle workers sleep on a single event counter, which
+ * is advanced whenever a task is submitted, so wakeups cannot be lost and
+ * no periodic wakeup is needed.
+ */
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "framework/scheduling/Task.h"
+
+namespace de {
+
+class WorkStealingPool {
+private:
+  struct TaskNode {
+    Task task;
+    TaskNode *next;
+  };
+
+  /*
+   * A Chase-Lev deque of tasks. Only the worker that owns the deque may
+   * push onto it, while any thread may take a task from it. Tasks are
+   * always taken from the top of the deque, and so run in the order in
+   * which they were pushed. The deque grows as needed, and the arrays
+   * that it has outgrown are retained until it is destroyed, as thieves
+   * may still be reading from them.
+   */
+  class TaskDeque {
+  private:
+    struct Array {
+      Array(size_t cap) : cap(cap), data(new std::atomic<TaskNode *>[cap]) {}
+
+      size_t cap;
+      std::unique_ptr<std::atomic<TaskNode *>[]> data;
+
+      TaskNode *get(int64_t idx) {
+        return data[idx & (cap - 1)].load(std::memory_order_relaxed);
+      }
+
+      void put(int64_t idx, TaskNode *node) {
+        data[idx & (cap - 1)].store(node, std::memory_order_relaxed);
+      }
+    };
+
+    static const size_t INITIAL_CAPACITY = 64;
+
+  public:
+    TaskDeque() : m_top(0), m_bottom(0) {
+      m_arrays.emplace_back(new Array(INITIAL_CAPACITY));
+      m_array.store(m_arrays.back().get());
+    }
+
+    void push(TaskNode *node) {
+      int64_t b = m_bottom.load(std::memory_order_relaxed);
+      int64_t t = m_top.load(std::memory_order_acquire);
+      Array *a = m_array.load(std::memory_order_relaxed);
+
+      if (b - t >= (int64_t)a->cap) {
+        a = grow(a, t, b);
+      }
+
+      a->put(b, node);
+      std::atomic_thread_fence(std::memory_order_release);
+      m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /*
+     * Returns the task at the top of the deque, or nullptr if the deque
+     * is empty or another thread took the task first
+     */
+    TaskNode *take() {
+      int64_t t = m_top.load(std::memory_order_acquire);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int64_t b = m_bottom.load(std::memory_order_acquire);
+
+      if (t >= b) {
+        return nullptr;
+      }
+
+      TaskNode *node = m_array.load(std::memory_order_acquire)->get(t);
+      if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+        return nullptr;
+      }
+
+      return node;
+    }
+
+    bool empty() {
+      return m_top.load(std::memory_order_acquire) >=
+             m_bottom.load(std::memory_order_acquire);
+    }
+
+  private:
+    alignas(64) std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+    std::atomic<Array *> m_array;
+
+    /* only accessed by the owner */
+    std::vector<std::unique_ptr<Array>> m_arrays;
+
+    Array *grow(Array *old, int64_t t, int64_t b) {
+      auto a = new Array(old->cap * 2);
+      for (int64_t i = t; i < b; i++) {
+        a->put(i, old->get(i));
+      }
+
+      m_arrays.emplace_back(a);
+      m_array.store(a, std::memory_order_release);
+      return a;
+    }
+  };
+
+  struct alignas(64) Worker {
+    TaskDeque deque;
+
+    /*
+     * tasks submitted from outside of the pool, as a lock-free stack.
+     * The whole stack is taken at once, and so may be taken by a thief
+     * as well as by the owner.
+     */
+    std::atomic<TaskNode *> inbox;
+
+    std::thread thrd;
+  };
+
+public:
+  WorkStealingPool(size_t thrd_cnt)
+      : m_workers(thrd_cnt), m_next_worker(0), m_pending(0), m_event(0),
+        m_sleepers(0), m_stopping(false) {
+    for (size_t i = 0; i < m_workers.size(); i++) {
+      m_workers[i].inbox.store(nullptr);
+    }
+
+    for (size_t i = 0; i < m_workers.size(); i++) {
+      m_workers[i].thrd = std::thread(&WorkStealingPool::run, this, i);
+    }
+  }
+
+  ~WorkStealingPool() { stop(); }
+
+  /*
+   * Submit t to be run by the pool. A task submitted by one of the pool's
+   * own workers is placed on that worker's deque, and otherwise it is
+   * placed in the inbox of the next worker in turn. Once the pool is
+   * stopping, only its own workers may submit tasks.
+   */
+  void push(Task t) {
+    assert(!m_stopping.load() || t_pool == this);
+    auto node = new TaskNode{std::move(t), nullptr};
+    m_pending.fetch_add(1);
+
+    if (t_pool == this) {
+      m_workers[t_worker_id].deque.push(node);
+    } else {
+      auto &inbox =
+          m_workers[m_next_worker.fetch_add(1) % m_workers.size()].inbox;
+      node->next = inbox.load();
+      while (!inbox.compare_exchange_weak(node->next, node)) {
+      }
+    }
+
+    signal();
+  }
+
+  /*
+   * Wait for every submitted task to complete, and then stop the worker
+   * threads. Only the tasks that are running may submit further tasks
+   * once this has been called.
+   */
+  void stop() {
+    if (m_stopping.exchange(true)) {
+      return;
+    }
+
+    signal(true);
+    for (auto &w : m_workers) {
+      w.thrd.join();
+    }
+  }
+
+  size_t get_thread_count() { return m_workers.size(); }
+
+private:
+  std::vector<Worker> m_workers;
+  std::atomic<size_t> m_next_worker;
+
+  /* the number of tasks that have been submitted but not completed */
+  std::atomic<size_t> m_pending;
+
+  /*
+   * advanced whenever new work is available, or the pool is stopping.
+   * A worker reads it before looking for work, and only sleeps if it is
+   * unchanged after failing to find any.
+   */
+  std::atomic<uint64_t> m_event;
+  std::atomic<size_t> m_sleepers;
+
+  std::atomic<bool> m_stopping;
+
+  static inline thread_local WorkStealingPool *t_pool = nullptr;
+  static inline thread_local size_t t_worker_id = 0;
+
+  void signal(bool all = false) {
+    m_event.fetch_add(1);
+    if (m_sleepers.load() > 0) {
+      if (all) {
+        m_event.notify_all();
+      } else {
+        m_event.notify_one();
+      }
+    }
+  }
+
+  /*
+   * Move the contents of src's inbox onto the deque of the worker dst,
+   * which must be owned by the calling thread. The inbox is a stack, so
+   * it is reversed first, to push the tasks in the order they arrived.
+   */
+  void drain_inbox(Worker &src, Worker &dst) {
+    if (src.inbox.load(std::memory_order_relaxed) == nullptr) {
+      return;
+    }
+
+    TaskNode *node = src.inbox.exchange(nullptr);
+    TaskNode *prev = nullptr;
+    while (node) {
+      auto next = node->next;
+      node->next = prev;
+      prev = node;
+      node = next;
+    }
+
+    /* a task may be taken and freed as soon as it has been pushed */
+    while (prev) {
+      auto next = prev->next;
+      dst.deque.push(prev);
+      prev = next;
+    }
+  }
+
+  TaskNode *find_task(size_t id) {
+    auto &self = m_workers[id];
+
+    drain_inbox(self, self);
+    if (auto node = self.deque.take()) {
+      return node;
+    }
+
+    for (size_t i = 1; i < m_workers.size(); i++) {
+      auto &victim = m_workers[(id + i) % m_workers.size()];
+      while (!victim.deque.empty()) {
+        if (auto node = victim.deque.take()) {
+          return node;
+        }
+      }
+
+      /* the victim is busy, so take the tasks that are waiting for it */
+      drain_inbox(victim, self);
+      if (auto node = self.deque.take()) {
+        return node;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void run(size_t id) {
+    t_pool = this;
+    t_worker_id = id;
+
+    while (true) {
+      uint64_t event = m_event.load();
+
+      if (auto node = find_task(id)) {
+        node->task(id);
+        delete node;
+
+        /* the last task to finish must wake the workers to exit */
+        if (m_pending.fetch_sub(1) == 1 && m_stopping.load()) {
+          signal(true);
+        }
+        continue;
+      }
+
+      if (m_stopping.load() && m_pending.load() == 0) {
+        break;
+      }
+
+      m_sleepers.fetch_add(1);
+      m_event.wait(event);
+      m_sleepers.fetch_sub(1);
+    }
+  }
+};
+
+} // namespace de
@@ -51,8 +51,9 @@ public:
   void job_complete(size_t id) {}
 
   /* FIXME: This is just a temporary approach */
+  /* flushes (type 3) are counted as reconstructions */
   void log_time_data(size_t length, size_t type) {
-    assert(type == 1 || type == 2);
+    assert(type >= 1 && type <= 3);
 
     if (type == 1) {
       m_type_1_cnt.fetch_add(1);
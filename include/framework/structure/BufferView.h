@@ -9,10 +9,14 @@
  */
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
 #include <functional>
 #include <utility>
+#include <vector>
 
 #include "framework/interface/Record.h"
 #include "psu-ds/BloomFilter.h"
@@ -22,6 +26,98 @@ namespace de {
 
 typedef std::function<void(void)> ReleaseFunction;
 
+/*
+ * The number of consecutive buffer positions covered by a single sorted
+ * run, when the buffer is maintaining them.
+ */
+static constexpr size_t BUFFER_RUN_SIZE = 256;
+
+/*
+ * A sorted index over the BUFFER_RUN_SIZE records within one block of
+ * buffer positions. The block covers positions [block * BUFFER_RUN_SIZE,
+ * (block + 1) * BUFFER_RUN_SIZE), and idx contains the offsets of these
+ * records within the block, in sorted order. Runs are reused for later
+ * blocks once the ring wraps around, so a run is only valid for a given
+ * block if its block field matches it.
+ */
+struct BufferRun {
+  std::atomic<size_t> block;
+  std::atomic<size_t> written;
+  uint32_t idx[BUFFER_RUN_SIZE];
+};
+
+/*
+ * The number of consecutive buffer positions covered by a single
+ * tombstone count.
+ */
+static constexpr size_t BUFFER_TS_BLOCK_SIZE = 256;
+
+/*
+ * Counts of the tombstones written into each block of
+ * BUFFER_TS_BLOCK_SIZE buffer positions. Counters are reused for later
+ * blocks as the buffer wraps around, so each counter is tagged with the
+ * number of the block that it is counting, in its upper bits. A counter
+ * whose tag does not match a block has not yet seen any tombstones for
+ * it.
+ */
+struct TombstoneCounter {
+  std::atomic<uint64_t> *counts;
+  size_t counter_cnt;
+
+  static constexpr size_t COUNT_BITS = 16;
+  static constexpr uint64_t COUNT_MASK = (1ul << COUNT_BITS) - 1;
+
+  void add(size_t blk, size_t cnt) {
+    auto &counter = counts[blk % counter_cnt];
+    uint64_t old_val = counter.load();
+    uint64_t new_val;
+
+    do {
+      new_val = ((old_val >> COUNT_BITS) == blk)
+                    ? old_val + cnt
+                    : (((uint64_t)blk << COUNT_BITS) | cnt);
+    } while (!counter.compare_exchange_weak(old_val, new_val));
+  }
+
+  size_t get(size_t blk) const {
+    uint64_t val = counts[blk % counter_cnt].load();
+    return ((val >> COUNT_BITS) == blk) ? (val & COUNT_MASK) : 0;
+  }
+};
+
+/*
+ * The buffer's records are stored in fixed-size segments of 2^seg_shift
+ * records each, rather than in one contiguous array. Buffer position pos
+ * lives within the segment stored in slot (pos >> seg_shift) & slot_mask
+ * of the table. Segments are allocated as the tail reaches them and are
+ * retired once the head has passed them, and slots are reused as the
+ * positions wrap around the table.
+ *
+ * Each segment has its own tombstone filter, covering the tombstones
+ * written into it, which shares the segment's lifetime. So, rather than
+ * a single filter that accumulates every tombstone ever inserted, the
+ * filters only ever describe records that are still within the buffer.
+ */
+template <RecordInterface R> struct SegmentTable {
+  std::atomic<Wrapped<R> *> *segments;
+  std::atomic<psudb::BloomFilter<R> *> *filters;
+  size_t seg_shift;
+  size_t slot_mask;
+
+  size_t get_segment_size() const { return 1ul << seg_shift; }
+
+  size_t get_slot(size_t pos) const { return (pos >> seg_shift) & slot_mask; }
+
+  Wrapped<R> *get(size_t pos) const {
+    return segments[get_slot(pos)].load(std::memory_order_acquire) +
+           (pos & (get_segment_size() - 1));
+  }
+
+  psudb::BloomFilter<R> *get_filter(size_t pos) const {
+    return filters[get_slot(pos)].load(std::memory_order_acquire);
+  }
+};
+
 template <RecordInterface R> class BufferView {
 public:
   BufferView() = default;
@@ -34,26 +130,25 @@ public:
   BufferView &operator=(BufferView &) = delete;
 
   BufferView(BufferView &&other)
-      : m_data(std::exchange(other.m_data, nullptr)),
+      : m_table(std::exchange(other.m_table, {})),
         m_release(std::move(other.m_release)),
         m_head(std::exchange(other.m_head, 0)),
         m_tail(std::exchange(other.m_tail, 0)),
-        m_start(std::exchange(other.m_start, 0)),
-        m_stop(std::exchange(other.m_stop, 0)),
         m_cap(std::exchange(other.m_cap, 0)),
-        m_approx_ts_cnt(std::exchange(other.m_approx_ts_cnt, 0)),
-        m_tombstone_filter(std::exchange(other.m_tombstone_filter, nullptr)),
+        m_ts_counter(std::exchange(other.m_ts_counter, {})),
+        m_tscnt(other.m_tscnt.load()),
+        m_runs(std::exchange(other.m_runs, nullptr)),
+        m_run_cnt(std::exchange(other.m_run_cnt, 0)),
         m_active(std::exchange(other.m_active, false)) {}
 
   BufferView &operator=(BufferView &&other) = delete;
 
-  BufferView(Wrapped<R> *buffer, size_t cap, size_t head, size_t tail,
-             size_t tombstone_cnt, psudb::BloomFilter<R> *filter,
-             ReleaseFunction release)
-      : m_data(buffer), m_release(release), m_head(head), m_tail(tail),
-        m_start(m_head % cap), m_stop(m_tail % cap), m_cap(cap),
-        m_approx_ts_cnt(tombstone_cnt), m_tombstone_filter(filter),
-        m_active(true) {}
+  BufferView(SegmentTable<R> table, size_t cap, size_t head, size_t tail,
+             TombstoneCounter ts_counter, ReleaseFunction release,
+             BufferRun *runs = nullptr, size_t run_cnt = 0)
+      : m_table(table), m_release(release), m_head(head), m_tail(tail),
+        m_cap(cap), m_ts_counter(ts_counter), m_tscnt(NO_COUNT),
+        m_runs(runs), m_run_cnt(run_cnt), m_active(true) {}
 
   ~BufferView() {
     if (m_active) {
@@ -61,40 +156,58 @@ public:
     }
   }
 
+  /*
+   * Only the segments whose tombstone filters report a possible match
+   * are searched.
+   */
   bool check_tombstone(const R &rec) {
-    if (m_tombstone_filter && !m_tombstone_filter->lookup(rec))
-      return false;
+    bool found = false;
+    auto below = [&rec](const Wrapped<R> *w) { return w->rec < rec; };
+    auto above = [&rec](const Wrapped<R> *w) { return rec < w->rec; };
+    auto visit = [&rec, &found](const Wrapped<R> *w) {
+      found = w->rec == rec && w->is_tombstone();
+      return !found;
+    };
 
-    for (size_t i = 0; i < get_record_count(); i++) {
-      if (m_data[to_idx(i)].rec == rec && m_data[to_idx(i)].is_tombstone()) {
-        return true;
+    size_t seg_size = m_table.get_segment_size();
+    for (size_t start = m_head; start < m_tail && !found;) {
+      size_t stop = std::min(m_tail, (start / seg_size + 1) * seg_size);
+
+      auto filter = m_table.get_filter(start);
+      if (!filter || filter->lookup(rec)) {
+        scan_range(start, stop, below, above, visit);
       }
+
+      start = stop;
     }
 
-    return false;
+    return found;
   }
 
-  bool delete_record(const R &rec) {
-    if (m_start < m_stop) {
-      for (size_t i = m_start; i < m_stop; i++) {
-        if (m_data[i].rec == rec) {
-          m_data[i].set_delete();
-          return true;
-        }
-      }
-    } else {
-      for (size_t i = m_start; i < m_cap; i++) {
-        if (m_data[i].rec == rec) {
-          m_data[i].set_delete();
-          return true;
-        }
-      }
+  /*
+   * Call visit on every record in the view that falls within a contiguous
+   * range of the record ordering. The range is defined by two predicates:
+   * below returns true for records that sort before the start of the range,
+   * and above returns true for records that sort after its end. Within
+   * blocks of the buffer that have a sorted run available, the start of
+   * the range is located using binary search and the scan stops at the
+   * first record past the end, so only the matching records are touched.
+   * The remainder of the view is scanned linearly. Records are not visited
+   * in any particular order. If visit returns false, the scan is
+   * terminated early. Returns false if the scan was terminated, and true
+   * otherwise.
+   */
+  template <typename BelowFunc, typename AboveFunc, typename VisitFunc>
+  bool range_scan(BelowFunc below, AboveFunc above, VisitFunc visit) {
+    return scan_range(m_head, m_tail, below, above, visit);
+  }
 
-      for (size_t i = 0; i < m_stop; i++) {
-        if (m_data[i].rec == rec) {
-          m_data[i].set_delete();
-          return true;
-        }
+  bool delete_record(const R &rec) {
+    for (size_t i = m_head; i < m_tail; i++) {
+      auto wrec = m_table.get(i);
+      if (wrec->rec == rec) {
+        wrec->set_delete();
+        return true;
       }
     }
 
@@ -103,32 +216,159 @@ public:
 
   size_t get_record_count() { return m_tail - m_head; }
 
+  /*
+   * Returns true if the buffer underlying this view maintains sorted
+   * runs over its blocks.
+   */
+  bool has_sorted_runs() { return m_runs != nullptr; }
+
+  /*
+   * Shrink the view so that it covers at most the first reccnt records
+   * from its head. This is used to bound the size of a flush when the
+   * buffer holds more records than the structure has planned for.
+   */
+  void limit_record_count(size_t reccnt) {
+    m_tail = std::min(m_tail, m_head + reccnt);
+    m_tscnt.store(NO_COUNT);
+  }
+
   size_t get_capacity() { return m_cap; }
 
   /*
-   * NOTE: This function returns an upper bound on the number
-   *       of tombstones within the view. There may be less than
-   *       this, due to synchronization issues during view creation.
+   * Returns the distance from the head of the view of the position at
+   * which wrec was written, based upon the timestamp assigned to it by
+   * the buffer. wrec may be a copy of a record within the view. Records
+   * that were written later have larger offsets.
    */
-  size_t get_tombstone_count() { return m_approx_ts_cnt; }
+  size_t get_offset(const Wrapped<R> &wrec) {
+    return (wrec.get_timestamp() + m_cap - m_head % m_cap) % m_cap;
+  }
+
+  /*
+   * Returns the number of tombstones within the view. This is calculated
+   * on first use from the buffer's per-block tombstone counts, so only
+   * the partial blocks at either end of the view need to be scanned.
+   */
+  size_t get_tombstone_count() {
+    size_t cnt = m_tscnt.load(std::memory_order_relaxed);
+    if (cnt != NO_COUNT) {
+      return cnt;
+    }
+
+    auto scan_positions = [this](size_t start, size_t stop) {
+      size_t cnt = 0;
+      for (size_t i = start; i < stop; i++) {
+        cnt += m_table.get(i)->is_tombstone();
+      }
+      return cnt;
+    };
+
+    size_t first_blk = (m_head + BUFFER_TS_BLOCK_SIZE - 1) / BUFFER_TS_BLOCK_SIZE;
+    size_t last_blk = m_tail / BUFFER_TS_BLOCK_SIZE;
+
+    if (first_blk >= last_blk) {
+      cnt = scan_positions(m_head, m_tail);
+    } else {
+      cnt = scan_positions(m_head, first_blk * BUFFER_TS_BLOCK_SIZE) +
+            scan_positions(last_blk * BUFFER_TS_BLOCK_SIZE, m_tail);
+      for (size_t blk = first_blk; blk < last_blk; blk++) {
+        cnt += m_ts_counter.get(blk);
+      }
+    }
+
+    m_tscnt.store(cnt, std::memory_order_relaxed);
+    return cnt;
+  }
 
   Wrapped<R> *get(size_t i) {
-    return m_data + to_idx(i);
+    assert(i < get_record_count());
+    return m_table.get(m_head + i);
   }
 
   void copy_to_buffer(psudb::byte *buffer) {
-    /* check if the region to be copied circles back to start. If so, do it in
-     * two steps */
-    if (m_start > m_stop) {
-      size_t split_idx = m_cap - m_start;
-
-      memcpy(buffer, (std::byte *)(m_data + m_start),
-             split_idx * sizeof(Wrapped<R>));
-      memcpy(buffer + (split_idx * sizeof(Wrapped<R>)), (std::byte *)m_data,
-             m_stop * sizeof(Wrapped<R>));
-    } else {
-      memcpy(buffer, (std::byte *)(m_data + m_start),
-             get_record_count() * sizeof(Wrapped<R>));
+    /* copy the region one segment at a time */
+    size_t seg_size = m_table.get_segment_size();
+    for (size_t pos = m_head; pos < m_tail;) {
+      size_t cnt = std::min(m_tail - pos, seg_size - (pos & (seg_size - 1)));
+      memcpy(buffer, (std::byte *)m_table.get(pos), cnt * sizeof(Wrapped<R>));
+
+      buffer += cnt * sizeof(Wrapped<R>);
+      pos += cnt;
+    }
+  }
+
+  /*
+   * Copy the records within the view into buffer in sorted order. Any
+   * blocks of the view that have a sorted run available are copied in
+   * run order, so that only the records outside of them need to be
+   * sorted, and the sorted segments are then merged together.
+   */
+  void copy_to_buffer_sorted(Wrapped<R> *buffer) {
+    size_t first_blk = (m_head + BUFFER_RUN_SIZE - 1) / BUFFER_RUN_SIZE;
+    size_t last_blk = m_tail / BUFFER_RUN_SIZE;
+
+    if (!m_runs || first_blk >= last_blk) {
+      copy_to_buffer((psudb::byte *)buffer);
+      std::sort(buffer, buffer + get_record_count(), std::less<Wrapped<R>>());
+      return;
+    }
+
+    /* the boundaries of the sorted segments within buffer */
+    std::vector<size_t> bounds = {0};
+    size_t cnt = 0;
+
+    std::vector<size_t> unsorted_blks;
+    for (size_t blk = first_blk; blk < last_blk; blk++) {
+      size_t base = blk * BUFFER_RUN_SIZE;
+      auto run = get_run(blk);
+      if (!run) {
+        unsorted_blks.push_back(blk);
+        continue;
+      }
+
+      for (size_t i = 0; i < BUFFER_RUN_SIZE; i++) {
+        buffer[cnt++] = *m_table.get(base + run->idx[i]);
+      }
+      bounds.push_back(cnt);
+    }
+
+    /* gather up everything else and sort it as one final segment */
+    size_t unsorted_start = cnt;
+    for (size_t i = m_head; i < first_blk * BUFFER_RUN_SIZE; i++) {
+      buffer[cnt++] = *m_table.get(i);
+    }
+
+    for (auto blk : unsorted_blks) {
+      for (size_t i = 0; i < BUFFER_RUN_SIZE; i++) {
+        buffer[cnt++] = *m_table.get(blk * BUFFER_RUN_SIZE + i);
+      }
+    }
+
+    for (size_t i = last_blk * BUFFER_RUN_SIZE; i < m_tail; i++) {
+      buffer[cnt++] = *m_table.get(i);
+    }
+
+    if (cnt > unsorted_start) {
+      std::sort(buffer + unsorted_start, buffer + cnt,
+                std::less<Wrapped<R>>());
+      bounds.push_back(cnt);
+    }
+
+    assert(cnt == get_record_count());
+
+    /* merge adjacent pairs of segments until only one remains */
+    while (bounds.size() > 2) {
+      std::vector<size_t> merged = {0};
+      for (size_t i = 1; i < bounds.size(); i += 2) {
+        if (i + 1 < bounds.size()) {
+          std::inplace_merge(buffer + bounds[i - 1], buffer + bounds[i],
+                             buffer + bounds[i + 1], std::less<Wrapped<R>>());
+          merged.push_back(bounds[i + 1]);
+        } else {
+          merged.push_back(bounds[i]);
+        }
+      }
+      bounds = std::move(merged);
     }
   }
 
@@ -137,21 +377,86 @@ public:
   size_t get_head() { return m_head; }
 
 private:
-  Wrapped<R> *m_data;
+  SegmentTable<R> m_table;
   ReleaseFunction m_release;
   size_t m_head;
   size_t m_tail;
-  size_t m_start;
-  size_t m_stop;
   size_t m_cap;
-  size_t m_approx_ts_cnt;
-  psudb::BloomFilter<R> *m_tombstone_filter;
+
+  static constexpr size_t NO_COUNT = SIZE_MAX;
+  TombstoneCounter m_ts_counter;
+  std::atomic<size_t> m_tscnt;
+
+  BufferRun *m_runs;
+  size_t m_run_cnt;
   bool m_active;
 
-  size_t to_idx(size_t i) {
-    size_t idx = (m_start + i >= m_cap) ? i - (m_cap - m_start) : m_start + i;
-    assert(idx < m_cap);
-    return idx;
+  /*
+   * Returns the sorted run for blk, or nullptr if one has not been
+   * built for it.
+   */
+  BufferRun *get_run(size_t blk) {
+    auto run = m_runs + (blk % m_run_cnt);
+    return (run->block.load(std::memory_order_acquire) == blk) ? run
+                                                               : nullptr;
+  }
+
+  /*
+   * Perform a range_scan over the positions [start, stop) of the buffer,
+   * which must lie within the view.
+   */
+  template <typename BelowFunc, typename AboveFunc, typename VisitFunc>
+  bool scan_range(size_t start, size_t stop, BelowFunc below, AboveFunc above,
+                  VisitFunc visit) {
+    auto scan_positions = [&](size_t from, size_t to) {
+      for (size_t i = from; i < to; i++) {
+        auto rec = m_table.get(i);
+        if (!below(rec) && !above(rec) && !visit(rec)) {
+          return false;
+        }
+      }
+      return true;
+    };
+
+    size_t first_blk = (start + BUFFER_RUN_SIZE - 1) / BUFFER_RUN_SIZE;
+    size_t last_blk = stop / BUFFER_RUN_SIZE;
+
+    if (!m_runs || first_blk >= last_blk) {
+      return scan_positions(start, stop);
+    }
+
+    if (!scan_positions(start, first_blk * BUFFER_RUN_SIZE) ||
+        !scan_positions(last_blk * BUFFER_RUN_SIZE, stop)) {
+      return false;
+    }
+
+    for (size_t blk = first_blk; blk < last_blk; blk++) {
+      size_t base = blk * BUFFER_RUN_SIZE;
+      auto run = get_run(blk);
+      if (!run) {
+        if (!scan_positions(base, base + BUFFER_RUN_SIZE)) {
+          return false;
+        }
+        continue;
+      }
+
+      auto idx = std::partition_point(
+          run->idx, run->idx + BUFFER_RUN_SIZE,
+          [&](uint32_t off) { return below(m_table.get(base + off)); });
+
+      for (; idx < run->idx + BUFFER_RUN_SIZE; idx++) {
+        auto rec = m_table.get(base + *idx);
+        if (above(rec)) {
+          break;
+        }
+
+        if (!visit(rec)) {
+          return false;
+        }
+      }
+    }
+
+    return true;
   }
 };
 
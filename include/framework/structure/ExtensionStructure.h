@@ -9,6 +9,7 @@
  */
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cstdio>
 #include <vector>
@@ -17,6 +18,7 @@
 #include "framework/structure/InternalLevel.h"
 
 #include "framework/util/Configuration.h"
+#include "util/SortedMerge.h"
 
 #include "psu-util/timer.h"
 
@@ -57,9 +59,10 @@ public:
    *
    * NOTE: When using tagged deletes, a delete of a record in the original
    * structure will affect the copy, so long as the copy retains a reference
-   * to the same shard as the original. This could cause synchronization
-   * problems under tagging with concurrency. Any deletes in this context will
-   * need to be forwarded to the appropriate structures manually.
+   * to the same shard as the original. Deletes of records in shards that
+   * the copy has already reconstructed will not, and must be forwarded to
+   * it separately. DynamicExtension does this by replaying its log of
+   * deletes into each new version before installing it.
    */
   ExtensionStructure<ShardType, QueryType, L> *copy() {
     auto new_struct = new ExtensionStructure<ShardType, QueryType, L>(
@@ -74,6 +77,27 @@ public:
     return new_struct;
   }
 
+  /*
+   * Replace the levels of this structure from first_level downward with
+   * those of other, adding any levels that other has and this structure
+   * lacks. This is used to install the results of a reconstruction
+   * performed on a separate copy of the structure, and so it is only
+   * valid if the levels being replaced have not been changed since the
+   * copy was made.
+   */
+  void install_levels(ExtensionStructure<ShardType, QueryType, L> *other,
+                      level_index first_level) {
+    for (size_t i = first_level; i < other->m_levels.size(); i++) {
+      if (i < m_levels.size()) {
+        m_levels[i] = other->m_levels[i];
+        m_current_state[i] = other->m_current_state[i];
+      } else {
+        m_levels.push_back(other->m_levels[i]);
+        m_current_state.push_back(other->m_current_state[i]);
+      }
+    }
+  }
+
   /*
    * Search for a record matching the argument and mark it deleted by
    * setting the delete bit in its wrapped header. Returns 1 if a matching
@@ -154,6 +178,25 @@ public:
    */
   size_t get_height() { return m_levels.size(); }
 
+  /*
+   * Return the CPU on which the largest level of the structure was built,
+   * or -1 if unknown. Queries will generally spend most of their time
+   * within this level.
+   */
+  int get_home_cpu() {
+    int cpu = -1;
+    size_t max_reccnt = 0;
+
+    for (size_t i = 0; i < m_levels.size(); i++) {
+      if (m_levels[i] && m_levels[i]->get_record_count() > max_reccnt) {
+        max_reccnt = m_levels[i]->get_record_count();
+        cpu = m_levels[i]->get_build_cpu();
+      }
+    }
+
+    return cpu;
+  }
+
   /*
    * Return the amount of memory (in bytes) used by the shards within the
    * structure for storing the primary data structure and raw data.
@@ -333,6 +376,39 @@ public:
     return reconstructions;
   }
 
+  /*
+   * Return the reconstructions, not involving L0, that will be required
+   * to free up space in L0 once it has filled. As buffer flushes only
+   * affect L0 until it is full, these can be performed in the background
+   * while flushes continue, rather than delaying the flush that would
+   * otherwise need them.
+   */
+  ReconstructionVector get_background_reconstruction_tasks() {
+    ReconstructionVector tasks;
+
+    /* BSM reconstructions always involve L0 */
+    if constexpr (L == LayoutPolicy::BSM) {
+      return tasks;
+    }
+
+    if (m_current_state.size() == 0) {
+      return tasks;
+    }
+
+    state_vector scratch_state = m_current_state;
+    scratch_state[0].reccnt = scratch_state[0].reccap;
+    scratch_state[0].shardcnt = scratch_state[0].shardcap;
+
+    auto recons = get_reconstruction_tasks_from_level(0, scratch_state);
+    for (size_t i = 0; i < recons.size(); i++) {
+      if (recons[i].sources[0] > 0) {
+        tasks.add_reconstruction(recons[i]);
+      }
+    }
+
+    return tasks;
+  }
+
   /*
    *
    */
@@ -357,8 +433,7 @@ public:
         return reconstructions;
       }
 
-      ReconstructionTask task;
-      task.target = base_level;
+      ReconstructionTask task = {{}, base_level, 0};
 
       size_t base_reccnt = 0;
       for (level_index i = base_level; i > source_level; i--) {
@@ -425,8 +500,18 @@ public:
       levels[i] = m_levels[task.sources[i]].get();
     }
 
+    /* the merge holds the oldest records if it takes in every level */
+    bool drop_tombstones = true;
+    for (level_index i = 0; i < (level_index)m_levels.size(); i++) {
+      if (get_level_record_count(i) > 0 &&
+          std::find(task.sources.begin(), task.sources.end(), i) ==
+              task.sources.end()) {
+        drop_tombstones = false;
+      }
+    }
+
     auto new_level = InternalLevel<ShardType, QueryType>::reconstruction(
-        levels, task.target);
+        levels, task.target, drop_tombstones);
     if (task.target >= m_levels.size()) {
       m_current_state.push_back({new_level->get_record_count(),
                                  calc_level_record_capacity(task.target), 1,
@@ -451,14 +536,82 @@ public:
     return;
   }
 
+  /*
+   * Perform each of the reconstructions in tasks, which must be ordered
+   * from the deepest level upwards, as they are by
+   * get_reconstruction_tasks. In this order, every task reads its source
+   * level before a later task replaces it, and a task targeting a level
+   * emptied by an earlier task merges nothing into it. So, the new shards
+   * for all of the tasks can be built up front from the current levels,
+   * independently of one another, using parallel_for, and then installed
+   * in order. parallel_for(cnt, work) must call work(i) for each i in
+   * [0, cnt), and return once every call has completed. It is also used
+   * to split each merge into as many as thread_cnt parts (see
+   * sorted_array_merge), for shards that build themselves that way.
+   */
+  template <typename ParallelFor>
+  void reconstruction(ReconstructionVector &tasks, ParallelFor parallel_for,
+                      size_t thread_cnt = 1) {
+    static_assert(L != LayoutPolicy::BSM);
+
+    std::vector<std::vector<ShardType *>> inputs(tasks.size());
+    std::vector<char> drop_tombstones(tasks.size(), false);
+    for (size_t i = 0; i < tasks.size(); i++) {
+      level_index target = tasks[i].target;
+      level_index source = tasks[i].sources[0];
+
+      if constexpr (L == LayoutPolicy::LEVELING) {
+        bool emptied = false;
+        for (size_t j = 0; j < i; j++) {
+          emptied |= tasks[j].sources[0] == target;
+        }
+
+        /* an empty target is replaced by the source, without a merge */
+        if (!emptied && target < (level_index)m_levels.size() &&
+            m_levels[target]->get_shard_count() > 0) {
+          inputs[i] = {m_levels[target]->get_shard(0),
+                       m_levels[source]->get_shard(0)};
+          drop_tombstones[i] = levels_empty_from(target + 1);
+        }
+      } else {
+        for (size_t j = 0; j < m_levels[source]->get_shard_count(); j++) {
+          if (auto shard = m_levels[source]->get_shard(j)) {
+            inputs[i].push_back(shard);
+          }
+        }
+        drop_tombstones[i] = levels_empty_from(target);
+      }
+    }
+
+    std::vector<ShardType *> shards(tasks.size(), nullptr);
+    std::vector<int> build_cpus(tasks.size(), -1);
+    merge_executor executor = {parallel_for, thread_cnt};
+    parallel_for(tasks.size(), [&](size_t i) {
+      if (inputs[i].size() > 0) {
+        merge_executor_scope scope(&executor);
+        shards[i] = InternalLevel<ShardType, QueryType>::build_shard(
+            inputs[i], drop_tombstones[i]);
+        build_cpus[i] = NumaTopology::get_current_cpu();
+      }
+    });
+
+    for (size_t i = 0; i < tasks.size(); i++) {
+      reconstruction(tasks[i].target, tasks[i].sources[0], shards[i],
+                     build_cpus[i]);
+    }
+  }
+
   /*
    * Combine incoming_level with base_level and reconstruct the shard,
    * placing it in base_level. The two levels should be sequential--i.e. no
    * levels are skipped in the reconstruction process--otherwise the
-   * tombstone ordering invariant may be violated.
+   * tombstone ordering invariant may be violated. If shard is provided,
+   * it is used as the result of the merge, having been built on build_cpu
+   * ahead of time, and ownership of it is taken.
    */
   inline void reconstruction(level_index base_level,
-                             level_index incoming_level) {
+                             level_index incoming_level,
+                             ShardType *shard = nullptr, int build_cpu = -1) {
     size_t shard_capacity = (L == LayoutPolicy::LEVELING) ? 1 : m_scale_factor;
 
     if (base_level >= m_levels.size()) {
@@ -473,17 +626,26 @@ public:
     if constexpr (L == LayoutPolicy::LEVELING) {
       /* if the base level has a shard, merge the base and incoming together to
        * make a new one */
-      if (m_levels[base_level]->get_shard_count() > 0) {
+      if (shard) {
+        m_levels[base_level] = InternalLevel<ShardType, QueryType>::from_shard(
+            base_level, shard, build_cpu);
+      } else if (m_levels[base_level]->get_shard_count() > 0) {
         m_levels[base_level] =
             InternalLevel<ShardType, QueryType>::reconstruction(
-                m_levels[base_level].get(), m_levels[incoming_level].get());
+                m_levels[base_level].get(), m_levels[incoming_level].get(),
+                levels_empty_from(base_level + 1));
         /* otherwise, we can just move the incoming to the base */
       } else {
         m_levels[base_level] = m_levels[incoming_level];
       }
 
     } else {
-      m_levels[base_level]->append_level(m_levels[incoming_level].get());
+      if (shard) {
+        m_levels[base_level]->append_shard(shard, build_cpu);
+      } else {
+        m_levels[base_level]->append_level(m_levels[incoming_level].get(),
+                                           levels_empty_from(base_level));
+      }
       m_levels[base_level]->finalize();
     }
 
@@ -519,6 +681,11 @@ public:
 
   size_t get_reference_count() { return m_refcnt.load(); }
 
+  /* returns a reference to the shard identified by id (see InternalLevel) */
+  std::shared_ptr<ShardType> get_shard_ptr(ShardID id) {
+    return m_levels[id.level_idx]->get_shard_ptr(id.shard_idx);
+  }
+
   std::vector<typename QueryType::LocalQuery *>
   get_local_queries(std::vector<std::pair<ShardID, ShardType *>> &shards,
                     typename QueryType::Parameters *parms) {
@@ -610,18 +777,18 @@ private:
       // FIXME: Kludgey implementation due to interface constraints.
       auto old_level = m_levels[0].get();
       auto temp_level = new InternalLevel<ShardType, QueryType>(0, 1);
-      temp_level->append_buffer(std::move(buffer));
+      temp_level->append_buffer(std::move(buffer), levels_empty_from(0));
 
       if (old_level->get_shard_count() > 0) {
         m_levels[0] = InternalLevel<ShardType, QueryType>::reconstruction(
-            old_level, temp_level);
+            old_level, temp_level, levels_empty_from(1));
         delete temp_level;
       } else {
         m_levels[0] =
             std::shared_ptr<InternalLevel<ShardType, QueryType>>(temp_level);
       }
     } else {
-      m_levels[0]->append_buffer(std::move(buffer));
+      m_levels[0]->append_buffer(std::move(buffer), levels_empty_from(0));
     }
 
     /* update the state vector */
@@ -648,6 +815,21 @@ private:
     return m_buffer_size * pow(m_scale_factor, idx + 1);
   }
 
+  /*
+   * Returns true if none of the levels from idx downwards hold any
+   * records. A shard built from the records above them is then the oldest
+   * in the structure, and has no need to retain upsert tombstones.
+   */
+  inline bool levels_empty_from(level_index idx) {
+    for (level_index i = idx; i < (level_index)m_levels.size(); i++) {
+      if (get_level_record_count(i) > 0) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
   /*
    * Returns the number of records present on a specified level.
    */
@@ -16,12 +16,14 @@
 #pragma once
 
 #include <memory>
+#include <type_traits>
 #include <vector>
 
 #include "framework/interface/Query.h"
 #include "framework/interface/Record.h"
 #include "framework/interface/Shard.h"
 #include "framework/structure/BufferView.h"
+#include "framework/util/NumaTopology.h"
 #include "util/types.h"
 
 namespace de {
@@ -36,10 +38,35 @@ class InternalLevel {
 public:
   InternalLevel(ssize_t level_no, size_t shard_cap)
       : m_level_no(level_no), m_shard_cnt(0), m_shards(shard_cap, nullptr),
-        m_pending_shard(nullptr) {}
+        m_pending_shard(nullptr), m_build_cpu(-1) {}
 
   ~InternalLevel() { delete m_pending_shard; }
 
+  /*
+   * Build a new shard from shards. If drop_tombstones is set, the new
+   * shard will hold the oldest records in the structure, and so shard
+   * types that support it are allowed to discard the tombstones of upsert
+   * records, which have no older versions left to shadow.
+   */
+  static ShardType *build_shard(std::vector<ShardType *> const &shards,
+                                bool drop_tombstones) {
+    if constexpr (std::is_constructible_v<ShardType,
+                                          std::vector<ShardType *> const &,
+                                          bool>) {
+      return new ShardType(shards, drop_tombstones);
+    } else {
+      return new ShardType(shards);
+    }
+  }
+
+  static ShardType *build_shard(BuffView buffer, bool drop_tombstones) {
+    if constexpr (std::is_constructible_v<ShardType, BuffView, bool>) {
+      return new ShardType(std::move(buffer), drop_tombstones);
+    } else {
+      return new ShardType(std::move(buffer));
+    }
+  }
+
   /*
    * Create a new shard combining the records from base_level and new_level,
    * and return a shared_ptr to a new level containing this shard. This is used
@@ -48,7 +75,8 @@ public:
    * No changes are made to the levels provided as arguments.
    */
   static std::shared_ptr<InternalLevel>
-  reconstruction(InternalLevel *base_level, InternalLevel *new_level) {
+  reconstruction(InternalLevel *base_level, InternalLevel *new_level,
+                 bool drop_tombstones = false) {
     assert(base_level->m_level_no > new_level->m_level_no ||
            (base_level->m_level_no == 0 && new_level->m_level_no == 0));
     auto res = new InternalLevel(base_level->m_level_no, 1);
@@ -56,12 +84,15 @@ public:
     std::vector<ShardType *> shards = {base_level->m_shards[0].get(),
                                        new_level->m_shards[0].get()};
 
-    res->m_shards[0] = std::make_shared<ShardType>(shards);
+    res->m_shards[0] =
+        std::shared_ptr<ShardType>(build_shard(shards, drop_tombstones));
+    res->m_build_cpu = NumaTopology::get_current_cpu();
     return std::shared_ptr<InternalLevel>(res);
   }
 
   static std::shared_ptr<InternalLevel>
-  reconstruction(std::vector<InternalLevel *> levels, size_t level_idx) {
+  reconstruction(std::vector<InternalLevel *> levels, size_t level_idx,
+                 bool drop_tombstones = false) {
     std::vector<ShardType *> shards;
     for (auto level : levels) {
       for (auto shard : level->m_shards) {
@@ -72,7 +103,9 @@ public:
 
     auto res = new InternalLevel(level_idx, 1);
     res->m_shard_cnt = 1;
-    res->m_shards[0] = std::make_shared<ShardType>(shards);
+    res->m_shards[0] =
+        std::shared_ptr<ShardType>(build_shard(shards, drop_tombstones));
+    res->m_build_cpu = NumaTopology::get_current_cpu();
 
     return std::shared_ptr<InternalLevel>(res);
   }
@@ -85,7 +118,7 @@ public:
    *
    * No changes are made to the level provided as an argument.
    */
-  void append_level(InternalLevel *level) {
+  void append_level(InternalLevel *level, bool drop_tombstones = false) {
     // FIXME: that this is happening probably means that
     // something is going terribly wrong earlier in the
     // reconstruction logic.
@@ -99,31 +132,69 @@ public:
         shards.emplace_back(shard.get());
     }
 
+    m_build_cpu = NumaTopology::get_current_cpu();
+
     if (m_shard_cnt == m_shards.size()) {
-      m_pending_shard = new ShardType(shards);
+      m_pending_shard = build_shard(shards, drop_tombstones);
       return;
     }
 
-    auto tmp = new ShardType(shards);
+    auto tmp = build_shard(shards, drop_tombstones);
     m_shards[m_shard_cnt] = std::shared_ptr<ShardType>(tmp);
 
     ++m_shard_cnt;
   }
 
+  /*
+   * Return a new level containing only shard, which has already been
+   * built on build_cpu. This is used in place of reconstruction when the
+   * shard is built ahead of time, under the leveling layout policy.
+   */
+  static std::shared_ptr<InternalLevel>
+  from_shard(ssize_t level_no, ShardType *shard, int build_cpu) {
+    auto res = new InternalLevel(level_no, 1);
+    res->m_shard_cnt = 1;
+    res->m_shards[0] = std::shared_ptr<ShardType>(shard);
+    res->m_build_cpu = build_cpu;
+
+    return std::shared_ptr<InternalLevel>(res);
+  }
+
+  /*
+   * Append shard, which has already been built on build_cpu, into this
+   * level. This is used in place of append_level when the shard is built
+   * ahead of time, under the tiering layout policy.
+   */
+  void append_shard(ShardType *shard, int build_cpu) {
+    m_build_cpu = build_cpu;
+
+    if (m_shard_cnt == m_shards.size()) {
+      assert(m_pending_shard == nullptr);
+      m_pending_shard = shard;
+      return;
+    }
+
+    m_shards[m_shard_cnt] = std::shared_ptr<ShardType>(shard);
+    ++m_shard_cnt;
+  }
+
   /*
    * Create a new shard using the records in the
    * provided buffer, and append this new shard
    * into this level. This is used for buffer
    * flushes under the tiering layout policy.
    */
-  void append_buffer(BuffView buffer) {
+  void append_buffer(BuffView buffer, bool drop_tombstones = false) {
+    m_build_cpu = NumaTopology::get_current_cpu();
+
     if (m_shard_cnt == m_shards.size()) {
       assert(m_pending_shard == nullptr);
-      m_pending_shard = new ShardType(std::move(buffer));
+      m_pending_shard = build_shard(std::move(buffer), drop_tombstones);
       return;
     }
 
-    m_shards[m_shard_cnt] = std::make_shared<ShardType>(std::move(buffer));
+    m_shards[m_shard_cnt] = std::shared_ptr<ShardType>(
+        build_shard(std::move(buffer), drop_tombstones));
     ++m_shard_cnt;
   }
 
@@ -159,11 +230,17 @@ public:
     return new ShardType(shards);
   }
 
+  /*
+   * Create local queries against each shard on this level, appending them
+   * to local_queries and the shards to shards. Shards are visited from
+   * newest to oldest, so that across the levels of the structure the
+   * local queries are in order of decreasing recency.
+   */
   void get_local_queries(
       std::vector<std::pair<ShardID, ShardType *>> &shards,
       std::vector<typename QueryType::LocalQuery *> &local_queries,
       typename QueryType::Parameters *query_parms) {
-    for (size_t i = 0; i < m_shard_cnt; i++) {
+    for (ssize_t i = m_shard_cnt - 1; i >= 0; i--) {
       if (m_shards[i]) {
         auto local_query =
             QueryType::local_preproc(m_shards[i].get(), query_parms);
@@ -213,6 +290,18 @@ public:
     return m_shards[idx].get();
   }
 
+  /*
+   * Returns a reference to the shard at idx, which keeps it alive after
+   * the level itself has been freed.
+   */
+  std::shared_ptr<ShardType> get_shard_ptr(size_t idx) {
+    if (idx >= m_shard_cnt) {
+      return nullptr;
+    }
+
+    return m_shards[idx];
+  }
+
   size_t get_shard_count() { return m_shard_cnt; }
 
   size_t get_record_count() {
@@ -278,10 +367,18 @@ public:
       new_level->m_shards[i] = m_shards[i];
     }
     new_level->m_shard_cnt = m_shard_cnt;
+    new_level->m_build_cpu = m_build_cpu;
 
     return new_level;
   }
 
+  /*
+   * Returns the CPU on which the most recent shard in this level was
+   * built, or -1 if unknown. Under first-touch placement, this identifies
+   * the NUMA node holding the level's most recent data.
+   */
+  int get_build_cpu() { return m_build_cpu; }
+
 private:
   ssize_t m_level_no;
 
@@ -290,6 +387,8 @@ private:
 
   std::vector<std::shared_ptr<ShardType>> m_shards;
   ShardType *m_pending_shard;
+
+  int m_build_cpu;
 };
 
 } // namespace de
@@ -6,22 +6,25 @@
  *
  * Distributed under the Modified BSD License.
  *
- * NOTE: Concerning the tombstone count. One possible approach
- * would be to track the number of tombstones below and above the
- * low water mark--this would be straightforward to do. Then, if we
- * *require* that the head only advance up to the LWM, we can get a
- * correct view on the number of tombstones in the active buffer at
- * any point in time, and the BufferView will have a pretty good
- * approximation as well (potentially with a few extra if new inserts
- * happen between when the tail pointer and tombstone count are fetched)
- *
+ * NOTE: Concerning the tombstone count. Rather than maintaining a
+ * single running count, which cannot be reduced correctly when the head
+ * advances past an arbitrary number of records, tombstones are counted
+ * per block of BUFFER_TS_BLOCK_SIZE positions. A view sums the counts of
+ * the blocks that it fully contains, and scans only the records of the
+ * partial blocks at either end, giving an exact count regardless of
+ * where the head and tail fall.
  */
 #pragma once
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstdlib>
+#include <functional>
 #include <immintrin.h>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include "framework/interface/Record.h"
 #include "framework/structure/BufferView.h"
@@ -39,28 +42,194 @@ template <RecordInterface R> class MutableBuffer {
     size_t refcnt;
   };
 
+  /*
+   * The maximum number of buffer heads (generations) that can be
+   * referenced at once. Each time the head is advanced, a new generation
+   * is registered, and the old one remains readable until its last
+   * reference is released. The head can only fail to advance if every
+   * slot is occupied by a referenced generation.
+   */
+  static constexpr size_t HEAD_SLOT_CNT = 8;
+  static constexpr size_t NO_HEAD = SIZE_MAX;
+
+  struct alignas(64) head_slot {
+    std::atomic<buffer_head> head;
+  };
+
+  /*
+   * The number of records that can be staged within a single insert
+   * lane before it must be drained into the main buffer. This is also
+   * the number of slots that a lane will reserve against the high
+   * watermark at a time.
+   */
+  static constexpr size_t LANE_CAPACITY = 64;
+
+  /*
+   * the number of times that publish will spin waiting for an earlier
+   * writer before yielding instead
+   */
+  static constexpr size_t PUBLISH_SPIN_CNT = 1024;
+
+  /*
+   * A per-thread staging area for inserts. Each lane is cache-line
+   * isolated, and is normally only touched by the threads mapped to it,
+   * so the lock is uncontended outside of drains triggered by the
+   * creation of a buffer view.
+   */
+  struct alignas(64) insert_lane {
+    std::atomic<bool> lock;
+    size_t reccnt;
+
+    /*
+     * only modified under the lock, but atomic so that drains can skip
+     * idle lanes without taking it
+     */
+    std::atomic<size_t> reserved;
+    Wrapped<R> data[LANE_CAPACITY];
+  };
+
 public:
+  /*
+   * If lane_cnt is non-zero, the buffer will operate in multi-lane mode.
+   * In this mode, each inserting thread appends into its own staging
+   * lane, and slots within the buffer are reserved against the high
+   * watermark in blocks of LANE_CAPACITY, rather than one at a time. The
+   * lanes are drained into the buffer whenever they fill up, and whenever
+   * a BufferView is created, so views always contain every record that
+   * has been successfully appended. As lanes may hold reservations for
+   * slots that they have not yet filled, the buffer may report itself
+   * as full up to lane_cnt * LANE_CAPACITY records early.
+   *
+   * If sorted_runs is true, the buffer will also maintain a sorted index
+   * over each block of BUFFER_RUN_SIZE consecutive records once the block
+   * has been completely filled. The index is built by the thread that
+   * writes the final record of the block. BufferViews use these runs to
+   * answer range scans using binary search within each block, rather
+   * than scanning every record, and to produce sorted copies of the
+   * buffer by merging the runs rather than sorting from scratch.
+   *
+   * The buffer's storage is allocated in segments (see SegmentTable).
+   * Enough segments to cover capacity records are allocated up front,
+   * and are recycled as the buffer wraps around. If max_capacity is
+   * larger than capacity, the buffer is growable: once the high
+   * watermark is reached, inserts will continue to be accepted into
+   * additional segments, allocated on demand, until max_capacity / 2
+   * records are buffered. The additional segments are freed again once
+   * the head has passed them. The high watermark then only controls the
+   * size of each flush, rather than the number of buffered records.
+   */
   MutableBuffer(size_t low_watermark, size_t high_watermark,
-                size_t capacity = 0)
+                size_t capacity = 0, size_t lane_cnt = 0,
+                bool sorted_runs = false, size_t max_capacity = 0)
       : m_lwm(low_watermark), m_hwm(high_watermark),
-        m_cap((capacity == 0) ? 2 * high_watermark : capacity), m_tail(0),
-        m_head({0, 0}), m_old_head({high_watermark, 0}),
-        m_data(new Wrapped<R>[m_cap]()),
-        m_tombstone_filter(
-            new psudb::BloomFilter<R>(BF_FPR, m_hwm, BF_HASH_FUNCS)),
-        m_tscnt(0), m_old_tscnt(0), m_active_head_advance(false) {
+        m_base_cap((capacity == 0) ? 2 * high_watermark : capacity),
+        m_cap(std::max(m_base_cap, max_capacity)), m_tail(0), m_published(0),
+        m_reserved(0), m_head(0), m_oldest_head(0),
+        m_ts_counter_cnt(m_cap / BUFFER_TS_BLOCK_SIZE + 2),
+        m_ts_counts(new std::atomic<uint64_t>[m_ts_counter_cnt]()),
+        m_lane_cnt(lane_cnt),
+        m_lanes((lane_cnt) ? new insert_lane[lane_cnt]() : nullptr),
+        /*
+         * there must be enough runs that a run is never reused while the
+         * records of the block that it currently indexes are still
+         * within the ring
+         */
+        m_run_cnt((sorted_runs) ? m_cap / BUFFER_RUN_SIZE + 2 : 0),
+        m_runs((sorted_runs) ? new BufferRun[m_run_cnt]() : nullptr) {
     assert(m_cap > m_hwm);
     assert(m_hwm >= m_lwm);
+    reset_runs();
+
+    /* the buffer begins with a single, unreferenced, generation at 0 */
+    m_heads[0].head.store({0, 0});
+    for (size_t i = 1; i < HEAD_SLOT_CNT; i++) {
+      m_heads[i].head.store({NO_HEAD, 0});
+    }
+
+    /*
+     * use power-of-two segment sizes and slot counts, so that locating a
+     * record requires no division. There must be enough slots that a
+     * slot is never needed by a new segment while the segment that last
+     * used it is still within the buffer.
+     */
+    size_t seg_shift = 0;
+    while ((2ul << seg_shift) <= std::max<size_t>(1, m_base_cap / 4)) {
+      seg_shift++;
+    }
+
+    size_t seg_size = 1ul << seg_shift;
+    size_t slot_cnt = 1;
+    while (slot_cnt < (m_cap + seg_size - 1) / seg_size + 2) {
+      slot_cnt *= 2;
+    }
+
+    m_table = {new std::atomic<Wrapped<R> *>[slot_cnt](),
+               new std::atomic<psudb::BloomFilter<R> *>[slot_cnt](), seg_shift,
+               slot_cnt - 1};
+    m_segment_ids = new std::atomic<size_t>[slot_cnt];
+    for (size_t i = 0; i < slot_cnt; i++) {
+      m_segment_ids[i].store(NO_SEGMENT);
+    }
+
+    m_base_segs = (m_base_cap + seg_size - 1) / seg_size;
+    for (size_t i = 0; i < m_base_segs; i++) {
+      m_segment_pool.push_back(new Wrapped<R>[seg_size]());
+      m_filter_pool.push_back(
+          new psudb::BloomFilter<R>(BF_FPR, seg_size, BF_HASH_FUNCS));
+    }
+    m_allocated_segs = m_base_segs;
+    m_filter_size = m_filter_pool[0]->get_memory_usage();
+    m_next_retire = 0;
   }
 
   ~MutableBuffer() {
-    delete[] m_data;
-    delete m_tombstone_filter;
+    for (size_t i = 0; i <= m_table.slot_mask; i++) {
+      delete[] m_table.segments[i].load();
+      delete m_table.filters[i].load();
+    }
+
+    for (auto seg : m_segment_pool) {
+      delete[] seg;
+    }
+
+    for (auto filter : m_filter_pool) {
+      delete filter;
+    }
+
+    delete[] m_table.segments;
+    delete[] m_table.filters;
+    delete[] m_segment_ids;
+    delete[] m_lanes;
+    delete[] m_runs;
+    delete[] m_ts_counts;
   }
 
-  int append(const R &rec, bool tombstone = false) {
-    int32_t tail = 0;
-    if ((tail = try_advance_tail()) == -1) {
+  /*
+   * Append rec to the buffer, returning 1 on success and 0 if the buffer
+   * is full. If seq is not null, it is set to the sequence number of the
+   * record on success: one past the position reserved for it, so that
+   * any buffer view with a tail of at least seq contains the record.
+   */
+  int append(const R &rec, bool tombstone = false, size_t *seq = nullptr) {
+    /*
+     * a record staged in a lane has no position until the lane is
+     * drained, so a record that needs a sequence number bypasses them
+     */
+    if (m_lanes && !seq) {
+      return append_to_lane(rec, tombstone);
+    }
+
+    size_t tail = 0;
+    if (m_lanes) {
+      if (!try_reserve_slots(1)) {
+        drain_lanes();
+        if (!try_reserve_slots(1)) {
+          return 0;
+        }
+      }
+
+      tail = m_tail.fetch_add(1);
+    } else if (!try_advance_tail(1, &tail)) {
       return 0;
     }
 
@@ -72,40 +241,186 @@ public:
 
     // FIXME: because of the mod, it isn't correct to use `pos`
     //        as the ordering timestamp in the header anymore.
-    size_t pos = tail % m_cap;
+    auto slot = m_table.get(tail);
 
-    m_data[pos] = wrec;
-    m_data[pos].set_timestamp(pos);
+    *slot = wrec;
+    slot->set_timestamp(tail % m_cap);
 
     if (tombstone) {
-      m_tscnt.fetch_add(1);
-      if (m_tombstone_filter)
-        m_tombstone_filter->insert(rec);
+      record_tombstones(tail, 1);
+      m_table.get_filter(tail)->insert(rec);
     }
 
-    m_data[pos].set_visible();
+    slot->set_visible();
+    record_written(tail, 1);
+    publish(tail, 1);
+
+    if (seq) {
+      *seq = tail + 1;
+    }
+
+    return 1;
+  }
+
+  /*
+   * Append up to cnt records from recs into the buffer, reserving all
+   * of the necessary slots with a single atomic operation. If the high
+   * watermark would be exceeded, only a prefix of recs will be appended.
+   * Returns the number of records that were appended, which may be 0
+   * if the buffer is full.
+   */
+  size_t append_batch(const R *recs, size_t cnt, bool tombstone = false) {
+    size_t tail = 0;
+    size_t reserved = 0;
+
+    if (m_lanes) {
+      /*
+       * in multi-lane mode, the slots must be reserved against the high
+       * watermark before the tail itself can be advanced.
+       */
+      reserved = try_reserve_slots(cnt);
+      tail = m_tail.fetch_add(reserved);
+    } else {
+      reserved = try_advance_tail(cnt, &tail);
+    }
+
+    if (reserved == 0) {
+      return 0;
+    }
+
+    write_run(recs, tail, reserved, tombstone);
+
+    if (tombstone) {
+      record_tombstones(tail, reserved);
+    }
+
+    /*
+     * records are only made visible once the entire batch has been
+     * written
+     */
+    for (size_t i = 0; i < reserved; i++) {
+      m_table.get(tail + i)->set_visible();
+    }
+
+    record_written(tail, reserved);
+    publish(tail, reserved);
+
+    return reserved;
+  }
+
+  /*
+   * Append the cnt records in recs into the buffer as a single unit,
+   * with the tombstone flag of each taken from its header. Either the
+   * whole batch is appended or none of it is, and the batch is published
+   * in one step, so a buffer view will contain all of its records or
+   * none of them. Returns 1 on success, and 0 if there is not enough
+   * room below the high watermark for the entire batch. If seq is not
+   * null, it is set on success to one past the position reserved for
+   * the last record in the batch, as in append.
+   */
+  int append_atomic(const Wrapped<R> *recs, size_t cnt,
+                    size_t *seq = nullptr) {
+    if (cnt == 0) {
+      if (seq) {
+        *seq = m_published.load();
+      }
+      return 1;
+    }
+
+    size_t tail = 0;
+    if (m_lanes) {
+      /*
+       * reservations held by the lanes may be all that is standing in
+       * the way, so reclaim them before giving up
+       */
+      if (!try_reserve_slots(cnt, false)) {
+        drain_lanes();
+        if (!try_reserve_slots(cnt, false)) {
+          return 0;
+        }
+      }
+
+      tail = m_tail.fetch_add(cnt);
+    } else if (!try_advance_tail(cnt, &tail, false)) {
+      return 0;
+    }
+
+    for (size_t i = 0; i < cnt; i++) {
+      auto slot = m_table.get(tail + i);
+      slot->rec = recs[i].rec;
+      slot->header = 0;
+      slot->set_timestamp((tail + i) % m_cap);
+
+      if (recs[i].is_tombstone()) {
+        slot->set_tombstone();
+        record_tombstones(tail + i, 1);
+        m_table.get_filter(tail + i)->insert(recs[i].rec);
+      }
+    }
+
+    for (size_t i = 0; i < cnt; i++) {
+      m_table.get(tail + i)->set_visible();
+    }
+
+    record_written(tail, cnt);
+    publish(tail, cnt);
+
+    if (seq) {
+      *seq = tail + cnt;
+    }
 
     return 1;
   }
 
   bool truncate() {
-    m_tscnt.store(0);
     m_tail.store(0);
-    if (m_tombstone_filter)
-      m_tombstone_filter->clear();
+    m_published.store(0);
+    m_reserved.store(0);
+    m_next_retire = 0;
+    for (size_t i = 0; i < m_lane_cnt; i++) {
+      m_lanes[i].reccnt = 0;
+      m_lanes[i].reserved = 0;
+    }
+    reset_runs();
+
+    for (size_t i = 0; i < m_ts_counter_cnt; i++) {
+      m_ts_counts[i].store(0);
+    }
+
+    for (size_t i = 0; i <= m_table.slot_mask; i++) {
+      if (auto filter = m_table.filters[i].load()) {
+        filter->clear();
+      }
+    }
 
     return true;
   }
 
-  size_t get_record_count() { return m_tail.load() - m_head.load().head_idx; }
+  size_t get_record_count() {
+    return m_published.load() - m_head.load();
+  }
 
   size_t get_capacity() { return m_cap; }
 
-  bool is_full() { return get_record_count() >= m_hwm; }
+  bool is_full() { return get_reserved_count() >= get_record_limit(); }
+
+  /*
+   * Returns true if at least one more record can currently be appended.
+   * Unlike is_full, this also accounts for the physical capacity, so it
+   * is false while a lagging generation still covers the storage that
+   * the next record would need, even if the buffer is below its record
+   * limit.
+   */
+  bool can_append() {
+    size_t tail = (m_lanes) ? m_reserved.load() : m_tail.load();
+    return get_reservable_count(tail, 1) > 0;
+  }
 
   bool is_at_low_watermark() { return get_record_count() >= m_lwm; }
 
-  size_t get_tombstone_count() { return m_tscnt.load(); }
+  size_t get_tombstone_count() {
+    return get_buffer_view().get_tombstone_count();
+  }
 
   bool delete_record(const R &rec) {
     return get_buffer_view().delete_record(rec);
@@ -115,84 +430,135 @@ public:
     return get_buffer_view().check_tombstone(rec);
   }
 
-  size_t get_memory_usage() { return m_cap * sizeof(Wrapped<R>); }
+  size_t get_memory_usage() {
+    return m_allocated_segs.load() * m_table.get_segment_size() *
+           sizeof(Wrapped<R>);
+  }
 
   size_t get_aux_memory_usage() {
-    return m_tombstone_filter->get_memory_usage();
+    return m_allocated_segs.load() * m_filter_size +
+           m_run_cnt * sizeof(BufferRun);
   }
 
+  /*
+   * Returns a view of the buffer starting at target_head. The caller
+   * must already hold a reference to that generation (see
+   * take_head_reference), or it may have been reclaimed.
+   */
   BufferView<R> get_buffer_view(size_t target_head) {
-    size_t head = get_head(target_head);
-    auto f = std::bind(release_head_reference, (void *)this, head);
+    drain_lanes();
+    bool referenced = take_head_reference(target_head);
+    assert(referenced);
+    (void)referenced;
+
+    auto f = [this, target_head]() { release_head_reference(target_head); };
 
-    return BufferView<R>(m_data, m_cap, head, m_tail.load(), m_tscnt.load(),
-                         m_tombstone_filter, f);
+    return BufferView<R>(m_table, m_cap, target_head, m_published.load(),
+                         {m_ts_counts, m_ts_counter_cnt}, f, m_runs,
+                         m_run_cnt);
   }
 
   BufferView<R> get_buffer_view() {
-    size_t head = get_head(m_head.load().head_idx);
-    auto f = std::bind(release_head_reference, (void *)this, head);
+    drain_lanes();
+
+    /*
+     * the current generation is never reclaimed, so this can only fail
+     * if the head was advanced (and the prior generation reclaimed)
+     * between the two loads
+     */
+    size_t head;
+    do {
+      head = m_head.load();
+    } while (!take_head_reference(head));
+
+    auto f = [this, head]() { release_head_reference(head); };
 
-    return BufferView<R>(m_data, m_cap, head, m_tail.load(), m_tscnt.load(),
-                         m_tombstone_filter, f);
+    return BufferView<R>(m_table, m_cap, head, m_published.load(),
+                         {m_ts_counts, m_ts_counter_cnt}, f, m_runs,
+                         m_run_cnt);
   }
 
   /*
-   * Advance the buffer following a reconstruction. Move current
-   * head and head_refcnt into old_head and old_head_refcnt, then
-   * assign new_head to old_head.
+   * Advance the buffer following a reconstruction, registering new_head
+   * as a new generation and making it current. The generation that was
+   * current is reclaimed once it has no remaining references, without
+   * affecting any other generations. Returns false if every generation
+   * slot is still in use, in which case the head is not advanced.
    */
   bool advance_head(size_t new_head) {
-    assert(new_head > m_head.load().head_idx);
-    assert(new_head <= m_tail.load());
+    assert(new_head > m_head.load());
+    assert(new_head <= m_published.load());
 
-    /* refuse to advance head while there is an old with one references */
-    if (m_old_head.load().refcnt > 0) {
-      // fprintf(stderr, "[W]: Refusing to advance head due to remaining
-      // reference counts\n");
-      return false;
+    bool registered = false;
+    for (size_t i = 0; i < HEAD_SLOT_CNT && !registered; i++) {
+      buffer_head free_hd = {NO_HEAD, 0};
+      registered = m_heads[i].head.compare_exchange_strong(
+          free_hd, buffer_head{new_head, 0});
     }
 
-    m_active_head_advance.store(true);
-
-    buffer_head new_hd = {new_head, 0};
-    buffer_head cur_hd;
-
-    /* replace current head with new head */
-    do {
-      cur_hd = m_head.load();
-    } while (!m_head.compare_exchange_strong(cur_hd, new_hd));
+    if (!registered) {
+      return false;
+    }
 
-    /* move the current head into the old head */
-    m_old_head.store(cur_hd);
+    /*
+     * a reference to the old generation released before this point will
+     * not have reclaimed it, as it was still current, so it must be
+     * checked for here
+     */
+    size_t old_head = m_head.exchange(new_head);
+    reclaim_head(old_head);
 
-    m_active_head_advance.store(false);
     return true;
   }
 
   /*
-   * FIXME: If target_head does not match *either* the old_head or the
-   * current_head, this routine will loop infinitely.
+   * Take a reference to the generation of the buffer starting at
+   * target_head, preventing it from being reclaimed until a matching
+   * call to release_head_reference. Returns false if no such generation
+   * exists.
    */
-  size_t get_head(size_t target_head) {
-    buffer_head cur_hd, new_hd;
-    bool head_acquired = false;
+  bool take_head_reference(size_t target_head) {
+    for (size_t i = 0; i < HEAD_SLOT_CNT; i++) {
+      auto hd = m_heads[i].head.load();
+      while (hd.head_idx == target_head) {
+        if (m_heads[i].head.compare_exchange_weak(
+                hd, buffer_head{target_head, hd.refcnt + 1})) {
+          return true;
+        }
+      }
+    }
 
-    do {
-      if (m_old_head.load().head_idx == target_head) {
-        cur_hd = m_old_head.load();
-        cur_hd.head_idx = target_head;
-        new_hd = {cur_hd.head_idx, cur_hd.refcnt + 1};
-        head_acquired = m_old_head.compare_exchange_strong(cur_hd, new_hd);
-      } else if (m_head.load().head_idx == target_head) {
-        cur_hd = m_head.load();
-        cur_hd.head_idx = target_head;
-        new_hd = {cur_hd.head_idx, cur_hd.refcnt + 1};
-        head_acquired = m_head.compare_exchange_strong(cur_hd, new_hd);
+    return false;
+  }
+
+  void release_head_reference(size_t head) {
+    for (size_t i = 0; i < HEAD_SLOT_CNT; i++) {
+      auto hd = m_heads[i].head.load();
+      while (hd.head_idx == head) {
+        assert(hd.refcnt > 0);
+        if (m_heads[i].head.compare_exchange_weak(
+                hd, buffer_head{head, hd.refcnt - 1})) {
+          if (hd.refcnt == 1 && m_head.load() != head) {
+            reclaim_head(head);
+          }
+          return;
+        }
       }
-    } while (!head_acquired);
+    }
 
-    return new_hd.head_idx;
+    assert(false);
+  }
+
+  /*
+   * Set a function to be called whenever a generation of the buffer is
+   * reclaimed, which frees up a generation slot, and possibly storage for
+   * further records. It is called by whichever thread releases the last
+   * reference to the generation, including from a BufferView's
+   * destructor, so it must not wait on anything that may be held while
+   * a view is released.
+   */
+  void set_reclaim_callback(std::function<void()> callback) {
+    m_reclaim_callback = std::move(callback);
   }
 
   void set_low_watermark(size_t lwm) {
@@ -210,89 +576,548 @@ public:
 
   size_t get_high_watermark() { return m_hwm; }
 
-  size_t get_tail() { return m_tail.load(); }
+  size_t get_tail() { return m_published.load(); }
+
+  size_t get_lane_count() { return m_lane_cnt; }
+
+  bool is_growable() { return m_cap > m_base_cap; }
+
+  bool has_sorted_runs() { return m_runs != nullptr; }
 
   /*
    * Note: this returns the available physical storage capacity,
    * *not* now many more records can be inserted before the
-   * HWM is reached. It considers the old_head to be "free"
-   * when it has no remaining references. This should be true,
-   * but a buggy framework implementation may violate the
-   * assumption.
+   * HWM is reached. Records are considered to be "free" once
+   * every generation of the buffer containing them has been
+   * reclaimed.
    */
   size_t get_available_capacity() {
-    if (m_old_head.load().refcnt == 0) {
-      return m_cap - (m_tail.load() - m_head.load().head_idx);
-    }
-
-    return m_cap - (m_tail.load() - m_old_head.load().head_idx);
+    return m_cap - (m_tail.load() - m_oldest_head.load());
   }
 
 private:
-  int64_t try_advance_tail() {
+  /*
+   * Attempt to reserve cnt contiguous slots at the end of the buffer. If
+   * fewer than cnt slots remain below the high watermark, as many as are
+   * available will be reserved instead, unless partial is false, in
+   * which case nothing will be. Returns the number of slots that were
+   * reserved, and places the position of the first one in start.
+   */
+  size_t try_advance_tail(size_t cnt, size_t *start, bool partial = true) {
     size_t old_value = m_tail.load();
+    size_t reserved = 0;
 
-    /* if full, fail to advance the tail */
-    if (old_value - m_head.load().head_idx >= m_hwm) {
-      return -1;
-    }
-
-    while (!m_tail.compare_exchange_strong(old_value, old_value + 1)) {
+    do {
       /* if full, stop trying and fail to advance the tail */
-      if (m_tail.load() >= m_hwm) {
-        return -1;
+      reserved = get_reservable_count(old_value, cnt);
+      if (reserved == 0 || (!partial && reserved < cnt)) {
+        return 0;
+      }
+
+      /* storage must exist before the new tail can be published */
+      ensure_segments(old_value, reserved);
+
+      if (m_tail.compare_exchange_strong(old_value, old_value + reserved)) {
+        break;
+      }
+
+      _mm_pause();
+    } while (true);
+
+    *start = old_value;
+    return reserved;
+  }
+
+  /*
+   * Reserve up to cnt slots against the high watermark in multi-lane
+   * mode, without advancing the tail. As with try_advance_tail, no slots
+   * are reserved if partial is false and fewer than cnt are available.
+   * Returns the number of slots that were reserved.
+   */
+  size_t try_reserve_slots(size_t cnt, bool partial = true) {
+    size_t old_value = m_reserved.load();
+    size_t reserved = 0;
+
+    do {
+      reserved = get_reservable_count(old_value, cnt);
+      if (reserved == 0 || (!partial && reserved < cnt)) {
+        return 0;
+      }
+
+      /*
+       * the tail never passes the reserved position, so ensuring the
+       * storage here covers every record later written by the lanes
+       */
+      ensure_segments(old_value, reserved);
+
+      if (m_reserved.compare_exchange_strong(old_value,
+                                             old_value + reserved)) {
+        break;
       }
 
       _mm_pause();
+    } while (true);
+
+    return reserved;
+  }
+
+  /*
+   * Returns the number of slots, up to cnt, that can be reserved starting
+   * at position pos. The reservation is limited both by the record limit,
+   * relative to the current head, and by the physical capacity, relative
+   * to the oldest generation that is still referenced, so that records
+   * visible to a lagging view are never overwritten.
+   */
+  size_t get_reservable_count(size_t pos, size_t cnt) {
+    size_t reccnt = pos - m_head.load();
+    size_t limit = get_record_limit();
+    if (reccnt >= limit) {
+      return 0;
     }
 
-    return old_value;
+    size_t used = pos - m_oldest_head.load();
+    if (used >= m_cap) {
+      return 0;
+    }
+
+    return std::min({cnt, limit - reccnt, m_cap - used});
   }
 
-  size_t to_idx(size_t i, size_t head) { return (head + i) % m_cap; }
+  /*
+   * Returns the maximum number of records that may be held in the buffer
+   * at once. This is the high watermark, unless the buffer is growable.
+   */
+  size_t get_record_limit() {
+    return (is_growable()) ? std::max<size_t>(m_hwm.load(), m_cap / 2)
+                           : m_hwm.load();
+  }
 
-  static void release_head_reference(void *buff, size_t head) {
-    MutableBuffer<R> *buffer = (MutableBuffer<R> *)buff;
+  /*
+   * Ensure that storage has been allocated for the cnt positions
+   * starting at start. This is called before the reservation itself is
+   * made, so a request from a failed attempt may be stale. A segment's
+   * slot is only ever handed to a newer segment, and a segment that has
+   * already been retired is never given storage again, as
+   * retire_segments would not free it.
+   */
+  void ensure_segments(size_t start, size_t cnt) {
+    if (cnt == 0) {
+      return;
+    }
 
-    buffer_head cur_hd, new_hd;
-    do {
-      if (buffer->m_old_head.load().head_idx == head) {
-        cur_hd = buffer->m_old_head;
-        if (cur_hd.refcnt == 0)
-          continue;
-        new_hd = {cur_hd.head_idx, cur_hd.refcnt - 1};
-        if (buffer->m_old_head.compare_exchange_strong(cur_hd, new_hd)) {
-          break;
-        }
+    size_t last = (start + cnt - 1) >> m_table.seg_shift;
+    for (size_t seg = start >> m_table.seg_shift; seg <= last; seg++) {
+      size_t slot = seg & m_table.slot_mask;
+      if (m_segment_ids[slot].load(std::memory_order_acquire) == seg) {
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lk(m_segment_lk);
+      size_t id = m_segment_ids[slot].load();
+      if (seg < m_next_retire || (id != NO_SEGMENT && id >= seg)) {
+        continue;
+      }
+
+      /* reuse the storage of the slot's previous segment, if it has any */
+      if (!m_table.segments[slot].load()) {
+        auto [seg_data, filter] = allocate_segment();
+        m_table.filters[slot].store(filter, std::memory_order_release);
+        m_table.segments[slot].store(seg_data, std::memory_order_release);
       } else {
-        cur_hd = buffer->m_head;
-        if (cur_hd.refcnt == 0)
-          continue;
-        new_hd = {cur_hd.head_idx, cur_hd.refcnt - 1};
+        m_table.filters[slot].load()->clear();
+      }
+      m_segment_ids[slot].store(seg, std::memory_order_release);
+    }
+  }
 
-        if (buffer->m_head.compare_exchange_strong(cur_hd, new_hd)) {
-          break;
+  /*
+   * Free the slot of the unreferenced generation starting at head, if it
+   * has not already been reclaimed, and release any storage that is no
+   * longer visible to any generation as a result. Both the final release
+   * of a reference and the head advance may try to reclaim the same
+   * generation, but only one will succeed.
+   */
+  void reclaim_head(size_t head) {
+    for (size_t i = 0; i < HEAD_SLOT_CNT; i++) {
+      buffer_head hd = {head, 0};
+      if (m_heads[i].head.compare_exchange_strong(hd,
+                                                  buffer_head{NO_HEAD, 0})) {
+        retire_segments();
+
+        if (m_reclaim_callback) {
+          m_reclaim_callback();
         }
+        return;
+      }
+    }
+  }
+
+  /*
+   * Recompute the oldest referenced generation, and release the storage
+   * for every segment that lies entirely before it. Generations are only
+   * ever registered at or beyond the current head, so the oldest one can
+   * only move forward, and as this is serialized by m_segment_lk, a stale
+   * result can never be stored over a newer one.
+   */
+  void retire_segments() {
+    std::unique_lock<std::mutex> lk(m_segment_lk);
+
+    size_t head = m_head.load();
+    for (size_t i = 0; i < HEAD_SLOT_CNT; i++) {
+      head = std::min(head, m_heads[i].head.load().head_idx);
+    }
+    m_oldest_head.store(head);
+
+    size_t end = head >> m_table.seg_shift;
+    for (; m_next_retire < end; m_next_retire++) {
+      size_t slot = m_next_retire & m_table.slot_mask;
+      if (m_segment_ids[slot].load() != m_next_retire) {
+        continue;
       }
+
+      release_segment(m_table.segments[slot].exchange(nullptr),
+                      m_table.filters[slot].exchange(nullptr));
+      m_segment_ids[slot].store(NO_SEGMENT);
+    }
+  }
+
+  /*
+   * Allocate and free segments, along with their tombstone filters.
+   * Freed segments are kept for reuse, rather than deallocated, for as
+   * long as no more segments are allocated than are needed to cover the
+   * base capacity. The caller must hold m_segment_lk.
+   */
+  std::pair<Wrapped<R> *, psudb::BloomFilter<R> *> allocate_segment() {
+    if (m_segment_pool.size() > 0) {
+      auto seg = m_segment_pool.back();
+      auto filter = m_filter_pool.back();
+      m_segment_pool.pop_back();
+      m_filter_pool.pop_back();
+      return {seg, filter};
+    }
+
+    m_allocated_segs.fetch_add(1);
+    return {new Wrapped<R>[m_table.get_segment_size()](),
+            new psudb::BloomFilter<R>(BF_FPR, m_table.get_segment_size(),
+                                      BF_HASH_FUNCS)};
+  }
+
+  /*
+   * A released segment's filter is cleared immediately, so that the
+   * cost of doing so falls on the thread advancing the head, rather than
+   * on an inserting thread when the segment is reused.
+   */
+  void release_segment(Wrapped<R> *seg, psudb::BloomFilter<R> *filter) {
+    if (m_allocated_segs.load() <= m_base_segs) {
+      filter->clear();
+      m_segment_pool.push_back(seg);
+      m_filter_pool.push_back(filter);
+      return;
+    }
+
+    m_allocated_segs.fetch_sub(1);
+    delete[] seg;
+    delete filter;
+  }
+
+  /*
+   * Returns the number of records in the buffer, including (in multi-lane
+   * mode) slots that have been reserved by a lane but not yet filled.
+   */
+  size_t get_reserved_count() {
+    size_t tail = (m_lanes) ? m_reserved.load() : m_tail.load();
+    return tail - m_head.load();
+  }
+
+  static size_t get_lane_id() {
+    static std::atomic<size_t> next_id = 0;
+    static thread_local size_t lane_id = next_id.fetch_add(1);
+    return lane_id;
+  }
+
+  void lock_lane(insert_lane &lane) {
+    bool unlocked = false;
+    while (!lane.lock.compare_exchange_weak(unlocked, true,
+                                            std::memory_order_acquire)) {
+      unlocked = false;
       _mm_pause();
-    } while (true);
+    }
   }
 
-  size_t m_lwm;
-  size_t m_hwm;
+  void unlock_lane(insert_lane &lane) {
+    lane.lock.store(false, std::memory_order_release);
+  }
+
+  int append_to_lane(const R &rec, bool tombstone) {
+    auto &lane = m_lanes[get_lane_id() % m_lane_cnt];
+    lock_lane(lane);
+
+    if (!reserve_lane_slot(lane)) {
+      /*
+       * other lanes may be sitting on reservations that they aren't
+       * using. Reclaim them and try again before giving up. The lane's
+       * lock must be released first, as draining will lock every lane.
+       */
+      unlock_lane(lane);
+      drain_lanes();
+      lock_lane(lane);
+
+      if (!reserve_lane_slot(lane)) {
+        unlock_lane(lane);
+        return 0;
+      }
+    }
+
+    auto &wrec = lane.data[lane.reccnt++];
+    wrec.rec = rec;
+    wrec.header = 0;
+    if (tombstone)
+      wrec.set_tombstone();
+
+    unlock_lane(lane);
+    return 1;
+  }
+
+  /*
+   * Ensure that lane has a reserved slot available for the next record,
+   * reserving a new block of slots if necessary. Returns false if the
+   * high watermark has been reached. The caller must hold the lane's
+   * lock.
+   */
+  bool reserve_lane_slot(insert_lane &lane) {
+    if (lane.reccnt < lane.reserved) {
+      return true;
+    }
+
+    if (lane.reccnt == LANE_CAPACITY) {
+      drain_lane(lane, false);
+    }
+
+    lane.reserved += try_reserve_slots(LANE_CAPACITY - lane.reserved);
+    return lane.reccnt < lane.reserved;
+  }
+
+  /*
+   * Move the staged records from lane into the buffer. The slots for them
+   * have already been reserved, so this cannot fail. If release is true,
+   * any unused reservation held by the lane is returned to the buffer,
+   * otherwise it is retained. The caller must hold the lane's lock.
+   */
+  void drain_lane(insert_lane &lane, bool release) {
+    if (release && lane.reserved > lane.reccnt) {
+      m_reserved.fetch_sub(lane.reserved - lane.reccnt);
+      lane.reserved = lane.reccnt;
+    }
+
+    if (lane.reccnt == 0) {
+      return;
+    }
+
+    size_t tail = m_tail.fetch_add(lane.reccnt);
+
+    for (size_t i = 0; i < lane.reccnt; i++) {
+      auto slot = m_table.get(tail + i);
+      *slot = lane.data[i];
+      slot->set_timestamp((tail + i) % m_cap);
+
+      if (lane.data[i].is_tombstone()) {
+        record_tombstones(tail + i, 1);
+        m_table.get_filter(tail + i)->insert(lane.data[i].rec);
+      }
+    }
+
+    for (size_t i = 0; i < lane.reccnt; i++) {
+      m_table.get(tail + i)->set_visible();
+    }
+    record_written(tail, lane.reccnt);
+    publish(tail, lane.reccnt);
+
+    lane.reserved -= lane.reccnt;
+    lane.reccnt = 0;
+  }
+
+  /*
+   * Move the staged records from every lane into the buffer, and release
+   * all unused reservations.
+   */
+  void drain_lanes() {
+    for (size_t i = 0; i < m_lane_cnt; i++) {
+      /* skip over idle lanes without taking the lock */
+      if (m_lanes[i].reserved.load(std::memory_order_acquire) == 0) {
+        continue;
+      }
+
+      lock_lane(m_lanes[i]);
+      drain_lane(m_lanes[i], true);
+      unlock_lane(m_lanes[i]);
+    }
+  }
+
+  void write_run(const R *recs, size_t start, size_t cnt, bool tombstone) {
+    for (size_t i = 0; i < cnt; i++) {
+      auto slot = m_table.get(start + i);
+      slot->rec = recs[i];
+      slot->header = 0;
+      slot->set_timestamp((start + i) % m_cap);
+
+      if (tombstone) {
+        slot->set_tombstone();
+        m_table.get_filter(start + i)->insert(recs[i]);
+      }
+    }
+  }
+
+  /*
+   * Note that the cnt records starting at position pos have been written
+   * and made visible. If this completes any blocks, build their sorted
+   * runs. Each position is written exactly once, and the blocks sharing a
+   * run are filled one after the other, so a block is complete when the
+   * running count of records written into its run reaches a multiple of
+   * BUFFER_RUN_SIZE.
+   */
+  void record_written(size_t pos, size_t cnt) {
+    if (!m_runs) {
+      return;
+    }
+
+    while (cnt > 0) {
+      size_t blk = pos / BUFFER_RUN_SIZE;
+      size_t blk_cnt = std::min(cnt, (blk + 1) * BUFFER_RUN_SIZE - pos);
+
+      auto &run = m_runs[blk % m_run_cnt];
+      size_t written = run.written.fetch_add(blk_cnt) + blk_cnt;
+      if (written % BUFFER_RUN_SIZE == 0) {
+        build_run(blk);
+      }
+
+      pos += blk_cnt;
+      cnt -= blk_cnt;
+    }
+  }
+
+  /*
+   * Publish the cnt records written starting at position pos, making
+   * them visible to new buffer views. Records are published in the
+   * order in which their slots were reserved, so this waits for any
+   * earlier writers to publish their own records first. This wait is
+   * normally only as long as it takes to copy a record into the buffer,
+   * but an earlier writer may have been descheduled, so the thread
+   * yields if it goes on for long.
+   */
+  void publish(size_t pos, size_t cnt) {
+    for (size_t i = 0; m_published.load(std::memory_order_acquire) != pos;
+         i++) {
+      if (i < PUBLISH_SPIN_CNT) {
+        _mm_pause();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+
+    m_published.store(pos + cnt, std::memory_order_release);
+  }
+
+  void build_run(size_t blk) {
+    auto &run = m_runs[blk % m_run_cnt];
+    size_t base = blk * BUFFER_RUN_SIZE;
+
+    for (size_t i = 0; i < BUFFER_RUN_SIZE; i++) {
+      run.idx[i] = i;
+    }
+
+    std::sort(run.idx, run.idx + BUFFER_RUN_SIZE,
+              [this, base](uint32_t a, uint32_t b) {
+                return *m_table.get(base + a) < *m_table.get(base + b);
+              });
+
+    run.block.store(blk, std::memory_order_release);
+  }
+
+  /*
+   * Add cnt tombstones, written at positions [pos, pos + cnt), to the
+   * counts of the blocks containing them.
+   */
+  void record_tombstones(size_t pos, size_t cnt) {
+    while (cnt > 0) {
+      size_t blk = pos / BUFFER_TS_BLOCK_SIZE;
+      size_t blk_cnt =
+          std::min(cnt, (blk + 1) * BUFFER_TS_BLOCK_SIZE - pos);
+
+      TombstoneCounter{m_ts_counts, m_ts_counter_cnt}.add(blk, blk_cnt);
+      pos += blk_cnt;
+      cnt -= blk_cnt;
+    }
+  }
+
+  void reset_runs() {
+    for (size_t i = 0; i < m_run_cnt; i++) {
+      m_runs[i].block.store(SIZE_MAX);
+      m_runs[i].written.store(0);
+    }
+  }
+
+  /*
+   * the watermarks may be adjusted while the buffer is in use, so they
+   * are atomic
+   */
+  std::atomic<size_t> m_lwm;
+  std::atomic<size_t> m_hwm;
+
+  /* the initially allocated capacity, and the maximum capacity */
+  size_t m_base_cap;
   size_t m_cap;
 
   alignas(64) std::atomic<size_t> m_tail;
 
-  alignas(64) std::atomic<buffer_head> m_head;
-  alignas(64) std::atomic<buffer_head> m_old_head;
+  /*
+   * The position below which every slot has been written. Slots are
+   * reserved by advancing m_tail before they are written, so views
+   * must end here instead, or they could read a slot's previous
+   * contents. This will always be at most m_tail.
+   */
+  alignas(64) std::atomic<size_t> m_published;
+
+  /*
+   * In multi-lane mode, the position up to which slots have been
+   * reserved by lanes. This will always be at least m_tail.
+   */
+  alignas(64) std::atomic<size_t> m_reserved;
+
+  /* the current head, and the start of the oldest referenced generation */
+  alignas(64) std::atomic<size_t> m_head;
+  alignas(64) std::atomic<size_t> m_oldest_head;
+
+  head_slot m_heads[HEAD_SLOT_CNT];
+
+  static constexpr size_t NO_SEGMENT = SIZE_MAX;
+
+  SegmentTable<R> m_table;
+
+  /* the number of the segment currently stored in each slot of m_table */
+  std::atomic<size_t> *m_segment_ids;
+
+  std::mutex m_segment_lk;
+  std::vector<Wrapped<R> *> m_segment_pool;
+  std::vector<psudb::BloomFilter<R> *> m_filter_pool;
+  size_t m_filter_size;
+  size_t m_base_segs;
+  std::atomic<size_t> m_allocated_segs;
+  size_t m_next_retire;
+
+  /*
+   * as with the runs, there must be enough counters that one is never
+   * reused while its block is still within the ring
+   */
+  size_t m_ts_counter_cnt;
+  std::atomic<uint64_t> *m_ts_counts;
+
+  size_t m_lane_cnt;
+  insert_lane *m_lanes;
 
-  Wrapped<R> *m_data;
-  psudb::BloomFilter<R> *m_tombstone_filter;
-  alignas(64) std::atomic<size_t> m_tscnt;
-  size_t m_old_tscnt;
+  size_t m_run_cnt;
+  BufferRun *m_runs;
 
-  alignas(64) std::atomic<bool> m_active_head_advance;
+  std::function<void()> m_reclaim_callback;
 };
 
 } // namespace de
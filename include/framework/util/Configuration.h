@@ -17,4 +17,6 @@ enum class LayoutPolicy { LEVELING, TEIRING, BSM };
 
 enum class DeletePolicy { TOMBSTONE, TAGGING };
 
+enum class AffinityPolicy { NONE, COMPACT, SCATTER };
+
 } // namespace de
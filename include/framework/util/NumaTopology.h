@@ -0,0 +1,188 @@
+/*
+ * include/framework/util/NumaTopology.h
+ *
+ * Copyright (C) 2023-2024 Douglas B. Rumbaugh <drumbaugh@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ * A description of the NUMA nodes of the system, and of the CPUs that
+ * belong to each of them, used to decide where the framework's worker
+ * threads should run. The framework does not bind memory explicitly.
+ * Instead, it relies upon the kernel's default first-touch policy, under
+ * which memory is placed on the node of the thread that first writes to
+ * it. Shards are built by pinned worker threads, and so are placed on
+ * the nodes of the CPUs selected for those threads. This does not apply
+ * to the buffer: its segments are allocated and zeroed when it is
+ * created, and are recycled rather than freed, so the buffer resides on
+ * the node of the thread that created it, whichever threads insert into
+ * it.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include "framework/util/Configuration.h"
+
+namespace de {
+
+class NumaTopology {
+public:
+  /*
+   * Create a topology with a single node containing all of the
+   * system's CPUs.
+   */
+  NumaTopology() {
+    size_t cpu_cnt = std::max(1u, std::thread::hardware_concurrency());
+
+    m_nodes.emplace_back();
+    for (size_t i = 0; i < cpu_cnt; i++) {
+      m_nodes[0].push_back(i);
+    }
+  }
+
+  /*
+   * Create a topology from an explicit list of the CPUs within each
+   * node. Nodes without any CPUs are ignored.
+   */
+  NumaTopology(std::vector<std::vector<int>> nodes) {
+    for (auto &node : nodes) {
+      if (node.size() > 0) {
+        m_nodes.emplace_back(std::move(node));
+      }
+    }
+
+    if (m_nodes.size() == 0) {
+      *this = NumaTopology();
+    }
+  }
+
+  /*
+   * Read the system's topology from sysfs. If this information is
+   * unavailable, a single node topology is returned.
+   */
+  static NumaTopology
+  discover(const std::string &sysfs_path = "/sys/devices/system/node") {
+    std::vector<std::vector<int>> nodes;
+
+    /*
+     * node numbering is not necessarily contiguous, so allow for some
+     * gaps before giving up. Only consecutive missing nodes are counted.
+     */
+    for (size_t i = 0, missing = 0; missing < 8; i++) {
+      std::ifstream f(sysfs_path + "/node" + std::to_string(i) + "/cpulist");
+      if (!f.is_open()) {
+        missing++;
+        continue;
+      }
+
+      missing = 0;
+      std::string cpulist;
+      std::getline(f, cpulist);
+      nodes.emplace_back(parse_cpulist(cpulist));
+    }
+
+    return NumaTopology(std::move(nodes));
+  }
+
+  size_t get_node_count() const { return m_nodes.size(); }
+
+  const std::vector<int> &get_node_cpus(size_t node) const {
+    return m_nodes[node];
+  }
+
+  /*
+   * Returns the node containing cpu, or -1 if it is not part of the
+   * topology.
+   */
+  int get_node_of_cpu(int cpu) const {
+    for (size_t i = 0; i < m_nodes.size(); i++) {
+      if (std::find(m_nodes[i].begin(), m_nodes[i].end(), cpu) !=
+          m_nodes[i].end()) {
+        return i;
+      }
+    }
+
+    return -1;
+  }
+
+  /*
+   * Returns the CPU to be used by the idx-th worker thread. Under
+   * COMPACT, the CPUs of each node are used up before moving on to the
+   * next one. Under SCATTER, consecutive threads are placed on different
+   * nodes.
+   */
+  int get_cpu(size_t idx, AffinityPolicy policy) const {
+    if (policy == AffinityPolicy::SCATTER) {
+      auto &node = m_nodes[idx % m_nodes.size()];
+      return node[(idx / m_nodes.size()) % node.size()];
+    }
+
+    size_t cpu_cnt = 0;
+    for (auto &node : m_nodes) {
+      cpu_cnt += node.size();
+    }
+
+    idx %= cpu_cnt;
+    for (auto &node : m_nodes) {
+      if (idx < node.size()) {
+        return node[idx];
+      }
+      idx -= node.size();
+    }
+
+    /* unreachable */
+    return m_nodes[0][0];
+  }
+
+  /*
+   * Returns the CPU that the calling thread is currently running on, or
+   * -1 if this cannot be determined.
+   */
+  static int get_current_cpu() {
+#ifdef _GNU_SOURCE
+    return sched_getcpu();
+#else
+    return -1;
+#endif
+  }
+
+  /* parse a list of CPU ranges in the kernel's format, e.g. "0-3,8,10-11" */
+  static std::vector<int> parse_cpulist(const std::string &cpulist) {
+    std::vector<int> cpus;
+    std::stringstream ss(cpulist);
+    std::string range;
+
+    while (std::getline(ss, range, ',')) {
+      if (range.empty()) {
+        continue;
+      }
+
+      auto dash = range.find('-');
+      int first = std::atoi(range.substr(0, dash).c_str());
+      int last = (dash == std::string::npos)
+                     ? first
+                     : std::atoi(range.substr(dash + 1).c_str());
+
+      for (int cpu = first; cpu <= last; cpu++) {
+        cpus.push_back(cpu);
+      }
+    }
+
+    return cpus;
+  }
+
+private:
+  std::vector<std::vector<int>> m_nodes;
+};
+
+} // namespace de
@@ -0,0 +1,125 @@
+/*
+ * include/framework/util/WatermarkController.h
+ *
+ * Copyright (C) 2023-2024 Douglas B. Rumbaugh <drumbaugh@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ * A feedback controller for the buffer watermarks. The time between a
+ * flush being triggered at the low watermark and the buffer head being
+ * advanced must be covered by the space between the low and high
+ * watermarks, or inserts will stall. The controller tracks the rate at
+ * which records arrive and the time taken by reconstructions, and
+ * selects watermarks that leave enough headroom to absorb one
+ * reconstruction at the observed insert rate. Both estimates jump
+ * immediately to larger observations and decay slowly after them, so
+ * that the watermarks respond quickly to the start of a burst.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <utility>
+
+namespace de {
+
+class WatermarkController {
+  typedef std::chrono::steady_clock clock;
+
+  /* the weight given to a new sample when an estimate is decaying */
+  static constexpr double DECAY = 0.25;
+
+  /* multiplier applied to the estimated headroom, as a safety margin */
+  static constexpr double SLACK = 2.0;
+
+public:
+  /*
+   * The low watermark will be kept within [min_lwm, max_lwm], and the
+   * high watermark within [min_hwm, max_hwm]. The high watermark will
+   * always be kept above the low watermark.
+   */
+  WatermarkController(size_t min_lwm, size_t max_lwm, size_t min_hwm,
+                      size_t max_hwm)
+      : m_min_lwm(min_lwm), m_max_lwm(max_lwm), m_min_hwm(min_hwm),
+        m_max_hwm(max_hwm), m_insert_rate(0), m_recon_time(0),
+        m_last_tail(0), m_recon_start(clock::now()),
+        m_last_sample(m_recon_start) {
+    assert(m_min_lwm <= m_max_lwm);
+    assert(m_min_hwm <= m_max_hwm);
+    assert(m_max_lwm < m_max_hwm);
+  }
+
+  /*
+   * Called when a reconstruction is scheduled, with the buffer's current
+   * tail, to sample the insert rate. Only one reconstruction can be
+   * pending at a time, so this is never called concurrently with
+   * itself or with reconstruction_complete.
+   */
+  void reconstruction_scheduled(size_t tail) {
+    auto now = clock::now();
+    double elapsed = std::chrono::duration<double>(now - m_last_sample).count();
+
+    if (tail > m_last_tail && elapsed > 0) {
+      update(m_insert_rate, (tail - m_last_tail) / elapsed);
+    }
+
+    m_last_tail = tail;
+    m_last_sample = now;
+    m_recon_start = now;
+  }
+
+  /*
+   * Called once the buffer head has been advanced by the reconstruction,
+   * to sample the reconstruction time.
+   */
+  void reconstruction_complete() {
+    update(m_recon_time,
+           std::chrono::duration<double>(clock::now() - m_recon_start).count());
+  }
+
+  /*
+   * Returns the watermarks that should be used for the next flush, as
+   * a (low, high) pair.
+   */
+  std::pair<size_t, size_t> get_watermarks() {
+    size_t headroom = m_insert_rate * m_recon_time * SLACK;
+
+    /*
+     * The larger the low watermark, the fewer (and larger) the flushes,
+     * so use the largest one that leaves sufficient headroom below the
+     * largest permissible high watermark. Then, shrink the high
+     * watermark as far as that headroom allows.
+     */
+    size_t lwm = (headroom < m_max_hwm) ? m_max_hwm - headroom : 0;
+    lwm = std::clamp(lwm, m_min_lwm, m_max_lwm);
+
+    size_t hwm = std::max(lwm + headroom, m_min_hwm);
+    hwm = std::clamp(hwm, lwm + 1, m_max_hwm);
+
+    return {lwm, hwm};
+  }
+
+private:
+  size_t m_min_lwm;
+  size_t m_max_lwm;
+  size_t m_min_hwm;
+  size_t m_max_hwm;
+
+  /* estimated records per second, and seconds per reconstruction */
+  double m_insert_rate;
+  double m_recon_time;
+
+  size_t m_last_tail;
+  clock::time_point m_recon_start;
+  clock::time_point m_last_sample;
+
+  static void update(double &estimate, double sample) {
+    estimate = (sample > estimate)
+                   ? sample
+                   : (1 - DECAY) * estimate + DECAY * sample;
+  }
+};
+
+} // namespace de
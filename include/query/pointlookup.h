@@ -13,6 +13,9 @@
  * the search_key (including tombstone cancellation--it's invertible) to
  * support non-unique indexes, or at least those implementing
  * lower_bound().
+ *
+ * Records satisfying UpsertInterface are not supported, as the lookup may
+ * return a version of the key that has been shadowed by a newer one.
  */
 #pragma once
 
@@ -23,6 +26,8 @@ namespace pl {
 
 template <ShardInterface S> class Query {
   typedef typename S::RECORD R;
+  static_assert(!UpsertInterface<R>,
+                "point lookups do not skip shadowed upsert versions");
 
 public:
   struct Parameters {
@@ -80,15 +85,15 @@ public:
   static std::vector<LocalResultType>
   local_query_buffer(LocalQueryBuffer *query) {
     std::vector<LocalResultType> result;
-
-    for (size_t i = 0; i < query->buffer->get_record_count(); i++) {
-      auto rec = query->buffer->get(i);
-
-      if (rec->rec.key == query->global_parms.search_key) {
-        result.push_back(*rec);
-        return result;
-      }
-    }
+    auto key = query->global_parms.search_key;
+
+    query->buffer->range_scan(
+        [key](auto rec) { return rec->rec.key < key; },
+        [key](auto rec) { return key < rec->rec.key; },
+        [&result](auto rec) {
+          result.push_back(*rec);
+          return false;
+        });
 
     return result;
   }
@@ -8,6 +8,9 @@
  * A query class for single dimensional range count queries. This query
  * requires that the shard support get_lower_bound(key) and
  * get_record_at(index).
+ *
+ * Records satisfying UpsertInterface are not supported, as the count
+ * would include every shadowed version of a key.
  */
 #pragma once
 
@@ -18,6 +21,8 @@ namespace rc {
 
 template <ShardInterface S, bool FORCE_SCAN = true> class Query {
   typedef typename S::RECORD R;
+  static_assert(!UpsertInterface<R>,
+                "range counts do not skip shadowed upsert versions");
 
 public:
   struct Parameters {
@@ -46,6 +51,8 @@ public:
 
   typedef size_t ResultType;
   constexpr static bool EARLY_ABORT = false;
+  constexpr static bool PARALLEL_LOCAL_QUERIES = true;
+  constexpr static bool REUSABLE_LOCAL_RESULTS = true;
   constexpr static bool SKIP_DELETE_FILTER = true;
 
   static LocalQuery *local_preproc(S *shard, Parameters *parms) {
@@ -124,18 +131,19 @@ public:
     std::vector<LocalResultType> result;
     size_t reccnt = 0;
     size_t tscnt = 0;
-    for (size_t i = 0; i < query->buffer->get_record_count(); i++) {
-      auto rec = query->buffer->get(i);
-      if (rec->rec.key >= query->global_parms.lower_bound &&
-          rec->rec.key <= query->global_parms.upper_bound) {
-        if (!rec->is_deleted()) {
-          reccnt++;
-          if (rec->is_tombstone()) {
-            tscnt++;
+    auto parms = &query->global_parms;
+    query->buffer->range_scan(
+        [parms](auto rec) { return rec->rec.key < parms->lower_bound; },
+        [parms](auto rec) { return rec->rec.key > parms->upper_bound; },
+        [&](auto rec) {
+          if (!rec->is_deleted()) {
+            reccnt++;
+            if (rec->is_tombstone()) {
+              tscnt++;
+            }
           }
-        }
-      }
-    }
+          return true;
+        });
 
     result.push_back({reccnt, tscnt});
 
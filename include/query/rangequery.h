@@ -7,9 +7,13 @@
  *
  * A query class for single dimensional range queries. This query requires
  * that the shard support get_lower_bound(key) and get_record_at(index).
+ * For records satisfying UpsertInterface, only the newest version of each
+ * key within the range is returned.
  */
 #pragma once
 
+#include <algorithm>
+
 #include "framework/QueryRequirements.h"
 #include "framework/interface/Record.h"
 #include "psu-ds/PriorityQueue.h"
@@ -42,6 +46,8 @@ public:
   typedef R ResultType;
 
   constexpr static bool EARLY_ABORT = false;
+  constexpr static bool PARALLEL_LOCAL_QUERIES = true;
+  constexpr static bool REUSABLE_LOCAL_RESULTS = true;
   constexpr static bool SKIP_DELETE_FILTER = true;
 
   static LocalQuery *local_preproc(S *shard, Parameters *parms) {
@@ -105,12 +111,51 @@ public:
   local_query_buffer(LocalQueryBuffer *query) {
 
     std::vector<LocalResultType> result;
-    for (size_t i = 0; i < query->buffer->get_record_count(); i++) {
-      auto rec = query->buffer->get(i);
-      if (rec->rec.key >= query->global_parms.lower_bound &&
-          rec->rec.key <= query->global_parms.upper_bound) {
-        result.emplace_back(*rec);
+    auto parms = &query->global_parms;
+    query->buffer->range_scan(
+        [parms](auto rec) { return rec->rec.key < parms->lower_bound; },
+        [parms](auto rec) { return rec->rec.key > parms->upper_bound; },
+        [&result](auto rec) {
+          result.emplace_back(*rec);
+          return true;
+        });
+
+    /*
+     * the results are not in order, which combine only depends upon
+     * when the buffer holds tombstones, which must be placed directly
+     * after the records they cancel, or when versions of a key must be
+     * matched up. Otherwise, the sort is only done when the buffer keeps
+     * sorted runs, so that the output is ordered as it would be if the
+     * records had come from shards.
+     */
+    if (!UpsertInterface<R> && !query->buffer->has_sorted_runs() &&
+        query->buffer->get_tombstone_count() == 0) {
+      return result;
+    }
+
+    std::sort(result.begin(), result.end(), [](auto &a, auto &b) {
+      return a.rec < b.rec ||
+             (a.rec == b.rec && !a.is_tombstone() && b.is_tombstone());
+    });
+
+    /*
+     * combine expects at most one version of each key from each local
+     * result, so only the one that was written last is kept
+     */
+    if constexpr (UpsertInterface<R>) {
+      size_t cnt = 0;
+      for (size_t i = 0; i < result.size(); i++) {
+        if (cnt > 0 && result[cnt - 1].rec.key_equals(result[i].rec)) {
+          if (query->buffer->get_offset(result[i]) >
+              query->buffer->get_offset(result[cnt - 1])) {
+            result[cnt - 1] = result[i];
+          }
+          continue;
+        }
+
+        result[cnt++] = result[i];
       }
+      result.resize(cnt);
     }
 
     return result;
@@ -146,6 +191,34 @@ public:
 
     while (pq.size()) {
       auto now = pq.peek();
+
+      if constexpr (UpsertInterface<R>) {
+        /*
+         * the local results are ordered from newest to oldest, and so
+         * the version of a key with the highest version number in the
+         * queue shadows all of the others
+         */
+        auto newest = now;
+        do {
+          pq.pop();
+          if (now.version > newest.version) {
+            newest = now;
+          }
+
+          auto &cursor = cursors[tmp_n - now.version - 1];
+          if (advance_cursor<LocalResultType>(cursor))
+            pq.push(cursor.ptr, now.version);
+
+          now = pq.size() ? pq.peek()
+                          : psudb::queue_record<LocalResultType>{nullptr, 0};
+        } while (now.data && now.data->rec.key_equals(newest.data->rec));
+
+        if (!newest.data->is_tombstone() && !newest.data->is_deleted())
+          output.push_back(newest.data->rec);
+
+        continue;
+      }
+
       auto next = pq.size() > 1
                       ? pq.peek(1)
                       : psudb::queue_record<LocalResultType>{nullptr, 0};
@@ -162,7 +235,7 @@ public:
           pq.push(cursor2.ptr, next.version);
       } else {
         auto &cursor = cursors[tmp_n - now.version - 1];
-        if (!now.data->is_tombstone())
+        if (!now.data->is_tombstone() && !now.data->is_deleted())
           output.push_back(cursor.ptr->rec);
 
         pq.pop();
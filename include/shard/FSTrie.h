@@ -48,26 +48,19 @@ public:
         keys.reserve(buffer.get_record_count());
 
         /*
-         * Copy the contents of the buffer view into a temporary buffer, and
-         * sort them. We still need to iterate over these temporary records to 
-         * apply tombstone/deleted record filtering, as well as any possible
-         * per-record processing that is required by the shard being built.
+         * Copy the contents of the buffer view directly into the shard's
+         * storage in sorted order, and then filter out deleted records in
+         * place. The write position never passes the read position, so no
+         * temporary copy is needed.
          */
-        auto temp_buffer = new Wrapped<R>[buffer.get_record_count()]();
-        for (size_t i=0; i<buffer.get_record_count(); i++) {
-            temp_buffer[i] = *(buffer.get(i));
-        }
-
-        auto base = temp_buffer;
-        auto stop = base + buffer.get_record_count();
-        std::sort(base, stop, std::less<Wrapped<R>>());
+        buffer.copy_to_buffer_sorted(m_data);
 
         for (size_t i=0; i<buffer.get_record_count(); i++) {
-            if (temp_buffer[i].is_deleted() || !temp_buffer[i].is_visible() || temp_buffer[i].rec.key == "") {
+            if (m_data[i].is_deleted() || !m_data[i].is_visible() || m_data[i].rec.key == "") {
                 continue;
             }
 
-            m_data[cnt] = temp_buffer[i];
+            m_data[cnt] = m_data[i];
             m_data[cnt].clear_timestamp();
 
             keys.push_back(std::string(m_data[cnt].rec.key));
@@ -79,7 +72,6 @@ public:
             m_fst = new fst::Trie(keys, true, 1);
         }
 
-        delete[] temp_buffer;
     }
 
     FSTrie(std::vector<FSTrie*> const &shards) 
@@ -48,7 +48,12 @@ private:
 public:
   typedef R RECORD;
 
-  ISAMTree(BufferView<R> buffer)
+  /*
+   * drop_tombstones is set by the framework when the new shard will hold
+   * the oldest records in the structure, and allows the tombstones of
+   * upsert records to be discarded (see SortedMerge.h).
+   */
+  ISAMTree(BufferView<R> buffer, bool drop_tombstones = false)
       : m_bf(nullptr), m_isam_nodes(nullptr), m_root(nullptr), m_reccnt(0),
         m_tombstone_cnt(0), m_internal_node_cnt(0), m_deleted_cnt(0),
         m_alloc_size(0) {
@@ -56,7 +61,8 @@ public:
         CACHELINE_SIZE, buffer.get_record_count() * sizeof(Wrapped<R>),
         (byte **)&m_data);
 
-    auto res = sorted_array_from_bufferview(std::move(buffer), m_data, m_bf);
+    auto res = sorted_array_from_bufferview(std::move(buffer), m_data, m_bf,
+                                            drop_tombstones);
     m_reccnt = res.record_count;
     m_tombstone_cnt = res.tombstone_count;
 
@@ -65,7 +71,7 @@ public:
     }
   }
 
-  ISAMTree(std::vector<ISAMTree *> const &shards)
+  ISAMTree(std::vector<ISAMTree *> const &shards, bool drop_tombstones = false)
       : m_bf(nullptr), m_isam_nodes(nullptr), m_root(nullptr), m_reccnt(0),
         m_tombstone_cnt(0), m_internal_node_cnt(0), m_deleted_cnt(0),
         m_alloc_size(0) {
@@ -78,7 +84,7 @@ public:
     m_alloc_size = psudb::sf_aligned_alloc(
         CACHELINE_SIZE, attemp_reccnt * sizeof(Wrapped<R>), (byte **)&m_data);
 
-    auto res = sorted_array_merge<R>(cursors, m_data, m_bf);
+    auto res = sorted_array_merge<R>(cursors, m_data, m_bf, drop_tombstones);
     m_reccnt = res.record_count;
     m_tombstone_cnt = res.tombstone_count;
 
@@ -52,56 +52,12 @@ public:
                                                (byte**) &m_data);
 
         std::vector<K> keys;
-        /*
-         * Copy the contents of the buffer view into a temporary buffer, and
-         * sort them. We still need to iterate over these temporary records to 
-         * apply tombstone/deleted record filtering, as well as any possible
-         * per-record processing that is required by the shard being built.
-         */
-        auto temp_buffer = (Wrapped<R> *) psudb::sf_aligned_calloc(CACHELINE_SIZE, 
-                                                                   buffer.get_record_count(), 
-                                                                   sizeof(Wrapped<R>));
-        buffer.copy_to_buffer((byte *) temp_buffer);
-
-        auto base = temp_buffer;
-        auto stop = base + buffer.get_record_count();
-        std::sort(base, stop, std::less<Wrapped<R>>());
-
-        merge_info info = {0, 0};
-
-        /* 
-         * Iterate over the temporary buffer to process the records, copying
-         * them into buffer as needed
-         */
-        while (base < stop) {
-            if (!base->is_tombstone() && (base + 1 < stop)
-                && base->rec == (base + 1)->rec  && (base + 1)->is_tombstone()) {
-                base += 2;
-                continue;
-            } else if (base->is_deleted()) {
-                base += 1;
-                continue;
-            }
-
-            // FIXME: this shouldn't be necessary, but the tagged record
-            // bypass doesn't seem to be working on this code-path, so this
-            // ensures that tagged records from the buffer are able to be
-            // dropped, eventually. It should only need to be &= 1
-            base->header &= 3;
-            keys.emplace_back(base->rec.key);
-            m_data[info.record_count++] = *base;
-
-            if (base->is_tombstone()) {
-                info.tombstone_count++;
-                if (m_bf){
-                    m_bf->insert(base->rec);
-                }
-            }
-
-            base++;
-        }
+        keys.reserve(buffer.get_record_count());
 
-        free(temp_buffer);
+        auto info = sorted_array_from_bufferview<R>(std::move(buffer), m_data, m_bf,
+                                                    [&keys](const Wrapped<R> &rec) {
+                                                        keys.emplace_back(rec.rec.key);
+                                                    });
 
         m_reccnt = info.record_count;
         m_tombstone_cnt = info.tombstone_count;
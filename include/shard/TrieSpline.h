@@ -50,75 +50,26 @@ public:
                                                  sizeof(Wrapped<R>), 
                                                (byte**) &m_data);
 
-        /*
-         * Copy the contents of the buffer view into a temporary buffer, and
-         * sort them. We still need to iterate over these temporary records to 
-         * apply tombstone/deleted record filtering, as well as any possible
-         * per-record processing that is required by the shard being built.
-         */
-        auto temp_buffer = (Wrapped<R> *) psudb::sf_aligned_calloc(CACHELINE_SIZE, 
-                                                                   buffer.get_record_count(), 
-                                                                   sizeof(Wrapped<R>));
-        buffer.copy_to_buffer((byte *) temp_buffer);
-
-        auto base = temp_buffer;
-        auto stop = base + buffer.get_record_count();
-        std::sort(base, stop, std::less<Wrapped<R>>());
-
-        auto tmp_min_key = temp_buffer[0].rec.key;
-        auto tmp_max_key = temp_buffer[buffer.get_record_count() - 1].rec.key;
-        auto bldr = ts::Builder<K>(tmp_min_key, tmp_max_key, E);
-
-        merge_info info = {0, 0};
+        auto info = sorted_array_from_bufferview<R>(std::move(buffer), m_data, m_bf);
+        m_reccnt = info.record_count;
+        m_tombstone_cnt = info.tombstone_count;
 
-        m_min_key = tmp_max_key;
-        m_max_key = tmp_min_key;
+        if (m_reccnt == 0) {
+            return;
+        }
 
         /* 
-         * Iterate over the temporary buffer to process the records, copying
-         * them into buffer as needed
+         * the builder requires the key range up front, so the keys are
+         * added in a second pass over the (already sorted) shard data
          */
-        while (base < stop) {
-            if (!base->is_tombstone() && (base + 1 < stop)
-                && base->rec == (base + 1)->rec  && (base + 1)->is_tombstone()) {
-                base += 2;
-                continue;
-            } else if (base->is_deleted()) {
-                base += 1;
-                continue;
-            }
-
-            // FIXME: this shouldn't be necessary, but the tagged record
-            // bypass doesn't seem to be working on this code-path, so this
-            // ensures that tagged records from the buffer are able to be
-            // dropped, eventually. It should only need to be &= 1
-            base->header &= 3;
-            bldr.AddKey(base->rec.key);
-            m_data[info.record_count++] = *base;
-
-            if (base->is_tombstone()) {
-                info.tombstone_count++;
-                if (m_bf){
-                    m_bf->insert(base->rec);
-                }
-            }
-
-            if (base->rec.key < m_min_key) {
-                m_min_key = base->rec.key;
-            } 
+        m_min_key = m_data[0].rec.key;
+        m_max_key = m_data[m_reccnt - 1].rec.key;
+        auto bldr = ts::Builder<K>(m_min_key, m_max_key, E);
 
-            if (base->rec.key > m_max_key) {
-                m_max_key = base->rec.key;
-            }
-
-            base++;
+        for (size_t i=0; i<m_reccnt; i++) {
+            bldr.AddKey(m_data[i].rec.key);
         }
 
-        free(temp_buffer);
-
-        m_reccnt = info.record_count;
-        m_tombstone_cnt = info.tombstone_count;
-
         if (m_reccnt > 50) {
             m_ts = bldr.Finalize();
         }
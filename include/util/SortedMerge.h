@@ -10,12 +10,13 @@
  * the necessary tombstone-cancellation logic.
  *
  * FIXME: include generic per-record processing functionality for Shards that
- * need it, to avoid needing to reprocess the array in the shard after
- * creation.
+ * need it in the merge routines as well, to avoid needing to reprocess the
+ * array in the shard after creation.
  */
 #pragma once
 
 #include <algorithm>
+#include <functional>
 
 #include "framework/interface/Shard.h"
 #include "psu-ds/PriorityQueue.h"
@@ -82,40 +83,65 @@ build_cursor_vec(std::vector<S *> const &shards, size_t *reccnt,
  * enough to store the records from the BufferView, or the behavior of the
  * function is undefined.
  *
- * It allocates a temporary buffer for the sorting, and execution of the
- * program will be aborted if the allocation fails.
+ * The records are sorted directly within buffer, and tombstone
+ * cancellation and deleted record filtering are then performed in place,
+ * so no temporary copy of the view is required. For records satisfying
+ * UpsertInterface, only the most recently written version of each key is
+ * retained, in place of tombstone cancellation. The process function is
+ * called on each record that is retained, in sorted order, to allow any
+ * per-record processing required by the shard to be done in the same pass.
+ *
+ * If drop_tombstones is set, the caller guarantees that there are no
+ * older records left in the structure for the resulting array's tombstones
+ * to shadow, and so a retained upsert tombstone is discarded instead. It
+ * has no effect on other records, whose tombstones are only removed by
+ * cancellation.
  */
-template <RecordInterface R>
+template <RecordInterface R, typename ProcessFunc>
 static merge_info
 sorted_array_from_bufferview(BufferView<R> bv, Wrapped<R> *buffer,
-                             psudb::BloomFilter<R> *bf = nullptr) {
-  /*
-   * Copy the contents of the buffer view into a temporary buffer, and
-   * sort them. We still need to iterate over these temporary records to
-   * apply tombstone/deleted record filtering, as well as any possible
-   * per-record processing that is required by the shard being built.
-   */
-  auto temp_buffer = (Wrapped<R> *)psudb::sf_aligned_calloc(
-      CACHELINE_SIZE, bv.get_record_count(), sizeof(Wrapped<R>));
-  bv.copy_to_buffer((byte *)temp_buffer);
+                             psudb::BloomFilter<R> *bf, ProcessFunc process,
+                             bool drop_tombstones = false) {
+  bv.copy_to_buffer_sorted(buffer);
 
-  auto base = temp_buffer;
+  auto base = buffer;
   auto stop = base + bv.get_record_count();
-  std::sort(base, stop, std::less<Wrapped<R>>());
 
   merge_info info = {0, 0};
 
   /*
-   * Iterate over the temporary buffer to process the records, copying
-   * them into buffer as needed
+   * Compact the surviving records towards the front of buffer. The write
+   * position never passes the read position, so nothing is overwritten
+   * before it has been processed.
    */
   while (base < stop) {
-    if (!base->is_tombstone() && (base + 1 < stop) &&
-        base->rec == (base + 1)->rec && (base + 1)->is_tombstone()) {
+    auto keep = base;
+
+    if constexpr (UpsertInterface<R>) {
+      /*
+       * every version of a key is adjacent in sorted order, and only the
+       * one that was written last is retained, even if it is a tombstone,
+       * so that it continues to shadow older versions in the structure
+       */
+      while (base + 1 < stop && (base + 1)->rec.key_equals(keep->rec)) {
+        base++;
+        if (bv.get_offset(*base) > bv.get_offset(*keep)) {
+          keep = base;
+        }
+      }
+
+      if (drop_tombstones && keep->is_tombstone()) {
+        base++;
+        continue;
+      }
+    } else if (!base->is_tombstone() && (base + 1 < stop) &&
+               base->rec == (base + 1)->rec && (base + 1)->is_tombstone()) {
       base += 2;
       continue;
-    } else if (base->is_deleted()) {
-      base += 1;
+    }
+
+    base++;
+    if (keep->is_deleted()) {
       continue;
     }
 
@@ -123,20 +149,182 @@ sorted_array_from_bufferview(BufferView<R> bv, Wrapped<R> *buffer,
     // bypass doesn't seem to be working on this code-path, so this
     // ensures that tagged records from the buffer are able to be
     // dropped, eventually. It should only need to be &= 1
-    base->header &= 3;
-    buffer[info.record_count++] = *base;
+    keep->header &= 3;
+    buffer[info.record_count] = *keep;
+    process(buffer[info.record_count]);
+    info.record_count++;
 
-    if (base->is_tombstone()) {
+    if (keep->is_tombstone()) {
       info.tombstone_count++;
       if (bf) {
-        bf->insert(base->rec);
+        bf->insert(keep->rec);
       }
     }
+  }
 
-    base++;
+  return info;
+}
+
+template <RecordInterface R>
+static merge_info
+sorted_array_from_bufferview(BufferView<R> bv, Wrapped<R> *buffer,
+                             psudb::BloomFilter<R> *bf = nullptr,
+                             bool drop_tombstones = false) {
+  return sorted_array_from_bufferview(
+      std::move(bv), buffer, bf, [](const Wrapped<R> &) {}, drop_tombstones);
+}
+
+/*
+ * A means of running the parts of a large merge in parallel, installed
+ * for the calling thread by a merge_executor_scope. parallel_for(cnt,
+ * work) must call work(i) for each i in [0, cnt), and return once every
+ * call has completed. A merge is split into at most part_cnt parts, each
+ * of at least MIN_MERGE_PART_SIZE records.
+ */
+struct merge_executor {
+  std::function<void(size_t, std::function<void(size_t)>)> parallel_for;
+  size_t part_cnt;
+};
+
+static const size_t MIN_MERGE_PART_SIZE = 1ul << 15;
+
+inline merge_executor *&current_merge_executor() {
+  static thread_local merge_executor *executor = nullptr;
+  return executor;
+}
+
+/*
+ * Use executor for the merges run by the calling thread for as long as
+ * the scope exists. Shards are built through their constructors, which
+ * have no way to receive an executor, so it is passed to
+ * sorted_array_merge on the side instead.
+ */
+class merge_executor_scope {
+public:
+  merge_executor_scope(merge_executor *executor)
+      : m_prev(current_merge_executor()) {
+    current_merge_executor() = executor;
+  }
+
+  ~merge_executor_scope() { current_merge_executor() = m_prev; }
+
+  merge_executor_scope(const merge_executor_scope &) = delete;
+  merge_executor_scope &operator=(const merge_executor_scope &) = delete;
+
+private:
+  merge_executor *m_prev;
+};
+
+/*
+ * Returns true if a should be merged before b, where records that the
+ * merge may cancel against one another, or choose between, compare equal.
+ * A merge can be split at any record without separating such records.
+ */
+template <RecordInterface R>
+static bool merge_split_less(const Wrapped<R> &a, const Wrapped<R> &b) {
+  if constexpr (UpsertInterface<R>) {
+    return a.rec.key < b.rec.key;
+  } else {
+    return a.rec < b.rec;
+  }
+}
+
+template <RecordInterface R>
+static merge_info serial_array_merge(std::vector<Cursor<Wrapped<R>>> &cursors,
+                                     Wrapped<R> *buffer,
+                                     psudb::BloomFilter<R> *bf,
+                                     bool drop_tombstones);
+
+/*
+ * Perform the merge of sorted_array_merge in part_cnt parts, divided by
+ * splitter records drawn from the largest cursor, so that each part
+ * covers a disjoint range of the output. The parts are merged in
+ * parallel using executor, each into the region of buffer where its
+ * first input record would have been placed had nothing been cancelled,
+ * and are then compacted to the front of buffer.
+ */
+template <RecordInterface R>
+static merge_info
+partitioned_array_merge(std::vector<Cursor<Wrapped<R>>> &cursors,
+                        Wrapped<R> *buffer, psudb::BloomFilter<R> *bf,
+                        bool drop_tombstones, size_t part_cnt,
+                        merge_executor *executor) {
+  size_t largest = 0;
+  for (size_t i = 1; i < cursors.size(); i++) {
+    if (cursors[i].end - cursors[i].ptr >
+        cursors[largest].end - cursors[largest].ptr) {
+      largest = i;
+    }
+  }
+
+  /*
+   * bounds[p][i] is the first record of cursor i within part p, and
+   * bounds[part_cnt] holds the ends of the cursors
+   */
+  size_t largest_cnt = cursors[largest].end - cursors[largest].ptr;
+  std::vector<std::vector<const Wrapped<R> *>> bounds(
+      part_cnt + 1, std::vector<const Wrapped<R> *>(cursors.size()));
+  for (size_t i = 0; i < cursors.size(); i++) {
+    bounds[0][i] = cursors[i].ptr;
+    bounds[part_cnt][i] = cursors[i].end;
+  }
+
+  for (size_t p = 1; p < part_cnt; p++) {
+    auto splitter = cursors[largest].ptr[p * largest_cnt / part_cnt];
+    for (size_t i = 0; i < cursors.size(); i++) {
+      bounds[p][i] = std::lower_bound(bounds[p - 1][i], cursors[i].end,
+                                      splitter, merge_split_less<R>);
+    }
+  }
+
+  std::vector<size_t> offsets(part_cnt, 0);
+  for (size_t p = 0; p < part_cnt; p++) {
+    for (size_t i = 0; i < cursors.size(); i++) {
+      offsets[p] += bounds[p][i] - cursors[i].ptr;
+    }
+  }
+
+  /*
+   * every cursor is kept in each part, even if it is empty there, so
+   * that the upsert merge can still tell the shards apart by position
+   */
+  std::vector<merge_info> infos(part_cnt);
+  executor->parallel_for(part_cnt, [&](size_t p) {
+    std::vector<Cursor<Wrapped<R>>> part(cursors.size());
+    for (size_t i = 0; i < cursors.size(); i++) {
+      size_t cnt = bounds[p + 1][i] - bounds[p][i];
+      part[i] = {bounds[p][i], bounds[p + 1][i], 0, cnt};
+    }
+
+    infos[p] = serial_array_merge<R>(part, buffer + offsets[p], nullptr,
+                                     drop_tombstones);
+  });
+
+  /*
+   * each part's output starts at or after the end of the compacted
+   * output of the parts before it, so the copies move records forward
+   * within buffer, and never overwrite a part before it has been moved
+   */
+  merge_info info = {0, 0};
+  for (size_t p = 0; p < part_cnt; p++) {
+    auto start = buffer + offsets[p];
+    if (start != buffer + info.record_count) {
+      std::copy(start, start + infos[p].record_count,
+                buffer + info.record_count);
+    }
+
+    if (bf && infos[p].tombstone_count > 0) {
+      for (size_t i = 0; i < infos[p].record_count; i++) {
+        if (buffer[info.record_count + i].is_tombstone()) {
+          bf->insert(buffer[info.record_count + i].rec);
+        }
+      }
+    }
+
+    info.record_count += infos[p].record_count;
+    info.tombstone_count += infos[p].tombstone_count;
   }
 
-  free(temp_buffer);
   return info;
 }
 
@@ -145,24 +333,95 @@ sorted_array_from_bufferview(BufferView<R> bv, Wrapped<R> *buffer,
  * buffer. Includes tombstone and tagged delete cancellation logic, and
  * will insert tombstones into a bloom filter, if one is provided.
  *
+ * For records satisfying UpsertInterface, only the newest version of each
+ * key is retained instead, and so the cursors must be ordered from the
+ * oldest shard to the newest. As above, drop_tombstones discards the
+ * retained version of a key if it is a tombstone.
+ *
+ * If a merge_executor has been installed for the calling thread, and the
+ * merge is large enough, it is split into parts that are merged in
+ * parallel (see partitioned_array_merge). The result is the same either
+ * way.
+ *
  * The behavior of this function is undefined if the provided buffer does
  * not have space to contain all of the records within the input cursors.
  */
 template <RecordInterface R>
 static merge_info sorted_array_merge(std::vector<Cursor<Wrapped<R>>> &cursors,
                                      Wrapped<R> *buffer,
-                                     psudb::BloomFilter<R> *bf = nullptr) {
+                                     psudb::BloomFilter<R> *bf = nullptr,
+                                     bool drop_tombstones = false) {
+  if (auto executor = current_merge_executor()) {
+    size_t reccnt = 0;
+    for (auto &cursor : cursors) {
+      reccnt += cursor.end - cursor.ptr;
+    }
+
+    size_t part_cnt =
+        std::min(executor->part_cnt, reccnt / MIN_MERGE_PART_SIZE);
+    if (part_cnt > 1) {
+      return partitioned_array_merge<R>(cursors, buffer, bf, drop_tombstones,
+                                        part_cnt, executor);
+    }
+  }
+
+  return serial_array_merge<R>(cursors, buffer, bf, drop_tombstones);
+}
+
+template <RecordInterface R>
+static merge_info serial_array_merge(std::vector<Cursor<Wrapped<R>>> &cursors,
+                                     Wrapped<R> *buffer,
+                                     psudb::BloomFilter<R> *bf,
+                                     bool drop_tombstones) {
 
   // FIXME: For smaller cursor arrays, it may be more efficient to skip
   //        the priority queue and just do a scan.
   PriorityQueue<Wrapped<R>> pq(cursors.size());
   for (size_t i = 0; i < cursors.size(); i++) {
-    pq.push(cursors[i].ptr, i);
+    /* a shard may be empty, if all of its records have been dropped */
+    if (cursors[i].ptr < cursors[i].end) {
+      pq.push(cursors[i].ptr, i);
+    }
   }
 
   merge_info info = {0, 0};
   while (pq.size()) {
     auto now = pq.peek();
+
+    if constexpr (UpsertInterface<R>) {
+      /*
+       * every version of a key is adjacent in sorted order, and each
+       * shard holds at most one of them, so the version retained is the
+       * one from the newest shard (the highest numbered cursor)
+       */
+      auto newest = now;
+      do {
+        pq.pop();
+        if (now.version > newest.version) {
+          newest = now;
+        }
+
+        auto &cursor = cursors[now.version];
+        if (advance_cursor(cursor))
+          pq.push(cursor.ptr, now.version);
+
+        now = pq.size() ? pq.peek() : queue_record<Wrapped<R>>{nullptr, 0};
+      } while (now.data && now.data->rec.key_equals(newest.data->rec));
+
+      if (!newest.data->is_deleted() &&
+          !(drop_tombstones && newest.data->is_tombstone())) {
+        buffer[info.record_count++] = *newest.data;
+        if (newest.data->is_tombstone()) {
+          info.tombstone_count++;
+          if (bf) {
+            bf->insert(newest.data->rec);
+          }
+        }
+      }
+
+      continue;
+    }
+
     auto next =
         pq.size() > 1 ? pq.peek(1) : queue_record<Wrapped<R>>{nullptr, 0};
     /*
@@ -103,7 +103,10 @@ public:
     total_reccnt += reccnt;
   }
 
-  void add_reconstruction(ReconstructionTask task) { m_tasks.push_back(task); }
+  void add_reconstruction(ReconstructionTask task) {
+    m_tasks.push_back(task);
+    total_reccnt += task.reccnt;
+  }
 
   ReconstructionTask remove_reconstruction(size_t idx) {
     assert(idx < m_tasks.size());
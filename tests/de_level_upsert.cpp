@@ -0,0 +1,179 @@
+/*
+ * tests/de_level_upsert.cpp
+ *
+ * Unit tests for Dynamic Extension Framework
+ *
+ * Copyright (C) 2023 Douglas Rumbaugh <drumbaugh@psu.edu> 
+ *                    Dong Xie <dongx@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ */
+#include <set>
+#include <random>
+#include <algorithm>
+
+#include "include/testing.h"
+#include "framework/DynamicExtension.h"
+#include "shard/ISAMTree.h"
+#include "query/rangequery.h"
+
+#include <check.h>
+using namespace de;
+
+typedef UpsertRecord<uint64_t, uint32_t> R;
+typedef ISAMTree<R> S;
+typedef rq::Query<S> Q;
+
+typedef DynamicExtension<S, Q, LayoutPolicy::LEVELING, DeletePolicy::TOMBSTONE, SerialScheduler> DE;
+
+
+START_TEST(t_upsert)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t keys = 500;
+    size_t rounds = 10;
+
+    /* every key is overwritten in each round */
+    for (size_t i=0; i<rounds; i++) {
+        for (size_t j=0; j<keys; j++) {
+            R r = {j, (uint32_t) i};
+            ck_assert_int_eq(test_de->insert(r), 1);
+        }
+    }
+
+    test_de->await_next_epoch();
+
+    /* the older versions should have been discarded during merges */
+    ck_assert_int_lt(test_de->get_record_count(), keys * rounds);
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = keys;
+    auto result = test_de->query(std::move(p)).get();
+
+    ck_assert_int_eq(result.size(), keys);
+    for (size_t i=0; i<result.size(); i++) {
+        ck_assert_int_eq(result[i].key, i);
+        ck_assert_int_eq(result[i].value, rounds - 1);
+    }
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_upsert_erase)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t keys = 500;
+
+    for (size_t i=0; i<keys; i++) {
+        R r = {i, 1};
+        ck_assert_int_eq(test_de->insert(r), 1);
+    }
+
+    /* the tombstone removes the key, whatever value it is given */
+    for (size_t i=0; i<keys; i+=2) {
+        R r = {i, 0};
+        ck_assert_int_eq(test_de->erase(r), 1);
+    }
+
+    /* a key can be reinserted after being erased */
+    R r = {0, 2};
+    ck_assert_int_eq(test_de->insert(r), 1);
+
+    test_de->await_next_epoch();
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = keys;
+    auto result = test_de->query(std::move(p)).get();
+
+    ck_assert_int_eq(result.size(), keys / 2 + 1);
+    ck_assert_int_eq(result[0].key, 0);
+    ck_assert_int_eq(result[0].value, 2);
+    for (size_t i=1; i<result.size(); i++) {
+        ck_assert_int_eq(result[i].key, 2*i - 1);
+        ck_assert_int_eq(result[i].value, 1);
+    }
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_upsert_tombstone_drop)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t keys = 500;
+
+    for (size_t i=0; i<keys; i++) {
+        R r = {i, 1};
+        ck_assert_int_eq(test_de->insert(r), 1);
+    }
+
+    for (size_t i=0; i<keys; i++) {
+        R r = {i, 0};
+        ck_assert_int_eq(test_de->erase(r), 1);
+    }
+
+    /* push the tombstones down into the deepest level */
+    for (size_t i=keys; i<10*keys; i++) {
+        R r = {i, 1};
+        ck_assert_int_eq(test_de->insert(r), 1);
+    }
+
+    test_de->await_next_epoch();
+
+    /*
+     * once merged into the deepest level, nothing older remains for the
+     * tombstones to shadow, and so they are dropped
+     */
+    ck_assert_int_eq(test_de->get_tombstone_count(), 0);
+    ck_assert_int_eq(test_de->get_record_count(), 9*keys);
+
+    auto flat = test_de->create_static_structure();
+    ck_assert_int_eq(flat->get_tombstone_count(), 0);
+    ck_assert_int_eq(flat->get_record_count(), 9*keys);
+
+    delete flat;
+    delete test_de;
+}
+END_TEST
+
+
+Suite *unit_testing()
+{
+    Suite *unit = suite_create("DynamicExtension: Upsert Leveling Testing");
+
+    TCase *upsert = tcase_create("de::DynamicExtension::upsert Testing");
+    tcase_add_test(upsert, t_upsert);
+    tcase_add_test(upsert, t_upsert_erase);
+    tcase_add_test(upsert, t_upsert_tombstone_drop);
+    suite_add_tcase(unit, upsert);
+
+    return unit;
+}
+
+
+int shard_unit_tests()
+{
+    int failed = 0;
+    Suite *unit = unit_testing();
+    SRunner *unit_shardner = srunner_create(unit);
+
+    srunner_run_all(unit_shardner, CK_NORMAL);
+    failed = srunner_ntests_failed(unit_shardner);
+    srunner_free(unit_shardner);
+
+    return failed;
+}
+
+
+int main() 
+{
+    int unit_failed = shard_unit_tests();
+
+    return (unit_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
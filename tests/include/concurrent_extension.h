@@ -133,6 +133,400 @@ START_TEST(t_insert_with_mem_merges)
 END_TEST
 
 
+START_TEST(t_insert_blocking)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    R r = {0, 0};
+    for (size_t i=0; i<100000; i++) {
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        r = R{r.key + 1, r.value + 1};
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), 100000);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_try_insert_for)
+{
+    auto test_de = new DE(100, 1000, 2);
+    test_de->set_insert_throttle(std::chrono::microseconds(1));
+
+    R r = {0, 0};
+    for (size_t i=0; i<20000; i++) {
+        ck_assert_int_eq(test_de->try_insert_for(r, std::chrono::seconds(10)), 1);
+        r = R{r.key + 1, r.value + 1};
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), 20000);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_adaptive_watermarks)
+{
+    auto test_de = new DE(100, 1000, 2);
+    auto fixed_de = new DE(100, 1000, 2);
+    test_de->enable_adaptive_watermarks(50, 900, 200);
+
+    R r = {0, 0};
+    for (size_t i=0; i<100000; i++) {
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        ck_assert_int_eq(fixed_de->insert_blocking(r), 1);
+        r = R{r.key + 1, r.value + 1};
+    }
+
+    test_de->await_next_epoch();
+    fixed_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), 100000);
+
+    /* the watermarks are only moved when adaptive watermarks are enabled */
+    auto [fixed_lwm, fixed_hwm] = fixed_de->get_buffer_watermarks();
+    ck_assert_int_eq(fixed_lwm, 100);
+    ck_assert_int_eq(fixed_hwm, 1000);
+
+    /* and then stay within the configured bounds */
+    auto [lwm, hwm] = test_de->get_buffer_watermarks();
+    ck_assert(lwm != 100 || hwm != 1000);
+    ck_assert_int_ge(lwm, 50);
+    ck_assert_int_le(lwm, 900);
+    ck_assert_int_ge(hwm, 200);
+    ck_assert_int_le(hwm, 1000);
+    ck_assert_int_lt(lwm, hwm);
+
+    delete test_de;
+    delete fixed_de;
+}
+END_TEST
+
+
+START_TEST(t_growable_buffer)
+{
+    auto test_de = new DE(100, 1000, 2, 0, 16, 0, false, 20000);
+
+    R r = {0, 0};
+    for (size_t i=0; i<100000; i++) {
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        r = R{r.key + 1, r.value + 1};
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), 100000);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_background_merges)
+{
+    auto test_de = new DE(100, 1000, 2);
+    auto fg_de = new DE(100, 1000, 2);
+    fg_de->set_background_merges(false);
+
+    size_t n = 200000;
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        ck_assert_int_eq(fg_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+    fg_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), n);
+    ck_assert_int_eq(fg_de->get_record_count(), n);
+
+    Q::Parameters p;
+    p.lower_bound = 1000;
+    p.upper_bound = 150999;
+
+    auto r1 = test_de->query(Q::Parameters(p)).get();
+    auto r2 = fg_de->query(std::move(p)).get();
+    std::sort(r1.begin(), r1.end());
+    std::sort(r2.begin(), r2.end());
+
+    ck_assert_int_eq(r1.size(), 150000);
+    ck_assert_int_eq(r2.size(), r1.size());
+    for (size_t i=0; i<r1.size(); i++) {
+        ck_assert_int_eq(r1[i].key, 1000 + i);
+        ck_assert_int_eq(r2[i].key, r1[i].key);
+    }
+
+    delete test_de;
+    delete fg_de;
+}
+END_TEST
+
+
+START_TEST(t_background_merges_single_thread)
+{
+    /*
+     * with only one worker, a background reconstruction cannot wait on
+     * a flush that is queued behind it, or neither will ever finish
+     */
+    auto test_de = new DE(100, 1000, 2, 0, 1);
+
+    size_t n = 200000;
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->get_record_count(), n);
+
+    Q::Parameters p;
+    p.lower_bound = 1000;
+    p.upper_bound = 150999;
+
+    auto result = test_de->query(std::move(p)).get();
+    ck_assert_int_eq(result.size(), 150000);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_memory_budget)
+{
+    /*
+     * every reconstruction exceeds the budget on its own, and so they run
+     * one at a time, with a flush held back whenever a background
+     * reconstruction is in progress, and vice versa
+     */
+    size_t budget = 1000 * sizeof(R);
+    auto test_de = new DE(100, 1000, 2, budget, 4);
+    auto single_de = new DE(100, 1000, 2, budget, 1);
+
+    size_t n = 200000;
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        ck_assert_int_eq(single_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+    single_de->await_next_epoch();
+
+    ck_assert_int_eq(test_de->get_record_count(), n);
+    ck_assert_int_eq(single_de->get_record_count(), n);
+
+    /* the background merges must have pushed records out of L0 */
+    ck_assert_int_gt(test_de->get_height(), 1);
+    ck_assert_int_gt(single_de->get_height(), 1);
+
+    Q::Parameters p;
+    p.lower_bound = 1000;
+    p.upper_bound = 150999;
+
+    auto r1 = test_de->query(Q::Parameters(p)).get();
+    auto r2 = single_de->query(std::move(p)).get();
+    ck_assert_int_eq(r1.size(), 150000);
+    ck_assert_int_eq(r2.size(), 150000);
+
+    delete test_de;
+    delete single_de;
+}
+END_TEST
+
+
+#include "framework/scheduling/PriorityScheduler.h"
+
+/*
+ * Wraps a scheduler, and checks that the memory budget that it is given
+ * holds up against the sizes of the jobs actually run on it. Reconstruction
+ * jobs (type 2) larger than the budget are counted, along with those
+ * scheduled while another sized job admitted against the same budget was
+ * running, which must have been deferred. The scheduler is created by the
+ * framework, so the counters are shared by every instance.
+ */
+template <SchedulerInterface SchedType>
+class BudgetCheckScheduler {
+public:
+    BudgetCheckScheduler(size_t memory_budget, size_t thread_cnt)
+        : m_sched(memory_budget, thread_cnt) {
+        budget = memory_budget;
+    }
+
+    void schedule_job(de::Job job, size_t size, void *args, size_t type=0) {
+        if (size == 0) {
+            m_sched.schedule_job(job, size, args, type);
+            return;
+        }
+
+        bool oversized = (type == 2 && size > budget);
+        {
+            std::unique_lock<std::mutex> lk(lock);
+            if (oversized) {
+                oversized_cnt++;
+                if (running.size() > 0) {
+                    deferred_cnt++;
+                }
+            }
+        }
+
+        m_sched.schedule_job([job, size, type, oversized](void *args) {
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                for (auto &job : running) {
+                    if (oversized || job.second) {
+                        overlap_cnt++;
+                    }
+                }
+                running.push_back({type, oversized});
+            }
+
+            job(args);
+
+            std::unique_lock<std::mutex> lk(lock);
+            running.erase(std::find(running.begin(), running.end(),
+                                    std::pair<size_t, bool>{type, oversized}));
+        }, size, args, type);
+    }
+
+    void shutdown() { m_sched.shutdown(); }
+    void print_statistics() { m_sched.print_statistics(); }
+
+    static void reset() {
+        oversized_cnt = 0;
+        deferred_cnt = 0;
+        overlap_cnt = 0;
+    }
+
+    static inline size_t budget;
+    static inline std::mutex lock;
+    static inline std::vector<std::pair<size_t, bool>> running;
+    static inline size_t oversized_cnt;
+    static inline size_t deferred_cnt;
+    static inline size_t overlap_cnt;
+
+private:
+    SchedType m_sched;
+};
+
+/* the type of DE, with its scheduler wrapped in a BudgetCheckScheduler */
+template <typename T> struct budget_checked;
+
+template <typename S_, typename Q_, LayoutPolicy L_, DeletePolicy D_,
+          typename Sched>
+struct budget_checked<DynamicExtension<S_, Q_, L_, D_, Sched>> {
+    typedef Sched scheduler;
+    typedef BudgetCheckScheduler<Sched> checker;
+    typedef DynamicExtension<S_, Q_, L_, D_, checker> type;
+};
+
+
+START_TEST(t_memory_budget_background_merges)
+{
+    typedef budget_checked<DE> checked;
+    typedef checked::type CDE;
+    checked::checker::reset();
+
+    /*
+     * background merges are far larger than the budget, and so must not
+     * run alongside any other reconstruction. Each is scheduled by the
+     * flush that precedes it, while the flush is still running, and so
+     * must be deferred until it has finished.
+     */
+    size_t budget = 1000 * sizeof(R);
+    auto test_de = new CDE(100, 1000, 2, budget, 4);
+
+    size_t n = 100000;
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->get_record_count(), n);
+    delete test_de;
+
+    ck_assert_int_gt(checked::checker::oversized_cnt, 0);
+    ck_assert_int_gt(checked::checker::deferred_cnt, 0);
+    ck_assert_int_eq(checked::checker::overlap_cnt, 0);
+}
+END_TEST
+
+
+START_TEST(t_flush_headroom)
+{
+    /*
+     * a flush may use the headroom that is held back from the other
+     * reconstructions, and so is started alongside a reconstruction that
+     * has taken the rest of the budget, while another reconstruction that
+     * would only fit by using the headroom is deferred
+     */
+    size_t budget = 1000;
+    auto sched = new PriorityScheduler(budget, 4, 1, 0.2);
+
+    std::atomic<bool> release = false;
+    std::mutex order_lock;
+    std::vector<char> order;
+    auto job = [&](char id, bool block) {
+        return [&, id, block](void *) {
+            {
+                std::unique_lock<std::mutex> lk(order_lock);
+                order.push_back(id);
+            }
+
+            while (block && !release.load()) {
+                std::this_thread::yield();
+            }
+        };
+    };
+
+    auto started = [&](size_t cnt) {
+        std::unique_lock<std::mutex> lk(order_lock);
+        return order.size() >= cnt;
+    };
+
+    /* a takes everything but the headroom, so b must wait */
+    sched->schedule_job(job('a', true), 800, nullptr, 2);
+    while (!started(1)) {
+        std::this_thread::yield();
+    }
+    sched->schedule_job(job('b', false), 150, nullptr, 2);
+
+    /* the headroom is enough for c, but not for d */
+    sched->schedule_job(job('c', false), 200, nullptr, 3);
+    while (!started(2)) {
+        std::this_thread::yield();
+    }
+    sched->schedule_job(job('d', false), 700, nullptr, 3);
+
+    /* a is the only job that can finish, so nothing else may start */
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ck_assert(!started(3));
+
+    /*
+     * once it does, the waiting flush goes ahead of the reconstruction,
+     * which does not fit alongside it
+     */
+    release.store(true);
+    sched->shutdown();
+    delete sched;
+
+    ck_assert_int_eq(order.size(), 4);
+    ck_assert_int_eq(order[0], 'a');
+    ck_assert_int_eq(order[1], 'c');
+    ck_assert_int_eq(order[2], 'd');
+    ck_assert_int_eq(order[3], 'b');
+}
+END_TEST
+
+
 START_TEST(t_range_query)
 {
     auto test_de = new DE(1000, 10000, 4);
@@ -186,6 +580,436 @@ START_TEST(t_range_query)
 END_TEST
 
 
+START_TEST(t_concurrent_readers)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t n = 20000;
+
+    /* readers repeatedly pin epochs while inserts keep replacing them */
+    std::vector<std::thread> readers;
+    std::atomic<size_t> failures = 0;
+    for (size_t i=0; i<4; i++) {
+        readers.emplace_back([&]() {
+            for (size_t j=0; j<2000; j++) {
+                if (test_de->get_record_count() > n) {
+                    failures.fetch_add(1);
+                }
+
+                Q::Parameters p;
+                p.lower_bound = 0;
+                p.upper_bound = 100;
+                if (test_de->query(std::move(p)).get().size() > 101) {
+                    failures.fetch_add(1);
+                }
+
+                std::this_thread::yield();
+            }
+        });
+    }
+
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(failures.load(), 0);
+    ck_assert_int_eq(test_de->get_record_count(), n);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_pin_churn)
+{
+    /* a small buffer, so that the current epoch is replaced often */
+    auto test_de = new DE(10, 100, 2);
+    size_t n = 30000;
+    std::atomic<bool> done = false;
+
+    /*
+     * many threads pin and release epochs against the same few epochs
+     * while inserts keep replacing them. Each releases exactly the pin it
+     * took, so none may hang releasing a pin that another thread has
+     * taken, and no epoch may be freed while a snapshot still uses it.
+     */
+    std::vector<std::thread> readers;
+    std::atomic<size_t> failures = 0;
+    for (size_t i=0; i<16; i++) {
+        readers.emplace_back([&]() {
+            for (size_t j=0; j<1000 || !done.load(); j++) {
+                if (test_de->get_record_count() > n) {
+                    failures.fetch_add(1);
+                }
+
+                auto snapshot = test_de->get_snapshot();
+                size_t reccnt = snapshot.get_record_count();
+                for (size_t j=0; j<10; j++) {
+                    test_de->get_height();
+                    std::this_thread::yield();
+                }
+
+                if (snapshot.get_record_count() != reccnt) {
+                    failures.fetch_add(1);
+                }
+            }
+        });
+    }
+
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    done.store(true);
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(failures.load(), 0);
+    ck_assert_int_eq(test_de->get_record_count(), n);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_preempted_queries)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t n = 50000;
+    std::atomic<size_t> inserted = 0;
+
+    /*
+     * full scans are long enough to hold up buffer flushes, and so will
+     * be preempted and restarted. Every record inserted before a scan
+     * begins must still be seen by it, and the results kept from shards
+     * that survive a restart must not be repeated by it.
+     */
+    std::vector<std::thread> readers;
+    std::atomic<size_t> failures = 0;
+    for (size_t i=0; i<2; i++) {
+        readers.emplace_back([&]() {
+            for (size_t j=0; j<50; j++) {
+                size_t before = inserted.load();
+
+                Q::Parameters p;
+                p.lower_bound = 0;
+                p.upper_bound = n;
+                auto res = test_de->query(std::move(p)).get();
+                std::sort(res.begin(), res.end());
+                if (res.size() < before || res.size() > n ||
+                    std::adjacent_find(res.begin(), res.end()) != res.end()) {
+                    failures.fetch_add(1);
+                }
+            }
+        });
+    }
+
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        inserted.fetch_add(1);
+    }
+
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    ck_assert_int_eq(failures.load(), 0);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_snapshot)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    for (size_t i=0; i<10000; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+
+    {
+        auto snapshot = test_de->get_snapshot();
+        size_t reccnt = snapshot.get_record_count();
+        ck_assert_int_eq(reccnt, 10000);
+
+        Q::Parameters p;
+        p.lower_bound = 0;
+        p.upper_bound = 20000;
+        ck_assert_int_eq(snapshot.query(Q::Parameters(p)).size(), 10000);
+
+        /*
+         * too few to fill the buffer, as the space holding the records
+         * visible to the snapshot cannot be reused until it is released
+         */
+        for (size_t i=10000; i<10050; i++) {
+            R r = {i, (uint32_t) i};
+            ck_assert_int_eq(test_de->insert(r), 1);
+        }
+
+        ck_assert_int_eq(snapshot.get_record_count(), reccnt);
+        ck_assert_int_eq(snapshot.query(Q::Parameters(p)).size(), 10000);
+        ck_assert_int_eq(test_de->query(Q::Parameters(p)).get().size(), 10050);
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->get_record_count(), 10050);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_many_snapshots)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    for (size_t i=0; i<50; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert(r), 1);
+    }
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = 20000;
+
+    /*
+     * more snapshots than there are reader slots, each of which pins an
+     * epoch until it is destroyed
+     */
+    {
+        std::vector<DE::Snapshot> snapshots;
+        for (size_t i=0; i<300; i++) {
+            snapshots.emplace_back(test_de->get_snapshot());
+        }
+
+        ck_assert_int_eq(test_de->query(Q::Parameters(p)).get().size(), 50);
+        ck_assert_int_eq(test_de->get_record_count(), 50);
+        for (auto &snapshot : snapshots) {
+            ck_assert_int_eq(snapshot.query(Q::Parameters(p)).size(), 50);
+        }
+    }
+
+    for (size_t i=50; i<10000; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->query(Q::Parameters(p)).get().size(), 10000);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_snapshots_across_flushes)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = 100000;
+
+    /*
+     * snapshots taken between flushes pin more generations of the buffer
+     * than it can track, so later flushes cannot be installed until some
+     * are released. The inserting thread holds the snapshots itself, so
+     * the inserts must fail once the buffer fills, rather than wait for
+     * the flush.
+     */
+    size_t n = 0;
+    {
+        std::vector<DE::Snapshot> snapshots;
+        std::vector<size_t> counts;
+        for (size_t i=0; i<20; i++) {
+            for (size_t j=0; j<300; j++) {
+                R r = {n, (uint32_t) n};
+                if (!test_de->try_insert_for(r, std::chrono::milliseconds(10))) {
+                    break;
+                }
+                n++;
+            }
+
+            snapshots.emplace_back(test_de->get_snapshot());
+            counts.push_back(snapshots.back().get_record_count());
+        }
+
+        ck_assert_int_eq(test_de->get_record_count(), n);
+        ck_assert_int_eq(test_de->query(Q::Parameters(p)).get().size(), n);
+        for (size_t i=0; i<snapshots.size(); i++) {
+            ck_assert_int_eq(snapshots[i].get_record_count(), counts[i]);
+            ck_assert_int_eq(snapshots[i].query(Q::Parameters(p)).size(),
+                             counts[i]);
+        }
+    }
+
+    /* releasing the snapshots allows the flushes to proceed */
+    for (size_t i=0; i<5000; i++) {
+        R r = {n, (uint32_t) n};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+        n++;
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->get_record_count(), n);
+    ck_assert_int_eq(test_de->query(Q::Parameters(p)).get().size(), n);
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_session_consistency)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t n = 5000;
+
+    /*
+     * the writers hand the sequence number of each record off to a
+     * separate set of readers, which must see the record when querying
+     * with it, without any other synchronization with the writer. Half of
+     * the writers use single-record batches, to cover write as well.
+     */
+    std::mutex tokens_lock;
+    std::deque<std::pair<size_t, size_t>> tokens;
+    std::vector<size_t> seqs(n, 0);
+    std::atomic<size_t> writers_done = 0;
+    std::atomic<size_t> failures = 0;
+
+    std::vector<std::thread> writers;
+    for (size_t i=0; i<4; i++) {
+        writers.emplace_back([&, i]() {
+            for (size_t j=i; j<n; j+=4) {
+                R r = {j, (uint32_t) j};
+                size_t seq = 0;
+                if (i % 2) {
+                    typename DE::WriteBatch batch;
+                    batch.insert(r);
+                    while (!test_de->write(batch, &seq)) {
+                        std::this_thread::yield();
+                    }
+                } else {
+                    while (!test_de->insert(r, &seq)) {
+                        std::this_thread::yield();
+                    }
+                }
+
+                seqs[j] = seq;
+                std::unique_lock<std::mutex> lk(tokens_lock);
+                tokens.push_back({j, seq});
+            }
+            writers_done.fetch_add(1);
+        });
+    }
+
+    std::vector<std::thread> readers;
+    for (size_t i=0; i<2; i++) {
+        readers.emplace_back([&]() {
+            while (true) {
+                std::pair<size_t, size_t> token;
+                {
+                    std::unique_lock<std::mutex> lk(tokens_lock);
+                    if (tokens.empty()) {
+                        if (writers_done.load() == 4) {
+                            return;
+                        }
+                        lk.unlock();
+                        std::this_thread::yield();
+                        continue;
+                    }
+
+                    token = tokens.front();
+                    tokens.pop_front();
+                }
+
+                Q::Parameters p;
+                p.lower_bound = token.first;
+                p.upper_bound = token.first;
+                if (test_de->query(std::move(p), token.second).get().size() != 1) {
+                    failures.fetch_add(1);
+                }
+            }
+        });
+    }
+
+    for (auto &t : writers) {
+        t.join();
+    }
+
+    for (auto &t : readers) {
+        t.join();
+    }
+
+    test_de->await_next_epoch();
+
+    ck_assert_int_eq(failures.load(), 0);
+    ck_assert_int_eq(test_de->get_record_count(), n);
+
+    /*
+     * each record reserved its own position in the buffer, so the
+     * sequence numbers are exactly 1 through n
+     */
+    std::sort(seqs.begin(), seqs.end());
+    for (size_t i=0; i<n; i++) {
+        ck_assert_int_eq(seqs[i], i + 1);
+    }
+
+    delete test_de;
+}
+END_TEST
+
+
+START_TEST(t_parallel_query)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    for (size_t i=0; i<20000; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    test_de->await_next_epoch();
+
+    /* spreading a query across threads should not change its results */
+    Q::Parameters p;
+    p.lower_bound = 100;
+    p.upper_bound = 15000;
+
+    test_de->set_query_fanout(1);
+    auto serial = test_de->query(Q::Parameters(p)).get();
+
+    test_de->set_query_fanout(8);
+    auto parallel = test_de->query(Q::Parameters(p)).get();
+
+    ck_assert_int_eq(serial.size(), 14901);
+    ck_assert_int_eq(parallel.size(), serial.size());
+
+    std::sort(serial.begin(), serial.end());
+    std::sort(parallel.begin(), parallel.end());
+    for (size_t i=0; i<serial.size(); i++) {
+        ck_assert_int_eq(parallel[i].key, serial[i].key);
+    }
+
+    delete test_de;
+}
+END_TEST
+
+
 START_TEST(t_tombstone_merging_01)
 {
     size_t reccnt = 100000;
@@ -240,6 +1064,165 @@ START_TEST(t_tombstone_merging_01)
 }
 END_TEST
 
+START_TEST(t_concurrent_deletes)
+{
+    auto test_de = new DE(100, 1000, 2);
+    size_t n = 50000;
+    size_t lag = 5000;
+
+    /*
+     * delete records old enough to have been flushed, so that the
+     * deletes race with the reconstructions that are moving them
+     */
+    for (size_t i=0; i<n; i++) {
+        R r = {i, (uint32_t) i};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+
+        if (i >= lag && (i - lag) % 2 == 0) {
+            R dr = {i - lag, (uint32_t) (i - lag)};
+            while (!test_de->erase(dr)) {
+                _mm_pause();
+            }
+        }
+    }
+
+    test_de->await_next_epoch();
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = n;
+    auto res = test_de->query(std::move(p)).get();
+    std::sort(res.begin(), res.end());
+
+    std::vector<uint64_t> expected;
+    for (size_t i=0; i<n; i++) {
+        if (i >= n - lag || i % 2 == 1) {
+            expected.push_back(i);
+        }
+    }
+
+    ck_assert_int_eq(res.size(), expected.size());
+    for (size_t i=0; i<res.size(); i++) {
+        ck_assert_int_eq(res[i].key, expected[i]);
+    }
+
+    delete test_de;
+}
+END_TEST
+
+
+/*
+ * Erases can only be batched under tombstone deletes, so this test is a
+ * template, and is only registered for those configurations
+ */
+template <typename T>
+concept BatchErasable = requires(typename T::WriteBatch b, R r) {
+    b.erase(r);
+};
+
+template <BatchErasable T>
+static void write_batch_updates() {
+    auto test_de = new T(100, 1000, 2);
+    size_t key_cnt = 1000;
+    size_t writer_cnt = 2;
+    size_t update_cnt = 20000;
+    size_t batch_keys = 50;
+
+    for (size_t i=0; i<key_cnt; i++) {
+        R r = {i, 0};
+        ck_assert_int_eq(test_de->insert_blocking(r), 1);
+    }
+
+    /*
+     * each writer updates its own keys, by erasing the current version of
+     * a record and inserting the next one in the same batch. A reader
+     * must never see a key with no version, or with two of them.
+     */
+    std::atomic<size_t> writers_done = 0;
+    std::vector<std::thread> writers;
+    for (size_t w=0; w<writer_cnt; w++) {
+        writers.emplace_back([&, w]() {
+            std::vector<uint32_t> versions(key_cnt, 0);
+            typename T::WriteBatch batch;
+
+            /*
+             * the erases are placed ahead of the inserts, to widen the
+             * gap that a reader would see if the batch were not atomic
+             */
+            for (size_t i=0; i<update_cnt; i+=batch_keys) {
+                for (size_t j=i; j<i+batch_keys; j++) {
+                    uint64_t key = (j * writer_cnt + w) % key_cnt;
+                    batch.erase({key, versions[key]});
+                }
+
+                for (size_t j=i; j<i+batch_keys; j++) {
+                    uint64_t key = (j * writer_cnt + w) % key_cnt;
+                    versions[key]++;
+                    batch.insert({key, versions[key]});
+                }
+
+                while (!test_de->write(batch)) {
+                    std::this_thread::yield();
+                }
+                batch.clear();
+
+                /*
+                 * otherwise, the writers spend most of their time waiting
+                 * on a full buffer, which the reader sees at rest
+                 */
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+            }
+
+            writers_done.fetch_add(1);
+        });
+    }
+
+    size_t failures = 0;
+    size_t queries = 0;
+    do {
+        Q::Parameters p;
+        p.lower_bound = 0;
+        p.upper_bound = key_cnt;
+        auto res = test_de->query(std::move(p)).get();
+
+        std::vector<size_t> counts(key_cnt, 0);
+        for (auto &r : res) {
+            counts[r.key]++;
+        }
+
+        for (size_t i=0; i<key_cnt; i++) {
+            failures += (counts[i] != 1);
+        }
+        queries++;
+    } while (writers_done.load() < writer_cnt || queries < 10);
+
+    for (auto &t : writers) {
+        t.join();
+    }
+
+    ck_assert_int_eq(failures, 0);
+
+    test_de->await_next_epoch();
+
+    Q::Parameters p;
+    p.lower_bound = 0;
+    p.upper_bound = key_cnt;
+    ck_assert_int_eq(test_de->query(std::move(p)).get().size(), key_cnt);
+
+    delete test_de;
+}
+
+/* never registered, as T cannot batch erases */
+template <typename T>
+static void write_batch_updates() {}
+
+START_TEST(t_write_batch_updates)
+{
+    write_batch_updates<DE>();
+}
+END_TEST
+
+
 DE *create_test_tree(size_t reccnt, size_t memlevel_cnt) {
     auto rng = gsl_rng_alloc(gsl_rng_mt19937);
 
@@ -358,17 +1341,42 @@ static void inject_dynamic_extension_tests(Suite *suite) {
     tcase_add_test(insert, t_insert);
     tcase_add_test(insert, t_insert_with_mem_merges);
     tcase_add_test(insert, t_debug_insert);
+    tcase_add_test(insert, t_insert_blocking);
+    tcase_add_test(insert, t_try_insert_for);
+    tcase_add_test(insert, t_adaptive_watermarks);
+    tcase_add_test(insert, t_growable_buffer);
+    tcase_add_test(insert, t_background_merges);
+    tcase_add_test(insert, t_background_merges_single_thread);
+    tcase_add_test(insert, t_memory_budget);
+    if constexpr (!std::same_as<budget_checked<DE>::scheduler, SerialScheduler>) {
+        tcase_add_test(insert, t_memory_budget_background_merges);
+    }
+    if constexpr (std::same_as<budget_checked<DE>::scheduler, PriorityScheduler>) {
+        tcase_add_test(insert, t_flush_headroom);
+    }
     tcase_set_timeout(insert, 500);
     suite_add_tcase(suite, insert);
 
     TCase *query = tcase_create("de::DynamicExtension::range_query Testing");
     tcase_add_test(query, t_range_query);
+    tcase_add_test(query, t_concurrent_readers);
+    tcase_add_test(query, t_pin_churn);
+    tcase_add_test(query, t_preempted_queries);
+    tcase_add_test(query, t_snapshot);
+    tcase_add_test(query, t_many_snapshots);
+    tcase_add_test(query, t_snapshots_across_flushes);
+    tcase_add_test(query, t_session_consistency);
+    tcase_add_test(query, t_parallel_query);
     tcase_set_timeout(query, 500);
     suite_add_tcase(suite, query);
 
     
     TCase *ts = tcase_create("de::DynamicExtension::tombstone_compaction Testing");
     tcase_add_test(ts, t_tombstone_merging_01);
+    tcase_add_test(ts, t_concurrent_deletes);
+    if constexpr (BatchErasable<DE>) {
+        tcase_add_test(ts, t_write_batch_updates);
+    }
     tcase_set_timeout(ts, 500);
     suite_add_tcase(suite, ts);
 
@@ -93,6 +93,31 @@ START_TEST(t_debug_insert)
 END_TEST
 
 
+START_TEST(t_insert_batch)
+{
+    auto test_de = new DE(100, 1000, 2);
+
+    std::vector<R> recs;
+    for (size_t i=0; i<5000; i++) {
+        recs.push_back({i, (uint32_t) i});
+    }
+
+    /* insert in batches, retrying any suffix that is not accepted */
+    size_t inserted = 0;
+    while (inserted < recs.size()) {
+        size_t batch = std::min((size_t) 128, recs.size() - inserted);
+        inserted += test_de->insert_batch(
+            std::span<const R>(recs.data() + inserted, batch));
+    }
+
+    test_de->await_next_epoch();
+    ck_assert_int_eq(test_de->get_record_count(), 5000);
+
+    delete test_de;
+}
+END_TEST
+
+
 START_TEST(t_insert_with_mem_merges)
 {
     auto test_de = new DE(100, 1000, 2);
@@ -332,6 +357,7 @@ static void inject_dynamic_extension_tests(Suite *suite) {
     tcase_add_test(insert, t_insert);
     tcase_add_test(insert, t_insert_with_mem_merges);
     tcase_add_test(insert, t_debug_insert);
+    tcase_add_test(insert, t_insert_batch);
     suite_add_tcase(suite, insert);
 
     TCase *query = tcase_create("de::DynamicExtension::range_query Testing");
@@ -48,6 +48,32 @@ START_TEST(t_memlevel_merge)
 }
 
 
+START_TEST(t_append_shard)
+{
+    auto tbl1 = create_test_mbuffer<Rec>(100);
+    auto tbl2 = create_test_mbuffer<Rec>(100);
+
+    auto shard1 = new ISAMTree<Rec>(tbl1->get_buffer_view());
+    auto shard2 = new ISAMTree<Rec>(tbl2->get_buffer_view());
+
+    auto level = ILevel::from_shard(1, shard1, -1);
+    ck_assert_int_eq(level->get_shard_count(), 1);
+    ck_assert_int_eq(level->get_record_count(), 100);
+
+    /* a full level holds the shard back until it is finalized */
+    level->append_shard(shard2, -1);
+    ck_assert_int_eq(level->get_record_count(), 100);
+    level->finalize();
+    ck_assert_int_eq(level->get_shard_count(), 1);
+    ck_assert_int_eq(level->get_record_count(), 100);
+    ck_assert_ptr_eq(level->get_shard(0), shard2);
+
+    delete tbl1;
+    delete tbl2;
+}
+END_TEST
+
+
 ILevel *create_test_memlevel(size_t reccnt) {
     auto tbl1 = create_test_mbuffer<Rec>(reccnt/2);
     auto tbl2 = create_test_mbuffer<Rec>(reccnt/2);
@@ -68,6 +94,7 @@ Suite *unit_testing()
 
     TCase *merge = tcase_create("de::InternalLevel::reconstruction Testing");
     tcase_add_test(merge, t_memlevel_merge);
+    tcase_add_test(merge, t_append_shard);
     suite_add_tcase(unit, merge);
 
     return unit;
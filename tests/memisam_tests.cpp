@@ -22,6 +22,68 @@ typedef ISAMTree<R> Shard;
 #include "include/shard_standard.h"
 #include "include/rangequery.h"
 
+START_TEST(t_partitioned_merge)
+{
+    /*
+     * the records of each key are spread across the shards, so many of
+     * the tombstones cancel records in other shards, and a split between
+     * parts of the merge that separated them would leave both behind
+     */
+    size_t n = 200000;
+    auto buffer1 = new MutableBuffer<R>(n/2, n);
+    auto buffer2 = new MutableBuffer<R>(n/2, n);
+    auto buffer3 = new MutableBuffer<R>(n/2, n);
+    for (uint64_t i = 0; i < n; i++) {
+        buffer1->append({i, (uint32_t) i});
+        buffer2->append({i, (uint32_t) i + 1});
+        if (i % 2 == 0) {
+            buffer3->append({i, (uint32_t) i}, true);
+        }
+    }
+
+    auto shard1 = new Shard(buffer1->get_buffer_view());
+    auto shard2 = new Shard(buffer2->get_buffer_view());
+    auto shard3 = new Shard(buffer3->get_buffer_view());
+    std::vector<Shard *> shards = {shard1, shard2, shard3};
+
+    auto serial = new Shard(shards);
+
+    merge_executor executor = {
+        [](size_t cnt, std::function<void(size_t)> work) {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < cnt; i++) {
+                threads.emplace_back(work, i);
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+        },
+        4};
+
+    Shard *parallel;
+    {
+        merge_executor_scope scope(&executor);
+        parallel = new Shard(shards);
+    }
+
+    ck_assert_int_eq(serial->get_record_count(), n + n / 2);
+    ck_assert_int_eq(parallel->get_record_count(), serial->get_record_count());
+    ck_assert_int_eq(parallel->get_tombstone_count(), 0);
+    for (size_t i = 0; i < serial->get_record_count(); i++) {
+        ck_assert(parallel->get_record_at(i)->rec == serial->get_record_at(i)->rec);
+    }
+
+    delete buffer1;
+    delete buffer2;
+    delete buffer3;
+    delete shard1;
+    delete shard2;
+    delete shard3;
+    delete serial;
+    delete parallel;
+}
+END_TEST
+
 Suite *unit_testing()
 {
     Suite *unit = suite_create("Alias-augmented B+Tree Shard Unit Testing");
@@ -29,6 +91,10 @@ Suite *unit_testing()
     inject_rangequery_tests(unit);
     inject_shard_tests(unit);
 
+    TCase *merge = tcase_create("de::sorted_array_merge Testing");
+    tcase_add_test(merge, t_partitioned_merge);
+    suite_add_tcase(unit, merge);
+
     return unit;
 }
 
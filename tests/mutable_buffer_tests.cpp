@@ -10,6 +10,7 @@
  *
  */
 
+#include <memory>
 #include <thread>
 #include <vector>
 
@@ -137,12 +138,15 @@ START_TEST(t_advance_head)
         ck_assert_int_eq(view.get_record_count(), cnt);
         ck_assert_int_eq(buffer->get_available_capacity(), 200 - cnt);
 
-        /* refuse to advance head again while there remain references to the old one */
-        ck_assert_int_eq(buffer->advance_head(buffer->get_tail() -1), 0);
+        /* the head can be advanced again while the old generation is still referenced */
+        ck_assert_int_eq(buffer->advance_head(buffer->get_tail() -1), 1);
+        ck_assert_int_eq(buffer->get_record_count(), 1);
+        ck_assert_int_eq(view.get_record_count(), cnt);
+        ck_assert_int_eq(buffer->get_available_capacity(), 200 - cnt);
     }
 
     /* once the buffer view falls out of scope, the capacity of the buffer should increase */
-    ck_assert_int_eq(buffer->get_available_capacity(), 175);
+    ck_assert_int_eq(buffer->get_available_capacity(), 199);
 
     /* now the head should be able to be advanced */
     ck_assert_int_eq(buffer->advance_head(buffer->get_tail()), 1);
@@ -155,6 +159,229 @@ START_TEST(t_advance_head)
 }
 END_TEST
 
+START_TEST(t_head_generations)
+{
+    auto buffer = new MutableBuffer<Rec>(50, 100);
+
+    size_t reclaimed = 0;
+    buffer->set_reclaim_callback([&reclaimed]() { reclaimed++; });
+
+    Rec rec = {1, 1};
+    for (size_t i=0; i<100; i++) {
+        ck_assert_int_eq(buffer->append(rec), 1);
+        rec.key++;
+        rec.value++;
+    }
+
+    {
+        /* hold a view of each of several generations, and advance past them all */
+        std::vector<std::unique_ptr<BufferView<Rec>>> views;
+        for (size_t i=0; i<4; i++) {
+            views.emplace_back(new BufferView<Rec>(buffer->get_buffer_view()));
+            ck_assert_int_eq(buffer->advance_head((i + 1) * 10), 1);
+        }
+
+        ck_assert_int_eq(buffer->get_record_count(), 60);
+        ck_assert_int_eq(buffer->get_available_capacity(), 100);
+        ck_assert_int_eq(reclaimed, 0);
+
+        /* releasing a newer generation does not depend upon the older ones */
+        views.erase(views.begin() + 2);
+        ck_assert_int_eq(buffer->get_available_capacity(), 100);
+        ck_assert_int_eq(reclaimed, 1);
+
+        /* every remaining view is unaffected */
+        for (size_t i=0; i<views.size(); i++) {
+            size_t head = views[i]->get_head();
+            ck_assert_int_eq(views[i]->get_record_count(), 100 - head);
+            for (size_t j=0; j<views[i]->get_record_count(); j++) {
+                ck_assert_int_eq(views[i]->get(j)->rec.key, head + j + 1);
+            }
+        }
+
+        /* releasing the oldest generation frees its records */
+        views.erase(views.begin());
+        ck_assert_int_eq(buffer->get_available_capacity(), 110);
+
+        /*
+         * fill the buffer to its high watermark again, and advance past it.
+         * The remaining views still cover the records starting at 10, so
+         * the buffer cannot accept any more, even though it is empty.
+         */
+        while (buffer->append(rec)) {
+            rec.key++;
+            rec.value++;
+        }
+        ck_assert_int_eq(buffer->get_tail(), 140);
+        ck_assert_int_eq(buffer->advance_head(140), 1);
+        ck_assert_int_eq(buffer->get_record_count(), 0);
+
+        size_t appended = 0;
+        while (buffer->append(rec)) {
+            rec.key++;
+            rec.value++;
+            appended++;
+        }
+        ck_assert_int_eq(appended, 70);
+        ck_assert_int_eq(buffer->get_available_capacity(), 0);
+
+        /* the buffer is below its high watermark, but has no room */
+        ck_assert_int_eq(buffer->is_full(), 0);
+        ck_assert_int_eq(buffer->can_append(), 0);
+
+        for (size_t j=0; j<views[0]->get_record_count(); j++) {
+            ck_assert_int_eq(views[0]->get(j)->rec.key, j + 11);
+        }
+    }
+
+    ck_assert_int_eq(buffer->get_available_capacity(), 130);
+    ck_assert_int_eq(buffer->can_append(), 1);
+    ck_assert_int_eq(buffer->append(rec), 1);
+
+    delete buffer;
+}
+END_TEST
+
+START_TEST(t_append_batch)
+{
+    auto buffer = new MutableBuffer<Rec>(50, 100);
+
+    std::vector<Rec> recs(75);
+    for (size_t i=0; i<recs.size(); i++) {
+        recs[i] = {i+1, (uint32_t) i+1};
+    }
+
+    /* the whole batch should fit below the HWM */
+    ck_assert_int_eq(buffer->append_batch(recs.data(), 75), 75);
+    ck_assert_int_eq(buffer->get_record_count(), 75);
+    ck_assert_int_eq(buffer->get_tail(), 75);
+
+    /* only a prefix of the second batch should be accepted */
+    ck_assert_int_eq(buffer->append_batch(recs.data(), 75), 25);
+    ck_assert_int_eq(buffer->is_full(), 1);
+    ck_assert_int_eq(buffer->append_batch(recs.data(), 75), 0);
+
+    {
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 100);
+        for (size_t i=0; i<view.get_record_count(); i++) {
+            ck_assert_int_eq(view.get(i)->rec.key, (i % 75) + 1);
+            ck_assert_int_eq(view.get(i)->is_visible(), 1);
+        }
+    }
+
+    /* advance the head so that the next batch wraps around the ring */
+    ck_assert_int_eq(buffer->advance_head(100), 1);
+    ck_assert_int_eq(buffer->append_batch(recs.data(), 75), 75);
+    ck_assert_int_eq(buffer->advance_head(175), 1);
+    ck_assert_int_eq(buffer->append_batch(recs.data(), 75, true), 75);
+    ck_assert_int_eq(buffer->get_tombstone_count(), 75);
+
+    {
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 75);
+        for (size_t i=0; i<view.get_record_count(); i++) {
+            ck_assert_int_eq(view.get(i)->rec.key, i + 1);
+            ck_assert_int_eq(view.get(i)->is_tombstone(), 1);
+            ck_assert_int_eq(view.check_tombstone(recs[i]), 1);
+        }
+    }
+
+    delete buffer;
+}
+END_TEST
+
+START_TEST(t_append_atomic)
+{
+    auto buffer = new MutableBuffer<Rec>(50, 100);
+
+    std::vector<Wrapped<Rec>> recs(60);
+    for (size_t i=0; i<recs.size(); i++) {
+        recs[i].rec = {i+1, (uint32_t) i+1};
+        recs[i].header = 0;
+        if (i % 2 == 0) {
+            recs[i].set_tombstone();
+        }
+    }
+
+    ck_assert_int_eq(buffer->append_atomic(recs.data(), 60), 1);
+    ck_assert_int_eq(buffer->get_record_count(), 60);
+    ck_assert_int_eq(buffer->get_tombstone_count(), 30);
+
+    /* a batch that does not fit below the HWM is rejected entirely */
+    ck_assert_int_eq(buffer->append_atomic(recs.data(), 41), 0);
+    ck_assert_int_eq(buffer->get_record_count(), 60);
+    ck_assert_int_eq(buffer->get_tail(), 60);
+    ck_assert_int_eq(buffer->append_atomic(recs.data(), 40), 1);
+    ck_assert_int_eq(buffer->is_full(), 1);
+
+    {
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 100);
+        for (size_t i=0; i<view.get_record_count(); i++) {
+            ck_assert_int_eq(view.get(i)->rec.key, (i % 60) + 1);
+            ck_assert_int_eq(view.get(i)->is_visible(), 1);
+            ck_assert_int_eq(view.get(i)->is_tombstone(), (i % 60) % 2 == 0);
+        }
+    }
+
+    delete buffer;
+}
+END_TEST
+
+START_TEST(t_tombstone_count)
+{
+    auto buffer = new MutableBuffer<Rec>(500, 1000);
+
+    /* track which positions hold tombstones, to compute the expected counts */
+    std::vector<bool> is_ts;
+    size_t head = 0;
+
+    auto expected = [&](size_t start, size_t stop) {
+        return (size_t) std::count(is_ts.begin() + start, is_ts.begin() + stop, true);
+    };
+
+    Rec rec = {1, 1};
+    for (size_t round=0; round<10; round++) {
+        /* mix single appends and batches, so that blocks are split unevenly */
+        for (size_t i=0; i<300; i++) {
+            bool ts = (i % 3 == 0) || (round % 2 == 0 && i % 7 == 0);
+            ck_assert_int_eq(buffer->append(rec, ts), 1);
+            is_ts.push_back(ts);
+            rec.key++;
+        }
+
+        std::vector<Rec> recs(150, rec);
+        bool ts = round % 3 == 0;
+        ck_assert_int_eq(buffer->append_batch(recs.data(), recs.size(), ts), 150);
+        is_ts.insert(is_ts.end(), 150, ts);
+
+        ck_assert_int_eq(buffer->get_tombstone_count(), expected(head, is_ts.size()));
+
+        {
+            auto view = buffer->get_buffer_view();
+            size_t tail = buffer->get_tail();
+            ck_assert_int_eq(view.get_tombstone_count(), expected(head, tail));
+
+            /* advance the head to an arbitrary, unaligned, position */
+            size_t new_head = head + 440 + round;
+            ck_assert_int_eq(buffer->advance_head(new_head), 1);
+
+            /* the existing view should be unaffected */
+            ck_assert_int_eq(view.get_tombstone_count(), expected(head, tail));
+            head = new_head;
+        }
+
+        ck_assert_int_eq(buffer->get_tombstone_count(), expected(head, is_ts.size()));
+    }
+
+    ck_assert_int_eq(buffer->advance_head(buffer->get_tail()), 1);
+    ck_assert_int_eq(buffer->get_tombstone_count(), 0);
+
+    delete buffer;
+}
+END_TEST
+
 void insert_records(std::vector<Rec> *values, size_t start, size_t stop, MutableBuffer<Rec> *buffer)
 {
     for (size_t i=start; i<stop; i++) {
@@ -199,6 +426,81 @@ START_TEST(t_multithreaded_insert)
 END_TEST
 
 
+void insert_records_retry(std::vector<Rec> *values, size_t start, size_t stop, MutableBuffer<Rec> *buffer)
+{
+    for (size_t i=start; i<stop; i++) {
+        size_t attempts = 0;
+        while (!buffer->append((*values)[i]) && attempts++ < 1000000) {
+            _mm_pause();
+        }
+    }
+}
+
+
+START_TEST(t_multilane_insert)
+{
+    size_t cnt = 10000;
+    size_t lane_cnt = 4;
+    auto buffer = new MutableBuffer<Rec>(cnt/2, cnt, 0, lane_cnt);
+    ck_assert_int_eq(buffer->get_lane_count(), lane_cnt);
+
+    std::vector<Rec> records(cnt);
+    for (size_t i=0; i<cnt; i++) {
+        records[i] = Rec {i, (uint32_t) i};
+    }
+
+    /* 
+     * use more threads than lanes, so that some lanes are shared, and
+     * fill the buffer exactly to the HWM
+     */
+    size_t thread_cnt = 8;
+    size_t per_thread = cnt / thread_cnt;
+    std::vector<std::thread> workers(thread_cnt);
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i] = std::thread(insert_records_retry, &records, i*per_thread, (i+1)*per_thread, buffer);
+    }
+
+    for (size_t i=0; i<thread_cnt; i++) {
+        workers[i].join();
+    }
+
+    ck_assert_int_eq(buffer->is_full(), 1);
+
+    {
+        /* every record should be visible in a view, even if it was staged */
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), cnt);
+
+        std::vector<bool> found(cnt, false);
+        for (size_t i=0; i<view.get_record_count(); i++) {
+            ck_assert_int_eq(view.get(i)->is_visible(), 1);
+            found[view.get(i)->rec.key] = true;
+        }
+
+        for (size_t i=0; i<cnt; i++) {
+            ck_assert_int_eq(found[i], 1);
+        }
+    }
+
+    ck_assert_int_eq(buffer->get_record_count(), cnt);
+
+    /* once the buffer has been flushed, inserts should succeed again */
+    ck_assert_int_eq(buffer->append(records[0]), 0);
+    ck_assert_int_eq(buffer->advance_head(buffer->get_tail()), 1);
+    ck_assert_int_eq(buffer->append(records[0], true), 1);
+    ck_assert_int_eq(buffer->get_record_count(), 0);
+
+    {
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 1);
+        ck_assert_int_eq(view.check_tombstone(records[0]), 1);
+    }
+
+    delete buffer;
+}
+END_TEST
+
+
 START_TEST(t_truncate)
 {
     auto buffer = new MutableBuffer<Rec>(50, 100);
@@ -373,6 +675,238 @@ START_TEST(t_bview_delete)
 END_TEST
 
 
+START_TEST(t_bview_tombstone_filters)
+{
+    auto buffer = new MutableBuffer<Rec>(50, 100);
+    size_t aux_memory = buffer->get_aux_memory_usage();
+
+    /*
+     * cycle tombstones through the buffer several times, so that the
+     * segments (and their filters) are reused
+     */
+    size_t head = 0;
+    for (size_t round=0; round<10; round++) {
+        for (size_t i=0; i<60; i++) {
+            /* zero the padding, as the tombstone filter hashes the raw record */
+            Rec rec {};
+            rec.key = round * 1000 + i;
+            rec.value = i;
+            ck_assert_int_eq(buffer->append(rec, i % 2 == 0), 1);
+        }
+
+        {
+            auto view = buffer->get_buffer_view();
+            for (size_t r=0; r<=round; r++) {
+                for (size_t i=0; i<60; i++) {
+                    Rec rec {};
+                    rec.key = r * 1000 + i;
+                    rec.value = i;
+
+                    /* only the tombstones still within the view should be found */
+                    bool expected = (i % 2 == 0) && (r * 60 + i >= head);
+                    ck_assert_int_eq(view.check_tombstone(rec), expected);
+                }
+            }
+        }
+
+        /* leave part of each round behind in the buffer */
+        head += 59;
+        ck_assert_int_eq(buffer->advance_head(head), 1);
+    }
+
+    /* the filters are recycled along with the segments, so don't grow */
+    ck_assert_int_eq(buffer->get_aux_memory_usage(), aux_memory);
+
+    delete buffer;
+}
+END_TEST
+
+
+START_TEST(t_bview_sorted_runs)
+{
+    auto buffer = new MutableBuffer<Rec>(1000, 2000, 0, 0, true);
+    ck_assert_int_eq(buffer->has_sorted_runs(), 1);
+
+    gsl_rng *rng = gsl_rng_alloc(gsl_rng_mt19937);
+
+    auto insert = [&](size_t cnt) {
+        for (size_t i=0; i<cnt; i++) {
+            /* zero the padding, as the tombstone filter hashes the raw record */
+            Rec rec {};
+            rec.key = gsl_rng_uniform_int(rng, 1000);
+            rec.value = i;
+            ck_assert_int_eq(buffer->append(rec, i % 10 == 0), 1);
+        }
+    };
+
+    /* advance the head to positions that aren't block-aligned, and wrap */
+    insert(1900);
+    ck_assert_int_eq(buffer->advance_head(1300), 1);
+    insert(1400);
+    ck_assert_int_eq(buffer->advance_head(3000), 1);
+    insert(1500);
+
+    {
+        auto view = buffer->get_buffer_view();
+        size_t reccnt = view.get_record_count();
+        ck_assert_int_eq(reccnt, 1800);
+
+        /* range scans should match a linear scan */
+        for (uint64_t lower=0; lower<1000; lower += 97) {
+            uint64_t upper = lower + 50;
+
+            size_t expected = 0;
+            for (size_t i=0; i<reccnt; i++) {
+                auto key = view.get(i)->rec.key;
+                expected += (key >= lower && key <= upper);
+            }
+
+            size_t found = 0;
+            view.range_scan([&](auto r) { return r->rec.key < lower; },
+                            [&](auto r) { return r->rec.key > upper; },
+                            [&](auto r) {
+                                ck_assert(r->rec.key >= lower && r->rec.key <= upper);
+                                found++;
+                                return true;
+                            });
+
+            ck_assert_int_eq(found, expected);
+        }
+
+        /* tombstone checks should match a linear scan */
+        for (size_t i=0; i<reccnt; i += 13) {
+            Rec rec {};
+            rec.key = view.get(i)->rec.key;
+            rec.value = view.get(i)->rec.value;
+
+            bool expected = false;
+            for (size_t j=0; j<reccnt; j++) {
+                if (view.get(j)->rec == rec && view.get(j)->is_tombstone()) {
+                    expected = true;
+                }
+            }
+
+            ck_assert_int_eq(view.check_tombstone(rec), expected);
+        }
+
+        /* the sorted copy should be a sorted permutation of the view */
+        auto sorted = new Wrapped<Rec>[reccnt];
+        auto unsorted = new Wrapped<Rec>[reccnt];
+        view.copy_to_buffer_sorted(sorted);
+        view.copy_to_buffer((psudb::byte *) unsorted);
+        std::sort(unsorted, unsorted + reccnt);
+
+        for (size_t i=0; i<reccnt; i++) {
+            ck_assert(sorted[i].rec == unsorted[i].rec);
+            ck_assert_int_eq(sorted[i].header, unsorted[i].header);
+        }
+
+        delete[] sorted;
+        delete[] unsorted;
+    }
+
+    gsl_rng_free(rng);
+    delete buffer;
+}
+END_TEST
+
+
+START_TEST(t_growable_buffer)
+{
+    auto buffer = new MutableBuffer<Rec>(50, 100, 0, 0, false, 800);
+    ck_assert_int_eq(buffer->is_growable(), 1);
+
+    size_t base_memory = buffer->get_memory_usage();
+
+    /* the buffer should accept records past the HWM, up to half its capacity */
+    Rec rec = {0, 0};
+    for (size_t i=0; i<400; i++) {
+        ck_assert_int_eq(buffer->append(rec), 1);
+        rec.key++;
+        rec.value++;
+    }
+
+    ck_assert_int_eq(buffer->is_full(), 1);
+    ck_assert_int_eq(buffer->append(rec), 0);
+    ck_assert_int_gt(buffer->get_memory_usage(), base_memory);
+
+    {
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 400);
+        for (size_t i=0; i<view.get_record_count(); i++) {
+            ck_assert_int_eq(view.get(i)->rec.key, i);
+        }
+    }
+
+    /* drain the buffer in HWM-sized steps, refilling as we go */
+    size_t head = 0;
+    for (size_t i=0; i<20; i++) {
+        head += 100;
+        ck_assert_int_eq(buffer->advance_head(head), 1);
+
+        for (size_t j=0; j<100; j++) {
+            ck_assert_int_eq(buffer->append(rec), 1);
+            rec.key++;
+            rec.value++;
+        }
+
+        auto view = buffer->get_buffer_view();
+        ck_assert_int_eq(view.get_record_count(), 400);
+        for (size_t j=0; j<view.get_record_count(); j++) {
+            ck_assert_int_eq(view.get(j)->rec.key, head + j);
+        }
+    }
+
+    /* once the excess records are gone, the extra memory is released */
+    head += 300;
+    ck_assert_int_eq(buffer->advance_head(head), 1);
+    ck_assert_int_eq(buffer->advance_head(head + 100), 1);
+    ck_assert_int_le(buffer->get_memory_usage(), base_memory);
+
+    delete buffer;
+}
+END_TEST
+
+
+START_TEST(t_append_sequence)
+{
+    /* sequence numbers must be assigned the same way with and without lanes */
+    for (size_t lane_cnt : {0, 4}) {
+        auto buffer = new MutableBuffer<Rec>(50, 100, 0, lane_cnt);
+
+        /* a record staged in a lane without a sequence number */
+        ck_assert_int_eq(buffer->append(Rec {0, 0}), 1);
+
+        size_t seq = 0;
+        ck_assert_int_eq(buffer->append(Rec {1, 1}, false, &seq), 1);
+        {
+            /* the view must contain the record, and it must be last */
+            auto view = buffer->get_buffer_view();
+            ck_assert_int_ge(view.get_tail(), seq);
+            ck_assert_int_eq(view.get(seq - view.get_head() - 1)->rec.key, 1);
+        }
+
+        Wrapped<Rec> batch[3];
+        for (size_t i=0; i<3; i++) {
+            batch[i].rec = Rec {i + 2, (uint32_t) i + 2};
+            batch[i].header = 0;
+        }
+
+        size_t batch_seq = 0;
+        ck_assert_int_eq(buffer->append_atomic(batch, 3, &batch_seq), 1);
+        ck_assert_int_eq(batch_seq, buffer->get_tail());
+        {
+            auto view = buffer->get_buffer_view();
+            ck_assert_int_ge(view.get_tail(), batch_seq);
+            ck_assert_int_eq(view.get(batch_seq - view.get_head() - 1)->rec.key, 4);
+        }
+
+        delete buffer;
+    }
+}
+END_TEST
+
+
 Suite *unit_testing()
 {
     Suite *unit = suite_create("Mutable Buffer Unit Testing");
@@ -385,13 +919,22 @@ Suite *unit_testing()
     TCase *append = tcase_create("de::MutableBuffer::append Testing");
     tcase_add_test(append, t_insert);
     tcase_add_test(append, t_advance_head);
+    tcase_add_test(append, t_head_generations);
     tcase_add_test(append, t_multithreaded_insert);
+    tcase_add_test(append, t_append_batch);
+    tcase_add_test(append, t_append_atomic);
+    tcase_add_test(append, t_tombstone_count);
+    tcase_add_test(append, t_multilane_insert);
+    tcase_add_test(append, t_append_sequence);
+    tcase_add_test(append, t_growable_buffer);
 
     suite_add_tcase(unit, append);
 
     TCase *view = tcase_create("de::BufferView Testing");
     tcase_add_test(view, t_bview_get);
     tcase_add_test(view, t_bview_delete);
+    tcase_add_test(view, t_bview_tombstone_filters);
+    tcase_add_test(view, t_bview_sorted_runs);
 
     suite_add_tcase(unit, view);
 
@@ -0,0 +1,189 @@
+/*
+ * tests/numa_topology_tests.cpp
+ *
+ * Unit tests for NumaTopology
+ *
+ * Copyright (C) 2023 Douglas Rumbaugh <drumbaugh@psu.edu>
+ *
+ * Distributed under the Modified BSD License.
+ *
+ */
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "framework/util/NumaTopology.h"
+
+#include <check.h>
+
+using namespace de;
+
+/*
+ * Create a fake sysfs node directory, containing a node<i>/cpulist file
+ * for each entry of cpulists. Returns the path of the directory.
+ */
+static std::string
+create_fake_sysfs(std::vector<std::pair<size_t, std::string>> cpulists) {
+    char tmpl[] = "/tmp/de_numa_XXXXXX";
+    std::string root = mkdtemp(tmpl);
+
+    for (auto &[node, cpulist] : cpulists) {
+        auto dir = root + "/node" + std::to_string(node);
+        std::filesystem::create_directory(dir);
+
+        std::ofstream f(dir + "/cpulist");
+        f << cpulist << "\n";
+    }
+
+    return root;
+}
+
+
+START_TEST(t_parse_cpulist)
+{
+    auto cpus = NumaTopology::parse_cpulist("0-3,8,10-11");
+    ck_assert(cpus == std::vector<int>({0, 1, 2, 3, 8, 10, 11}));
+
+    cpus = NumaTopology::parse_cpulist("5");
+    ck_assert(cpus == std::vector<int>({5}));
+
+    cpus = NumaTopology::parse_cpulist("");
+    ck_assert_int_eq(cpus.size(), 0);
+}
+END_TEST
+
+
+START_TEST(t_explicit_topology)
+{
+    NumaTopology topology({{0, 1}, {}, {2, 3}});
+
+    /* nodes without CPUs are dropped */
+    ck_assert_int_eq(topology.get_node_count(), 2);
+    ck_assert(topology.get_node_cpus(1) == std::vector<int>({2, 3}));
+
+    ck_assert_int_eq(topology.get_node_of_cpu(1), 0);
+    ck_assert_int_eq(topology.get_node_of_cpu(3), 1);
+    ck_assert_int_eq(topology.get_node_of_cpu(4), -1);
+
+    /* a topology without any CPUs falls back to a single node */
+    NumaTopology empty({{}, {}});
+    ck_assert_int_eq(empty.get_node_count(), 1);
+    ck_assert_int_eq(empty.get_node_cpus(0).size(),
+                     std::max(1u, std::thread::hardware_concurrency()));
+}
+END_TEST
+
+
+START_TEST(t_get_cpu)
+{
+    NumaTopology topology({{0, 1}, {2, 3}});
+
+    std::vector<int> scatter;
+    std::vector<int> compact;
+    for (size_t i=0; i<5; i++) {
+        scatter.push_back(topology.get_cpu(i, AffinityPolicy::SCATTER));
+        compact.push_back(topology.get_cpu(i, AffinityPolicy::COMPACT));
+    }
+
+    ck_assert(scatter == std::vector<int>({0, 2, 1, 3, 0}));
+    ck_assert(compact == std::vector<int>({0, 1, 2, 3, 0}));
+
+    /* nodes of different sizes wrap around independently under SCATTER */
+    NumaTopology uneven({{0}, {4, 5, 6}});
+    scatter.clear();
+    for (size_t i=0; i<6; i++) {
+        scatter.push_back(uneven.get_cpu(i, AffinityPolicy::SCATTER));
+    }
+
+    ck_assert(scatter == std::vector<int>({0, 4, 0, 5, 0, 6}));
+}
+END_TEST
+
+
+START_TEST(t_discover)
+{
+    /* node1 is missing, and node3 has memory, but no CPUs */
+    auto root = create_fake_sysfs({{0, "0-1"}, {2, "2,3"}, {3, ""}});
+
+    auto topology = NumaTopology::discover(root);
+    ck_assert_int_eq(topology.get_node_count(), 2);
+    ck_assert(topology.get_node_cpus(0) == std::vector<int>({0, 1}));
+    ck_assert(topology.get_node_cpus(1) == std::vector<int>({2, 3}));
+
+    std::filesystem::remove_all(root);
+}
+END_TEST
+
+
+START_TEST(t_discover_sparse)
+{
+    /*
+     * more nodes are missing in total than discover will skip over in a
+     * row, but never that many consecutively
+     */
+    auto root = create_fake_sysfs({{0, "0"}, {6, "1"}, {12, "2"}});
+
+    auto topology = NumaTopology::discover(root);
+    ck_assert_int_eq(topology.get_node_count(), 3);
+    ck_assert(topology.get_node_cpus(2) == std::vector<int>({2}));
+
+    std::filesystem::remove_all(root);
+}
+END_TEST
+
+
+START_TEST(t_discover_missing)
+{
+    auto topology = NumaTopology::discover("/nonexistent/sysfs/node");
+
+    ck_assert_int_eq(topology.get_node_count(), 1);
+    ck_assert_int_eq(topology.get_node_cpus(0).size(),
+                     std::max(1u, std::thread::hardware_concurrency()));
+}
+END_TEST
+
+
+Suite *unit_testing()
+{
+    Suite *unit = suite_create("NumaTopology Unit Testing");
+
+    TCase *parse = tcase_create("de::NumaTopology::parse_cpulist Testing");
+    tcase_add_test(parse, t_parse_cpulist);
+    suite_add_tcase(unit, parse);
+
+    TCase *cpus = tcase_create("de::NumaTopology::get_cpu Testing");
+    tcase_add_test(cpus, t_explicit_topology);
+    tcase_add_test(cpus, t_get_cpu);
+    suite_add_tcase(unit, cpus);
+
+    TCase *discover = tcase_create("de::NumaTopology::discover Testing");
+    tcase_add_test(discover, t_discover);
+    tcase_add_test(discover, t_discover_sparse);
+    tcase_add_test(discover, t_discover_missing);
+    suite_add_tcase(unit, discover);
+
+    return unit;
+}
+
+int run_unit_tests()
+{
+    int failed = 0;
+    Suite *unit = unit_testing();
+    SRunner *unit_runner = srunner_create(unit);
+
+    srunner_run_all(unit_runner, CK_NORMAL);
+    failed = srunner_ntests_failed(unit_runner);
+    srunner_free(unit_runner);
+
+    return failed;
+}
+
+
+int main()
+{
+    int unit_failed = run_unit_tests();
+
+    return (unit_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}